@@ -38,95 +38,196 @@
 #include "parity.h"
 #include "hardnested/hardnested_bruteforce.h"
 #include "hardnested/hardnested_cpu_dispatch.h"
+#include "hardnested/hardnested_threadpool.h"
 #include "hardnested/tables.h"
 
 #define IGNORE_BITFLIP_THRESHOLD  0.99 // ignore bitflip arrays which have nearly only valid states
 #define MC_AUTH_A 0x60
 #define MC_AUTH_B 0x61
 #define NUM_PART_SUMS                   9 // number of possible partial sum property values
-#define QUEUE_LEN 4
+#define COST_MODEL_SAMPLES 8 // number of samples kept for the time-to-key model
+#define MIN_COST_MODEL_SAMPLES 4
 #define NUM_REFINES 1
+#define SPECULATION_TIME 60.0 // start the speculative brute force when the bitflip candidates take at most this long (s)
+#define SPECULATION_BATCH_TIME 0.5 // brute force time per batch of the speculative brute force (s)
+#define MAX_SUM_A8_FILTERS 7 // secondary first bytes whose Sum(a8) is checked against the candidates
+#define HEALTH_WINDOW 256 // encrypted nonces per acquisition health check
+#define HEALTH_MIN_NEW_RATE 0.1 // minimum fraction of new (1st byte, 2nd byte) pairs per window
+#define HEALTH_MAX_PARITY_ERRORS 0.05 // maximum fraction of nonces with contradicting parity bits per window
+#define HEALTH_FULL_COVERAGE 4096 // encrypted nonces after which all first bytes must have been seen
 #define BITFLIP_2ND_BYTE 0x0200
 #define CHECK_1ST_BYTES 0x01
 #define CHECK_2ND_BYTES 0x02
 
 static uint16_t sums[NUM_SUMS] = {0, 32, 56, 64, 80, 96, 104, 112, 120, 128, 136, 144, 152, 160, 176, 192, 200, 224, 256}; // possible sum property values
 
-static uint32_t num_acquired_nonces = 0;
-static uint64_t start_time = 0;
-static uint16_t effective_bitflip[2][0x400];
-static uint16_t num_effective_bitflips[2] = {0, 0};
-static uint16_t all_effective_bitflip[0x400];
-static uint16_t num_all_effective_bitflips = 0;
-static uint16_t num_1st_byte_effective_bitflips = 0;
-static uint8_t hardnested_stage = CHECK_1ST_BYTES;
-static uint64_t known_target_key;
-static uint32_t test_state[2] = {0, 0};
-static float brute_force_per_second;
-static pthread_mutex_t statelist_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t book_of_work_mutex = PTHREAD_MUTEX_INITIALIZER;
-static uint16_t real_sum_a8 = 0;
-static uint32_t part_sum_count[2][NUM_PART_SUMS][NUM_PART_SUMS];
-static float my_p_K[NUM_SUMS];
-static const float* p_K;
-static uint32_t cuid;
-static noncelist_t nonces[256];
-static uint8_t best_first_bytes[256];
-static uint64_t maximum_states = 0;
-static uint8_t best_first_byte_smallest_bitarray = 0;
-static uint16_t first_byte_Sum = 0;
-static uint16_t first_byte_num = 0;
-static bool write_stats = false;
-static uint32_t* all_bitflips_bitarray[2];
-static uint32_t num_all_bitflips_bitarray[2];
-static bool all_bitflips_bitarray_dirty[2];
-static uint64_t last_sample_clock = 0;
-static uint64_t sample_period = 0;
-static uint64_t num_keys_tested = 0;
-static statelist_t* candidates = NULL;
+// Target independent data. Calculated once and shared by all attacks using the same tables.
+struct hardnested_tables {
+    bool low_memory;
+    bool speculative;                       // brute force the best candidates already while acquiring the nonces
+    float sum_a8_risk;                      // allowed probability of the secondary Sum(a8) filters excluding the key
+    float brute_force_per_second;
+    float generation_cost_per_state;        // measured candidate generation time per expected brute force state (s). Kept across targets
+    // bitflip property bitarrays
+    uint32_t *bitflip_bitarrays[2][0x400];
+    uint32_t count_bitflip_bitarrays[2][0x400];
+    float bitflip_gain[0x400];               // expected relative drop of the states per bitarray AND
+    bool bitflips_available[2][0x400];
+    bool bitflips_allocated[2][0x400];
+    uint16_t bitflip_users[2][0x400];        // low memory mode: threads currently using a decompressed bitarray (of any attack)
+    uint16_t effective_bitflip[2][0x400];
+    uint16_t num_effective_bitflips[2];
+    uint16_t all_effective_bitflip[0x400];
+    uint16_t num_all_effective_bitflips;
+    uint16_t num_1st_byte_effective_bitflips;
+    // sum property bitarrays. The part sum bitarrays are copied for each target (not kept in low memory mode, they are
+    // regenerated from part_sum_idx, PartialSumProperty() / 2 of each 20 bit state, instead)
+    uint8_t *part_sum_idx[2];
+    uint32_t *precalc_part_sum_a0_bitarrays[2][NUM_PART_SUMS];
+    uint32_t *precalc_part_sum_a8_bitarrays[2][NUM_PART_SUMS];
+    uint32_t *sum_a0_bitarrays[2][NUM_SUMS];
+    // hypergeometric probabilities for Sum(a8) estimation
+    double *p_hypergeometric_table[NUM_SUMS];
+};
+
+#define HYPERGEOMETRIC_N 256
+#define TRIANGLE_IDX(n, k) ((uint32_t)(n) * ((n) + 1) / 2 + (k))
+#define TRIANGLE_SIZE TRIANGLE_IDX(HYPERGEOMETRIC_N + 1, 0)
+
+#define NONCE_RING_SIZE 1024 // must be a power of 2
+
+typedef struct nonce_ring_entry {
+    uint32_t nonce_enc;
+    uint8_t par_enc;
+} nonce_ring_entry_t;
+
+struct sl_cache_entry {
+    uint32_t *sl;
+    uint32_t len;
+    work_status_t cache_status;
+};
+
+// Target dependent data of one attack. Owned by the thread(s) working on the attack.
+struct hardnested_ctx {
+    hardnested_tables_t *tables;
+    // Status of target
+    uint8_t targetBLOCK;
+    uint8_t targetKEY;
+    uint32_t cuid;
+    bool key_found;
+    uint64_t found_key;
+    // nonces and their properties
+    uint32_t num_acquired_nonces;
+    uint8_t hardnested_stage;
+    noncelist_t nonces[256];
+    uint8_t best_first_bytes[256];
+    uint8_t best_first_byte_smallest_bitarray;
+    uint16_t first_byte_Sum;
+    uint16_t first_byte_num;
+    uint32_t *all_bitflips_bitarray[2];
+    uint32_t num_all_bitflips_bitarray[2];
+    bool all_bitflips_bitarray_dirty[2];
+    // sum property bitarrays (working copies, reduced during the attack) and statistics
+    uint32_t *part_sum_a0_bitarrays[2][NUM_PART_SUMS];
+    uint32_t *part_sum_a8_bitarrays[2][NUM_PART_SUMS];
+    uint32_t part_sum_count[2][NUM_PART_SUMS][NUM_PART_SUMS];
+    float my_p_K[NUM_SUMS];
+    const float *p_K;
+    uint32_t p_K_generation;
+    double p_T_is_k_table[TRIANGLE_SIZE];
+    uint32_t p_T_is_k_generation[TRIANGLE_SIZE];
+    // nonce acquisition
+    struct nonce_ring {
+        nonce_ring_entry_t entry[NONCE_RING_SIZE];
+        uint32_t head;      // next slot to be written. Written by the reader thread only
+        uint32_t tail;      // next slot to be read. Written by the analysis loop only
+        bool stop;          // set by the analysis loop when enough nonces have been collected
+        bool tag_lost;      // set by the reader thread before it gives up
+        pthread_mutex_t mutex;  // with cond, wakes up the reader when the ring has room again and the analysis loop
+        pthread_cond_t cond;    // when nonces arrived or any of the flags changed
+    } nonce_ring;
+    struct {
+        uint32_t num_samples;           // encrypted nonces received, including the repeated ones
+        uint32_t num_parity_errors;     // ... with parity bits contradicting those of an earlier nonce
+        uint32_t window_samples;        // the counts at the start of the current window
+        uint32_t window_new_nonces;
+        uint32_t window_parity_errors;
+    } health;
+    uint64_t last_sample_clock;
+    uint64_t sample_period;
+    struct {
+        uint32_t num_samples;
+        uint32_t nonces[COST_MODEL_SAMPLES];
+        uint64_t time[COST_MODEL_SAMPLES];
+        float log_brute_force[COST_MODEL_SAMPLES];
+    } cost_model;
+    uint64_t acquisition_end_time;
+    float predicted_time_to_key;
+    // candidate generation and brute force
+    statelist_t *candidates;
+    bf_test_nonces_t bf_test_nonces;
+    uint64_t maximum_states;
+    uint64_t num_keys_tested;
+    bf_run_t *bf_run;               // the brute force run in progress, if any. Under cancel_mutex, like cancelled
+    bool cancelled;                 // by hardnested_cancel(): give up solving
+    uint8_t num_sum_a8_filters;
+    struct sum_a8_filter {
+        uint8_t first_byte;
+        uint8_t common_bits;                    // number of low bits shared with the best first byte
+        uint16_t allowed_odd[NUM_PART_SUMS];    // per even partial sum: the odd partial sums giving the guessed Sum(a8)
+    } sum_a8_filter[MAX_SUM_A8_FILTERS];
+    struct sl_cache_entry sl_cache[NUM_PART_SUMS][NUM_PART_SUMS][2];
+    // tests with a known key
+    uint64_t known_target_key;
+    uint32_t test_state[2];
+    uint16_t real_sum_a8;
+    // progress output
+    uint64_t start_time;
+    uint64_t last_print_time;
+};
+
+// The tables and the attack the current thread is working on. Worker threads bind them on start.
+static THREAD_LOCAL hardnested_tables_t *tables;
+static THREAD_LOCAL hardnested_ctx_t *ctx;
+static pthread_mutex_t generation_cost_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cancel_mutex = PTHREAD_MUTEX_INITIALIZER;
 static char failstr[250] = "";
-static work_status_t book_of_work[NUM_PART_SUMS][NUM_PART_SUMS][NUM_PART_SUMS][NUM_PART_SUMS];
-
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// sum property bitarrays
-
-static uint32_t* part_sum_a0_bitarrays[2][NUM_PART_SUMS];
-static uint32_t* part_sum_a8_bitarrays[2][NUM_PART_SUMS];
-static uint32_t* sum_a0_bitarrays[2][NUM_SUMS];
-
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// bitflip property bitarrays
 
-static uint32_t* bitflip_bitarrays[2][0x400];
-static uint32_t count_bitflip_bitarrays[2][0x400];
 
-// Status of target
-static uint8_t targetBLOCK;
-static uint8_t targetKEY;
+static void bind_ctx(hardnested_ctx_t *attack) {
+    ctx = attack;
+    tables = attack->tables;
+}
 
 
-static bool hard_LOW_MEM;
-static bool bitflips_available[2][0x400];
-static bool bitflips_allocated[2][0x400];
 static pthread_mutex_t bitflip_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
+// release a bitarray obtained by get_bitflip_data(). In low memory mode it is freed when its last user is done.
 void remove_bitflip_data(odd_even_t odd_even, uint16_t bitflip){
+    if (!tables->bitflips_available[odd_even][bitflip]) {
+        return;
+    }
+
     pthread_mutex_lock(&bitflip_mutex);
-    if (hard_LOW_MEM && bitflips_allocated[odd_even][bitflip]) {
-        free_bitarray(bitflip_bitarrays[odd_even][bitflip]);
-        bitflips_allocated[odd_even][bitflip] = false;
+    if (tables->low_memory && --tables->bitflip_users[odd_even][bitflip] == 0 && tables->bitflips_allocated[odd_even][bitflip]) {
+        free_bitarray(tables->bitflip_bitarrays[odd_even][bitflip]);
+        tables->bitflip_bitarrays[odd_even][bitflip] = NULL;
+        tables->bitflips_allocated[odd_even][bitflip] = false;
     }
     pthread_mutex_unlock(&bitflip_mutex);
 }
 
 uint32_t* get_bitflip_data(odd_even_t odd_even, uint16_t bitflip) {
-    if (!bitflips_available[odd_even][bitflip]) {
+    if (!tables->bitflips_available[odd_even][bitflip]) {
         return NULL;
     }
 
     pthread_mutex_lock(&bitflip_mutex);
-    if (hard_LOW_MEM && !bitflips_allocated[odd_even][bitflip]) {
+    if (tables->low_memory) {
+        tables->bitflip_users[odd_even][bitflip]++;
+    }
+    if (tables->low_memory && !tables->bitflips_allocated[odd_even][bitflip]) {
         lzma_stream strm = LZMA_STREAM_INIT;
         bitflip_info p = get_bitflip(odd_even, bitflip);
 
@@ -145,16 +246,15 @@ uint32_t* get_bitflip_data(odd_even_t odd_even, uint16_t bitflip) {
             strm.avail_out = sizeof (uint32_t) * (1 << 19);
             decompress(&strm);
 
-            bitflip_bitarrays[odd_even][bitflip] = bitset;
-            bitflips_allocated[odd_even][bitflip] = true;
+            tables->bitflip_bitarrays[odd_even][bitflip] = bitset;
+            tables->bitflips_allocated[odd_even][bitflip] = true;
         }
         lzma_end(&strm);
     }
+    uint32_t *bitflip_data = tables->bitflip_bitarrays[odd_even][bitflip];
     pthread_mutex_unlock(&bitflip_mutex);
     
-    return bitflip_bitarrays[odd_even][bitflip];
-
-
+    return bitflip_data;
 }
 
 
@@ -203,10 +303,10 @@ static void print_progress_header(void) {
     sprintf(progress_text, "Start using %d threads", num_CPUs());
 #endif
     
-    static uint8_t keyType;
-    if (targetKEY == MC_AUTH_A) {
+    uint8_t keyType;
+    if (ctx->targetKEY == MC_AUTH_A) {
         keyType = 'A';
-    } else if (targetKEY == MC_AUTH_B) {
+    } else if (ctx->targetKEY == MC_AUTH_B) {
         keyType = 'B';
     } else {
         keyType = '?';
@@ -217,17 +317,29 @@ static void print_progress_header(void) {
     PrintAndLog(true, " time    | trg | #nonces | Activity                                                | expected to brute force");
     PrintAndLog(true, "         |     |         |                                                         | #states         | time ");
     PrintAndLog(true, "-------------------------------------------------------------------------------------------------------------");
-    PrintAndLog(true, "       0 | %2d%c |       0 | %-55s |                 |", block_to_sector(targetBLOCK), keyType, progress_text);
+    PrintAndLog(true, "       0 | %2d%c |       0 | %-55s |                 |", block_to_sector(ctx->targetBLOCK), keyType, progress_text);
 }
 
 
-void hardnested_print_progress(uint32_t nonces, char *activity, float brute_force, uint64_t min_diff_print_time, uint8_t trgKeyBlock, uint8_t trgKeyType, bool newline) {
-    static uint64_t last_print_time = 0;
-    static uint8_t keyType;
-    if (msclock() - last_print_time > min_diff_print_time) {
-        last_print_time = msclock();
-        uint64_t total_time = msclock() - start_time;
-        float brute_force_time = brute_force / brute_force_per_second;
+void hardnested_print_progress(hardnested_ctx_t *attack, uint32_t num_nonces, char *activity, float brute_force, uint64_t min_diff_print_time, bool newline) {
+    uint8_t keyType;
+    if (attack == NULL) {   // benchmark
+        return;
+    }
+    // each attack has its own clock and print throttle. Several threads may report on the same attack, of the
+    // throttled reports only the one which advances last_print_time is printed
+    uint64_t now = msclock();
+    uint64_t last_print_time = __atomic_load_n(&attack->last_print_time, __ATOMIC_RELAXED);
+    bool print = true;
+    if (min_diff_print_time == 0) {
+        __atomic_store_n(&attack->last_print_time, now, __ATOMIC_RELAXED);
+    } else {
+        print = now - last_print_time > min_diff_print_time
+                && __atomic_compare_exchange_n(&attack->last_print_time, &last_print_time, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    if (print) {
+        uint64_t total_time = now - attack->start_time;
+        float brute_force_time = brute_force / attack->tables->brute_force_per_second;
         char brute_force_time_string[20];
         if (brute_force_time < 90) {
             sprintf(brute_force_time_string, "%2.0fs", brute_force_time);
@@ -239,15 +351,15 @@ void hardnested_print_progress(uint32_t nonces, char *activity, float brute_forc
             sprintf(brute_force_time_string, "%2.0fd", brute_force_time / (60 * 60 * 24));
         }
 
-        if (trgKeyType == MC_AUTH_A) {
+        if (attack->targetKEY == MC_AUTH_A) {
             keyType = 'A';
-        } else if (trgKeyType == MC_AUTH_B) {
+        } else if (attack->targetKEY == MC_AUTH_B) {
             keyType = 'B';
         } else {
             keyType = '?';
         }
 
-        PrintAndLog(newline, " %7.0f | %2d%c | %7d | %-55s | %15.0f | %5s", (float) total_time / 1000.0, block_to_sector(trgKeyBlock), keyType, nonces, activity, brute_force, brute_force_time_string);
+        PrintAndLog(newline, " %7.0f | %2d%c | %7d | %-55s | %15.0f | %5s", (float) total_time / 1000.0, block_to_sector(attack->targetBLOCK), keyType, num_nonces, activity, brute_force, brute_force_time_string);
     }
 }
 
@@ -274,31 +386,25 @@ static inline uint32_t test_bit24(uint32_t *bitarray, uint32_t index) {
 }
 
 
-static inline uint32_t next_state(uint32_t *bitarray, uint32_t state) {
-    if (++state == 1 << 24) return 1 << 24;
-    uint32_t index = state >> 5;
-    uint_fast8_t bit = state & 0x1f;
-    uint32_t line = bitarray[index] << bit;
-    while (bit <= 0x1f) {
-        if (line & 0x80000000) return state;
-        state++;
-        bit++;
-        line <<= 1;
-    }
-    index++;
-    while (bitarray[index] == 0x00000000 && state < 1 << 24) {
-        index++;
-        state += 0x20;
+// A bitflip property keeps the fraction count / 2^24 of the states of each half it has an effective bitarray for. Its
+// gain is the expected fraction of the states (odd * even) it removes, divided by the number of bitarray ANDs it costs.
+static void calc_bitflip_gain(uint16_t bitflip) {
+    uint8_t num_ands = 0;
+    float remaining = 1.0;
+    for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+        if (tables->count_bitflip_bitarrays[odd_even][bitflip] < (1 << 24)) {
+            num_ands++;
+            remaining *= (float) tables->count_bitflip_bitarrays[odd_even][bitflip] / (1 << 24);
+        }
     }
-    if (state >= 1 << 24) return 1 << 24;
-    return state + __builtin_clz(bitarray[index]);
+    tables->bitflip_gain[bitflip] = num_ands == 0 ? 0.0 : (1.0 - remaining) / num_ands;
 }
 
 
-static int compare_count_bitflip_bitarrays(const void *b1, const void *b2) {
-    uint64_t count1 = (uint64_t)count_bitflip_bitarrays[ODD_STATE][*(uint16_t *)b1] * count_bitflip_bitarrays[EVEN_STATE][*(uint16_t *)b1];
-    uint64_t count2 = (uint64_t)count_bitflip_bitarrays[ODD_STATE][*(uint16_t *)b2] * count_bitflip_bitarrays[EVEN_STATE][*(uint16_t *)b2];
-    return (count1 > count2) - (count2 > count1);
+static int compare_bitflip_gain(const void *b1, const void *b2) {
+    float gain1 = tables->bitflip_gain[*(uint16_t *)b1];
+    float gain2 = tables->bitflip_gain[*(uint16_t *)b2];
+    return (gain1 < gain2) - (gain2 < gain1);
 }
 
 
@@ -308,16 +414,17 @@ static void init_bitflip_bitarrays(void) {
     lzma_stream strm = LZMA_STREAM_INIT;
 
     for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-        num_effective_bitflips[odd_even] = 0;
+        tables->num_effective_bitflips[odd_even] = 0;
         for (uint16_t bitflip = 0x001; bitflip < 0x400; bitflip++) {
-            bitflip_bitarrays[odd_even][bitflip] = NULL;
-            bitflips_available[odd_even][bitflip] = false;
-            bitflips_allocated[odd_even][bitflip] = false;
-            count_bitflip_bitarrays[odd_even][bitflip] = 1 << 24;
+            tables->bitflip_bitarrays[odd_even][bitflip] = NULL;
+            tables->bitflips_available[odd_even][bitflip] = false;
+            tables->bitflips_allocated[odd_even][bitflip] = false;
+            tables->bitflip_users[odd_even][bitflip] = 0;
+            tables->count_bitflip_bitarrays[odd_even][bitflip] = 1 << 24;
             bitflip_info p = get_bitflip(odd_even, bitflip);
             if (p.input_buffer != NULL) {
                 uint32_t count = 0;
-                bitflips_available[odd_even][bitflip] = true;
+                tables->bitflips_available[odd_even][bitflip] = true;
 
                 lzma_init_inflate(&strm, p.input_buffer, p.len, (uint8_t*)&count, sizeof(count));
                 if ((float)count / (1 << 24) < IGNORE_BITFLIP_THRESHOLD) {
@@ -332,59 +439,59 @@ static void init_bitflip_bitarrays(void) {
                     strm.avail_out = sizeof(uint32_t) * (1 << 19);
                     decompress(&strm);
 
-                  effective_bitflip[odd_even][num_effective_bitflips[odd_even]++] = bitflip;
-                  if (hard_LOW_MEM) {
+                  tables->effective_bitflip[odd_even][tables->num_effective_bitflips[odd_even]++] = bitflip;
+                  if (tables->low_memory) {
                     free_bitarray(bitset);
                   } else {
-                    bitflip_bitarrays[odd_even][bitflip] = bitset;  
+                    tables->bitflip_bitarrays[odd_even][bitflip] = bitset;  
                   }
-                  count_bitflip_bitarrays[odd_even][bitflip] = count;
+                  tables->count_bitflip_bitarrays[odd_even][bitflip] = count;
                 }
 				lzma_end(&strm);
             }
         }
-        effective_bitflip[odd_even][num_effective_bitflips[odd_even]] = 0x400; // EndOfList marker
+        tables->effective_bitflip[odd_even][tables->num_effective_bitflips[odd_even]] = 0x400; // EndOfList marker
     }
     uint16_t i = 0;
     uint16_t j = 0;
-    num_all_effective_bitflips = 0;
-    num_1st_byte_effective_bitflips = 0;
-    while (i < num_effective_bitflips[EVEN_STATE] || j < num_effective_bitflips[ODD_STATE]) {
-        if (effective_bitflip[EVEN_STATE][i] < effective_bitflip[ODD_STATE][j]) {
-            all_effective_bitflip[num_all_effective_bitflips++] = effective_bitflip[EVEN_STATE][i];
+    tables->num_all_effective_bitflips = 0;
+    tables->num_1st_byte_effective_bitflips = 0;
+    while (i < tables->num_effective_bitflips[EVEN_STATE] || j < tables->num_effective_bitflips[ODD_STATE]) {
+        if (tables->effective_bitflip[EVEN_STATE][i] < tables->effective_bitflip[ODD_STATE][j]) {
+            tables->all_effective_bitflip[tables->num_all_effective_bitflips++] = tables->effective_bitflip[EVEN_STATE][i];
             i++;
-        } else if (effective_bitflip[EVEN_STATE][i] > effective_bitflip[ODD_STATE][j]) {
-            all_effective_bitflip[num_all_effective_bitflips++] = effective_bitflip[ODD_STATE][j];
+        } else if (tables->effective_bitflip[EVEN_STATE][i] > tables->effective_bitflip[ODD_STATE][j]) {
+            tables->all_effective_bitflip[tables->num_all_effective_bitflips++] = tables->effective_bitflip[ODD_STATE][j];
             j++;
         } else {
-            all_effective_bitflip[num_all_effective_bitflips++] = effective_bitflip[EVEN_STATE][i];
+            tables->all_effective_bitflip[tables->num_all_effective_bitflips++] = tables->effective_bitflip[EVEN_STATE][i];
             i++;
             j++;
         }
-        if (!(all_effective_bitflip[num_all_effective_bitflips - 1] & BITFLIP_2ND_BYTE)) {
-            num_1st_byte_effective_bitflips = num_all_effective_bitflips;
+        if (!(tables->all_effective_bitflip[tables->num_all_effective_bitflips - 1] & BITFLIP_2ND_BYTE)) {
+            tables->num_1st_byte_effective_bitflips = tables->num_all_effective_bitflips;
         }
     }
-    qsort(all_effective_bitflip, num_1st_byte_effective_bitflips, sizeof(uint16_t), compare_count_bitflip_bitarrays);
-    qsort(all_effective_bitflip + num_1st_byte_effective_bitflips, num_all_effective_bitflips - num_1st_byte_effective_bitflips, sizeof(uint16_t), compare_count_bitflip_bitarrays);
-    char progress_text[80];
-    sprintf(progress_text, "Using %d precalculated bitflip state tables", num_all_effective_bitflips);
-    hardnested_print_progress(0, progress_text, (float) (1LL << 47), 0, targetBLOCK, targetKEY, true);
+    for (uint16_t bitflip = 0x001; bitflip < 0x400; bitflip++) {
+        calc_bitflip_gain(bitflip);
+    }
+    qsort(tables->all_effective_bitflip, tables->num_1st_byte_effective_bitflips, sizeof(uint16_t), compare_bitflip_gain);
+    qsort(tables->all_effective_bitflip + tables->num_1st_byte_effective_bitflips, tables->num_all_effective_bitflips - tables->num_1st_byte_effective_bitflips, sizeof(uint16_t), compare_bitflip_gain);
 }
 
 
 static void free_bitflip_bitarrays(void) {
     for (int16_t bitflip = 0x3ff; bitflip > 0x000; bitflip--) {
-        if (hard_LOW_MEM && !bitflips_allocated[ODD_STATE][bitflip]) {
+        if (tables->low_memory && !tables->bitflips_allocated[ODD_STATE][bitflip]) {
             continue;
         }
-        free_bitarray(bitflip_bitarrays[ODD_STATE][bitflip]);
+        free_bitarray(tables->bitflip_bitarrays[ODD_STATE][bitflip]);
     }
     for (int16_t bitflip = 0x3ff; bitflip > 0x000; bitflip--) {
-        if (hard_LOW_MEM && !bitflips_allocated[EVEN_STATE][bitflip]) {
+        if (tables->low_memory && !tables->bitflips_allocated[EVEN_STATE][bitflip]) {
             continue;
         }
-        free_bitarray(bitflip_bitarrays[EVEN_STATE][bitflip]);
+        free_bitarray(tables->bitflip_bitarrays[EVEN_STATE][bitflip]);
     }
 }
 
@@ -413,103 +520,254 @@ static uint16_t PartialSumProperty(uint32_t state, odd_even_t odd_even) {
 }
 
 
-static void init_part_sum_bitarrays(void) {
-    for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-        for (uint16_t part_sum_a0 = 0; part_sum_a0 < NUM_PART_SUMS; part_sum_a0++) {
-            part_sum_a0_bitarrays[odd_even][part_sum_a0] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
-            if (part_sum_a0_bitarrays[odd_even][part_sum_a0] == NULL) {
-                printf("Out of memory error in init_part_suma0_statelists(). Aborting...\n");
-                exit(4);
+#define PART_SUM_CHUNK          (1 << 12)   // states per part_sum_idx task
+#define PART_SUM_WORDS_PER_TASK (1 << 14)   // bitarray words per part_sum_bitarrays task
+
+struct part_sum_idx_args {
+    uint8_t *part_sum_idx;
+    odd_even_t odd_even;
+    uint32_t first_state;
+};
+
+// PartialSumProperty() / 2 of PART_SUM_CHUNK consecutive 20 bit states. The 16 sequences of 4 shifted in bits share
+// their prefixes, i.e. there are only 2 + 4 + 8 + 16 different filter inputs per state (+1 for the odd state). These
+// are evaluated in one batch, two per filter_flags() input.
+static void *part_sum_idx_task(void *x) {
+    struct part_sum_idx_args *args = (struct part_sum_idx_args *)x;
+    uint32_t *input = malloc(sizeof(uint32_t) * 16 * PART_SUM_CHUNK);
+    uint8_t *flags = malloc(16 * PART_SUM_CHUNK);
+    if (input == NULL || flags == NULL) {
+        printf("Out of memory error in part_sum_idx_task(). Aborting...\n");
+        exit(4);
+    }
+
+    // input group 0: the state itself. Group 2^(k-1) + v: the state shifted by k bits, with v ^ 1 shifted in last
+    for (uint32_t i = 0; i < PART_SUM_CHUNK; i++) {
+        uint32_t state = args->first_state + i;
+        input[i] = state >> 1;
+        for (uint16_t k = 1; k <= 4; k++) {
+            for (uint16_t v = 0; v < 1 << (k - 1); v++) {
+                input[((1 << (k - 1)) + v) * PART_SUM_CHUNK + i] = state << (k - 1) | v;
             }
-            clear_bitarray24(part_sum_a0_bitarrays[odd_even][part_sum_a0]);
         }
     }
-    for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-        for (uint32_t state = 0; state < (1 << 20); state++) {
-            uint16_t part_sum_a0 = PartialSumProperty(state, odd_even) / 2;
-            for (uint16_t low_bits = 0; low_bits < 1 << 4; low_bits++) {
-                set_bit24(part_sum_a0_bitarrays[odd_even][part_sum_a0], state << 4 | low_bits);
+    filter_flags(input, flags, 16 * PART_SUM_CHUNK);
+
+    for (uint32_t i = 0; i < PART_SUM_CHUNK; i++) {
+        uint32_t state = args->first_state + i;
+        uint16_t sum = 0;
+        for (uint16_t j = 0; j < 16; j++) {
+            uint16_t part_sum = 0;
+            for (uint16_t k = 1; k <= 4; k++) {
+                uint16_t bits = j >> (4 - k);
+                part_sum ^= flags[((1 << (k - 1)) + (bits >> 1)) * PART_SUM_CHUNK + i] >> (bits & 0x01) & 0x01;
             }
+            if (args->odd_even == ODD_STATE) {
+                part_sum ^= flags[i] >> (state & 0x01) & 0x01;
+                part_sum ^= 1; // XOR 1 cancelled out for the other 8 bits
+            }
+            sum += part_sum;
         }
+        args->part_sum_idx[args->first_state + i] = sum / 2;
     }
 
-    for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-        for (uint16_t part_sum_a8 = 0; part_sum_a8 < NUM_PART_SUMS; part_sum_a8++) {
-            part_sum_a8_bitarrays[odd_even][part_sum_a8] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
-            if (part_sum_a8_bitarrays[odd_even][part_sum_a8] == NULL) {
-                printf("Out of memory error in init_part_suma8_statelists(). Aborting...\n");
-                exit(4);
+    free(flags);
+    free(input);
+    return NULL;
+}
+
+
+static void calc_part_sum_idx(uint8_t *part_sum_idx[2]) {
+    uint32_t num_tasks = 2 * (1 << 20) / PART_SUM_CHUNK;
+    struct part_sum_idx_args *args = malloc(num_tasks * sizeof(*args));
+    if (args == NULL) {
+        printf("Out of memory error in calc_part_sum_idx(). Aborting...\n");
+        exit(4);
+    }
+    for (uint32_t i = 0; i < num_tasks; i++) {
+        args[i].odd_even = i % 2 ? ODD_STATE : EVEN_STATE;
+        args[i].part_sum_idx = part_sum_idx[args[i].odd_even];
+        args[i].first_state = i / 2 * PART_SUM_CHUNK;
+    }
+    hardnested_pool_run(part_sum_idx_task, args, sizeof(*args), num_tasks);
+    free(args);
+}
+
+
+struct part_sum_bitarrays_args {
+    const uint8_t *part_sum_idx;
+    uint32_t **part_sum_a0;                 // NULL if not wanted
+    uint32_t **part_sum_a8;                 // NULL if not wanted
+    uint32_t **sum_a0;                      // NULL if not wanted
+    const uint16_t *sum_a0_masks;           // part sums contributing to each sum_a0, as bitmask
+    uint32_t first_word;
+};
+
+// Fill words [first_word, first_word + PART_SUM_WORDS_PER_TASK) of the (partial) sum bitarrays from part_sum_idx. In
+// the a0 bitarrays a 20 bit state covers a half word (its 4 low bits are free), in the a8 bitarrays it is repeated
+// every 2^15 words (its 4 high bits are free).
+static void *part_sum_bitarrays_task(void *x) {
+    struct part_sum_bitarrays_args *args = (struct part_sum_bitarrays_args *)x;
+    const uint8_t *idx = args->part_sum_idx;
+
+    for (uint32_t w = args->first_word; w < args->first_word + PART_SUM_WORDS_PER_TASK; w++) {
+        uint8_t hi = idx[2 * w];
+        uint8_t lo = idx[2 * w + 1];
+        if (args->part_sum_a0 != NULL) {
+            for (uint16_t part_sum = 0; part_sum < NUM_PART_SUMS; part_sum++) {
+                args->part_sum_a0[part_sum][w] = (hi == part_sum ? 0xffff0000 : 0) | (lo == part_sum ? 0x0000ffff : 0);
             }
-            clear_bitarray24(part_sum_a8_bitarrays[odd_even][part_sum_a8]);
         }
+        if (args->sum_a0 != NULL) {
+            for (uint16_t sum_a0 = 0; sum_a0 < NUM_SUMS; sum_a0++) {
+                uint16_t mask = args->sum_a0_masks[sum_a0];
+                args->sum_a0[sum_a0][w] = (mask >> hi & 0x01 ? 0xffff0000 : 0) | (mask >> lo & 0x01 ? 0x0000ffff : 0);
+            }
+        }
+        if (args->part_sum_a8 != NULL) {
+            uint32_t words[NUM_PART_SUMS] = {0};
+            const uint8_t *states = idx + ((w & 0x7fff) << 5);
+            for (uint16_t bit = 0; bit < 32; bit++) {
+                words[states[bit]] |= 0x80000000 >> bit;
+            }
+            for (uint16_t part_sum = 0; part_sum < NUM_PART_SUMS; part_sum++) {
+                args->part_sum_a8[part_sum][w] = words[part_sum];
+            }
+        }
+    }
+    return NULL;
+}
+
+
+static void fill_part_sum_bitarrays(uint8_t *part_sum_idx[2], uint32_t *part_sum_a0[2][NUM_PART_SUMS], uint32_t *part_sum_a8[2][NUM_PART_SUMS], uint32_t *sum_a0[2][NUM_SUMS]) {
+    uint16_t sum_a0_masks[2][NUM_SUMS] = {{0}};
+    for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
+        for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
+            uint16_t sum_a0_value = 2 * p * (16 - 2 * q) + (16 - 2 * p) * 2 * q;
+            uint16_t sum_a0_idx = 0;
+            while (sums[sum_a0_idx] != sum_a0_value) sum_a0_idx++;
+            sum_a0_masks[EVEN_STATE][sum_a0_idx] |= 1 << q;
+            sum_a0_masks[ODD_STATE][sum_a0_idx] |= 1 << p;
+        }
+    }
+
+    uint32_t tasks_per_odd_even = (1 << 19) / PART_SUM_WORDS_PER_TASK;
+    struct part_sum_bitarrays_args *args = malloc(2 * tasks_per_odd_even * sizeof(*args));
+    if (args == NULL) {
+        printf("Out of memory error in fill_part_sum_bitarrays(). Aborting...\n");
+        exit(4);
+    }
+    for (uint32_t i = 0; i < 2 * tasks_per_odd_even; i++) {
+        odd_even_t odd_even = i % 2 ? ODD_STATE : EVEN_STATE;
+        args[i].part_sum_idx = part_sum_idx[odd_even];
+        args[i].part_sum_a0 = part_sum_a0 == NULL ? NULL : part_sum_a0[odd_even];
+        args[i].part_sum_a8 = part_sum_a8 == NULL ? NULL : part_sum_a8[odd_even];
+        args[i].sum_a0 = sum_a0 == NULL ? NULL : sum_a0[odd_even];
+        args[i].sum_a0_masks = sum_a0_masks[odd_even];
+        args[i].first_word = i / 2 * PART_SUM_WORDS_PER_TASK;
     }
+    hardnested_pool_run(part_sum_bitarrays_task, args, sizeof(*args), 2 * tasks_per_odd_even);
+    free(args);
+}
+
+
+static void calc_part_sum_bitarrays(uint32_t *part_sum_a0[2][NUM_PART_SUMS], uint32_t *part_sum_a8[2][NUM_PART_SUMS]) {
     for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-        for (uint32_t state = 0; state < (1 << 20); state++) {
-            uint16_t part_sum_a8 = PartialSumProperty(state, odd_even) / 2;
-            for (uint16_t high_bits = 0; high_bits < 1 << 4; high_bits++) {
-                set_bit24(part_sum_a8_bitarrays[odd_even][part_sum_a8], state | high_bits << 20);
+        for (uint16_t part_sum_idx = 0; part_sum_idx < NUM_PART_SUMS; part_sum_idx++) {
+            part_sum_a0[odd_even][part_sum_idx] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
+            part_sum_a8[odd_even][part_sum_idx] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
+            if (part_sum_a0[odd_even][part_sum_idx] == NULL || part_sum_a8[odd_even][part_sum_idx] == NULL) {
+                printf("Out of memory error in calc_part_sum_bitarrays(). Aborting...\n");
+                exit(4);
             }
         }
     }
+    fill_part_sum_bitarrays(tables->part_sum_idx, part_sum_a0, part_sum_a8, NULL);
 }
 
 
-static void free_part_sum_bitarrays(void) {
-    for (int16_t part_sum_a8 = (NUM_PART_SUMS - 1); part_sum_a8 >= 0; part_sum_a8--) {
-        free_bitarray(part_sum_a8_bitarrays[ODD_STATE][part_sum_a8]);
+static void free_part_sum_bitarrays_of(uint32_t *part_sum_a0[2][NUM_PART_SUMS], uint32_t *part_sum_a8[2][NUM_PART_SUMS]) {
+    for (int16_t part_sum_a8_idx = (NUM_PART_SUMS - 1); part_sum_a8_idx >= 0; part_sum_a8_idx--) {
+        free_bitarray(part_sum_a8[ODD_STATE][part_sum_a8_idx]);
+        part_sum_a8[ODD_STATE][part_sum_a8_idx] = NULL;
     }
-    for (int16_t part_sum_a8 = (NUM_PART_SUMS - 1); part_sum_a8 >= 0; part_sum_a8--) {
-        free_bitarray(part_sum_a8_bitarrays[EVEN_STATE][part_sum_a8]);
+    for (int16_t part_sum_a8_idx = (NUM_PART_SUMS - 1); part_sum_a8_idx >= 0; part_sum_a8_idx--) {
+        free_bitarray(part_sum_a8[EVEN_STATE][part_sum_a8_idx]);
+        part_sum_a8[EVEN_STATE][part_sum_a8_idx] = NULL;
     }
-    for (int16_t part_sum_a0 = (NUM_PART_SUMS - 1); part_sum_a0 >= 0; part_sum_a0--) {
-        free_bitarray(part_sum_a0_bitarrays[ODD_STATE][part_sum_a0]);
+    for (int16_t part_sum_a0_idx = (NUM_PART_SUMS - 1); part_sum_a0_idx >= 0; part_sum_a0_idx--) {
+        free_bitarray(part_sum_a0[ODD_STATE][part_sum_a0_idx]);
+        part_sum_a0[ODD_STATE][part_sum_a0_idx] = NULL;
     }
-    for (int16_t part_sum_a0 = (NUM_PART_SUMS - 1); part_sum_a0 >= 0; part_sum_a0--) {
-        free_bitarray(part_sum_a0_bitarrays[EVEN_STATE][part_sum_a0]);
+    for (int16_t part_sum_a0_idx = (NUM_PART_SUMS - 1); part_sum_a0_idx >= 0; part_sum_a0_idx--) {
+        free_bitarray(part_sum_a0[EVEN_STATE][part_sum_a0_idx]);
+        part_sum_a0[EVEN_STATE][part_sum_a0_idx] = NULL;
+    }
+}
+
+
+static void init_part_sum_bitarrays(void) {
+    // the working copies are reduced by update_sum_bitarrays() and therefore need to be fresh for each target
+    if (tables->precalc_part_sum_a0_bitarrays[EVEN_STATE][0] == NULL) {
+        calc_part_sum_bitarrays(ctx->part_sum_a0_bitarrays, ctx->part_sum_a8_bitarrays);
+    } else {
+        for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+            for (uint16_t part_sum = 0; part_sum < NUM_PART_SUMS; part_sum++) {
+                ctx->part_sum_a0_bitarrays[odd_even][part_sum] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
+                ctx->part_sum_a8_bitarrays[odd_even][part_sum] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
+                if (ctx->part_sum_a0_bitarrays[odd_even][part_sum] == NULL || ctx->part_sum_a8_bitarrays[odd_even][part_sum] == NULL) {
+                    printf("Out of memory error in init_part_sum_bitarrays(). Aborting...\n");
+                    exit(4);
+                }
+                memcpy(ctx->part_sum_a0_bitarrays[odd_even][part_sum], tables->precalc_part_sum_a0_bitarrays[odd_even][part_sum], sizeof(uint32_t) * (1 << 19));
+                memcpy(ctx->part_sum_a8_bitarrays[odd_even][part_sum], tables->precalc_part_sum_a8_bitarrays[odd_even][part_sum], sizeof(uint32_t) * (1 << 19));
+            }
+        }
     }
+    memset(ctx->part_sum_count, 0, sizeof(ctx->part_sum_count));
+}
+
+
+static void free_part_sum_bitarrays(void) {
+    free_part_sum_bitarrays_of(ctx->part_sum_a0_bitarrays, ctx->part_sum_a8_bitarrays);
 }
 
 
 static void init_sum_bitarrays(void) {
     for (uint16_t sum_a0 = 0; sum_a0 < NUM_SUMS; sum_a0++) {
         for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-            sum_a0_bitarrays[odd_even][sum_a0] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
-            if (sum_a0_bitarrays[odd_even][sum_a0] == NULL) {
+            tables->sum_a0_bitarrays[odd_even][sum_a0] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
+            if (tables->sum_a0_bitarrays[odd_even][sum_a0] == NULL) {
                 printf("Out of memory error in init_sum_bitarrays(). Aborting...\n");
                 exit(4);
             }
-            clear_bitarray24(sum_a0_bitarrays[odd_even][sum_a0]);
-        }
-    }
-    for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
-        for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
-            uint16_t sum_a0 = 2 * p * (16 - 2 * q) + (16 - 2 * p) * 2 * q;
-            uint16_t sum_a0_idx = 0;
-            while (sums[sum_a0_idx] != sum_a0) sum_a0_idx++;
-            bitarray_OR(sum_a0_bitarrays[EVEN_STATE][sum_a0_idx], part_sum_a0_bitarrays[EVEN_STATE][q]);
-            bitarray_OR(sum_a0_bitarrays[ODD_STATE][sum_a0_idx], part_sum_a0_bitarrays[ODD_STATE][p]);
         }
     }
-
+    fill_part_sum_bitarrays(tables->part_sum_idx, NULL, NULL, tables->sum_a0_bitarrays);
 }
 
 
 static void free_sum_bitarrays(void) {
     for (int8_t sum_a0 = NUM_SUMS - 1; sum_a0 >= 0; sum_a0--) {
-        free_bitarray(sum_a0_bitarrays[ODD_STATE][sum_a0]);
-        free_bitarray(sum_a0_bitarrays[EVEN_STATE][sum_a0]);
+        free_bitarray(tables->sum_a0_bitarrays[ODD_STATE][sum_a0]);
+        free_bitarray(tables->sum_a0_bitarrays[EVEN_STATE][sum_a0]);
     }
 }
 
 
 static int add_nonce(uint32_t nonce_enc, uint8_t par_enc) {
     uint8_t first_byte = nonce_enc >> 24;
-    noncelistentry_t *p1 = nonces[first_byte].first;
+    noncelistentry_t *p1 = ctx->nonces[first_byte].first;
     noncelistentry_t *p2 = NULL;
 
+    ctx->health.num_samples++;
+    if (p1 != NULL && (p1->par_enc & 0x08) != (par_enc & 0x08)) { // the 1st byte determines its parity bit
+        ctx->health.num_parity_errors++;
+    }
+
     if (p1 == NULL) { // first nonce with this 1st byte
-        first_byte_num++;
-        first_byte_Sum += evenparity32((nonce_enc & 0xff000000) | (par_enc & 0x08));
+        ctx->first_byte_num++;
+        ctx->first_byte_Sum += evenparity32((nonce_enc & 0xff000000) | (par_enc & 0x08));
     }
 
     while (p1 != NULL && (p1->nonce_enc & 0x00ff0000) < (nonce_enc & 0x00ff0000)) {
@@ -519,17 +777,20 @@ static int add_nonce(uint32_t nonce_enc, uint8_t par_enc) {
 
     if (p1 == NULL) {                                                          // need to add at the end of the list
         if (p2 == NULL) {           // list is empty yet. Add first entry.
-            p2 = nonces[first_byte].first = malloc(sizeof(noncelistentry_t));
+            p2 = ctx->nonces[first_byte].first = malloc(sizeof(noncelistentry_t));
         } else {                    // add new entry at end of existing list.
             p2 = p2->next = malloc(sizeof(noncelistentry_t));
         }
     } else if ((p1->nonce_enc & 0x00ff0000) != (nonce_enc & 0x00ff0000)) {     // found distinct 2nd byte. Need to insert.
         if (p2 == NULL) {           // need to insert at start of list
-            p2 = nonces[first_byte].first = malloc(sizeof(noncelistentry_t));
+            p2 = ctx->nonces[first_byte].first = malloc(sizeof(noncelistentry_t));
         } else {
             p2 = p2->next = malloc(sizeof(noncelistentry_t));
         }
     } else {                                                                   // we have seen this 2nd byte before. Nothing to add or insert.
+        if ((p1->par_enc & 0x04) != (par_enc & 0x04)) {                       // ... which determines its parity bit as well
+            ctx->health.num_parity_errors++;
+        }
         return (0);
     }
 
@@ -538,45 +799,45 @@ static int add_nonce(uint32_t nonce_enc, uint8_t par_enc) {
     p2->nonce_enc = nonce_enc;
     p2->par_enc = par_enc;
 
-    nonces[first_byte].num++;
-    nonces[first_byte].Sum += evenparity32((nonce_enc & 0x00ff0000) | (par_enc & 0x04));
-    nonces[first_byte].sum_a8_guess_dirty = true;   // indicates that we need to recalculate the Sum(a8) probability for this first byte
+    ctx->nonces[first_byte].num++;
+    ctx->nonces[first_byte].Sum += evenparity32((nonce_enc & 0x00ff0000) | (par_enc & 0x04));
+    ctx->nonces[first_byte].sum_a8_guess_dirty = true;   // indicates that we need to recalculate the Sum(a8) probability for this first byte
     return (1); // new nonce added
 }
 
 
 static void init_nonce_memory(void) {
     for (uint16_t i = 0; i < 256; i++) {
-        nonces[i].num = 0;
-        nonces[i].Sum = 0;
-        nonces[i].first = NULL;
+        ctx->nonces[i].num = 0;
+        ctx->nonces[i].Sum = 0;
+        ctx->nonces[i].first = NULL;
         for (uint16_t j = 0; j < NUM_SUMS; j++) {
-            nonces[i].sum_a8_guess[j].sum_a8_idx = j;
-            nonces[i].sum_a8_guess[j].prob = 0.0;
+            ctx->nonces[i].sum_a8_guess[j].sum_a8_idx = j;
+            ctx->nonces[i].sum_a8_guess[j].prob = 0.0;
         }
-        nonces[i].sum_a8_guess_dirty = false;
+        ctx->nonces[i].sum_a8_guess_dirty = false;
         for (uint16_t bitflip = 0x000; bitflip < 0x400; bitflip++) {
-            nonces[i].BitFlips[bitflip] = 0;
+            ctx->nonces[i].BitFlips[bitflip] = 0;
         }
-        nonces[i].states_bitarray[EVEN_STATE] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
-        if (nonces[i].states_bitarray[EVEN_STATE] == NULL) {
+        ctx->nonces[i].states_bitarray[EVEN_STATE] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
+        if (ctx->nonces[i].states_bitarray[EVEN_STATE] == NULL) {
             printf("Out of memory error in init_nonce_memory(). Aborting...\n");
             exit(4);
         }
-        set_bitarray24(nonces[i].states_bitarray[EVEN_STATE]);
-        nonces[i].num_states_bitarray[EVEN_STATE] = 1 << 24;
-        nonces[i].states_bitarray[ODD_STATE] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
-        if (nonces[i].states_bitarray[ODD_STATE] == NULL) {
+        set_bitarray24(ctx->nonces[i].states_bitarray[EVEN_STATE]);
+        ctx->nonces[i].num_states_bitarray[EVEN_STATE] = 1 << 24;
+        ctx->nonces[i].states_bitarray[ODD_STATE] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
+        if (ctx->nonces[i].states_bitarray[ODD_STATE] == NULL) {
             printf("Out of memory error in init_nonce_memory(). Aborting...\n");
             exit(4);
         }
-        set_bitarray24(nonces[i].states_bitarray[ODD_STATE]);
-        nonces[i].num_states_bitarray[ODD_STATE] = 1 << 24;
-        nonces[i].all_bitflips_dirty[EVEN_STATE] = false;
-        nonces[i].all_bitflips_dirty[ODD_STATE] = false;
+        set_bitarray24(ctx->nonces[i].states_bitarray[ODD_STATE]);
+        ctx->nonces[i].num_states_bitarray[ODD_STATE] = 1 << 24;
+        ctx->nonces[i].all_bitflips_dirty[EVEN_STATE] = false;
+        ctx->nonces[i].all_bitflips_dirty[ODD_STATE] = false;
     }
-    first_byte_num = 0;
-    first_byte_Sum = 0;
+    ctx->first_byte_num = 0;
+    ctx->first_byte_Sum = 0;
 }
 
 
@@ -592,86 +853,106 @@ static void free_nonce_list(noncelistentry_t *p) {
 
 static void free_nonces_memory(void) {
     for (uint16_t i = 0; i < 256; i++) {
-        free_nonce_list(nonces[i].first);
+        free_nonce_list(ctx->nonces[i].first);
     }
     for (int i = 255; i >= 0; i--) {
-        free_bitarray(nonces[i].states_bitarray[ODD_STATE]);
-        free_bitarray(nonces[i].states_bitarray[EVEN_STATE]);
+        free_bitarray(ctx->nonces[i].states_bitarray[ODD_STATE]);
+        free_bitarray(ctx->nonces[i].states_bitarray[EVEN_STATE]);
     }
 }
 
 
-static double p_hypergeometric(uint16_t i_K, uint16_t n, uint16_t k) {
-    uint16_t const N = 256;
-    uint16_t K = sums[i_K];
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sum(a8) statistics. The hypergeometric probabilities only depend on (Sum, n, k) with k <= n <= 256 and are
+// tabulated once. The normalizers additionally depend on ctx->p_K and are recalculated lazily when ctx->p_K changes.
+
+static void init_hypergeometric_tables(void) {
+    double log_factorial[HYPERGEOMETRIC_N + 1];
+    log_factorial[0] = 0.0;
+    for (uint16_t i = 1; i <= HYPERGEOMETRIC_N; i++) {
+        log_factorial[i] = log_factorial[i - 1] + log(i);
+    }
 
-    if (n - k > N - K || k > K) return 0.0; // avoids log(x<=0) in calculation below
-    if (k == 0) {
-        // use logarithms to avoid overflow with huge factorials (double type can only hold 170!)
-        double log_result = 0.0;
-        for (int16_t i = N - K; i >= N - K - n + 1; i--) {
-            log_result += log(i);
-        }
-        for (int16_t i = N; i >= N - n + 1; i--) {
-            log_result -= log(i);
+    uint16_t const N = HYPERGEOMETRIC_N;
+    for (uint8_t i_K = 0; i_K < NUM_SUMS; i_K++) {
+        tables->p_hypergeometric_table[i_K] = malloc(TRIANGLE_SIZE * sizeof(double));
+        if (tables->p_hypergeometric_table[i_K] == NULL) {
+            printf("Out of memory error in init_hypergeometric_tables(). Aborting...\n");
+            exit(4);
         }
-        // p_hypergeometric_cache[n][i_K][k] = exp(log_result);
-        return exp(log_result);
-    } else {
-        if (n - k == N - K) { // special case. The published recursion below would fail with a divide by zero exception
-            double log_result = 0.0;
-            for (int16_t i = k + 1; i <= n; i++) {
-                log_result += log(i);
-            }
-            for (int16_t i = K + 1; i <= N; i++) {
-                log_result -= log(i);
+        uint16_t K = sums[i_K];
+        for (uint16_t n = 0; n <= N; n++) {
+            for (uint16_t k = 0; k <= n; k++) {
+                double p = 0.0;
+                if (n - k <= N - K && k <= K) {
+                    // use logarithms to avoid overflow with huge factorials: p = C(K,k) * C(N-K,n-k) / C(N,n)
+                    double log_result = log_factorial[K] - log_factorial[k] - log_factorial[K - k]
+                                        + log_factorial[N - K] - log_factorial[n - k] - log_factorial[N - K - n + k]
+                                        - log_factorial[N] + log_factorial[n] + log_factorial[N - n];
+                    p = exp(log_result);
+                }
+                tables->p_hypergeometric_table[i_K][TRIANGLE_IDX(n, k)] = p;
             }
-            // p_hypergeometric_cache[n][i_K][k] = exp(log_result);
-            return exp(log_result);
-        } else {          // recursion
-            return (p_hypergeometric(i_K, n, k - 1) * (K - k + 1) * (n - k + 1) / (k * (N - K - n + k)));
         }
     }
 }
 
 
+static void free_hypergeometric_tables(void) {
+    for (uint8_t i_K = 0; i_K < NUM_SUMS; i_K++) {
+        free(tables->p_hypergeometric_table[i_K]);
+    }
+}
+
+
+static inline double p_hypergeometric(uint16_t i_K, uint16_t n, uint16_t k) {
+    return tables->p_hypergeometric_table[i_K][TRIANGLE_IDX(n, k)];
+}
+
+
 static float sum_probability(uint16_t i_K, uint16_t n, uint16_t k) {
     if (k > sums[i_K]) return 0.0;
 
-    double p_T_is_k_when_S_is_K = p_hypergeometric(i_K, n, k);
-    double p_S_is_K = p_K[i_K];
-    double p_T_is_k = 0;
-    for (uint16_t i = 0; i < NUM_SUMS; i++) {
-        p_T_is_k += p_K[i] * p_hypergeometric(i, n, k);
+    uint32_t idx = TRIANGLE_IDX(n, k);
+    if (ctx->p_T_is_k_generation[idx] != ctx->p_K_generation) {
+        double p_T_is_k = 0;
+        for (uint16_t i = 0; i < NUM_SUMS; i++) {
+            p_T_is_k += ctx->p_K[i] * p_hypergeometric(i, n, k);
+        }
+        ctx->p_T_is_k_table[idx] = p_T_is_k;
+        ctx->p_T_is_k_generation[idx] = ctx->p_K_generation;
     }
-    return (p_T_is_k_when_S_is_K * p_S_is_K / p_T_is_k);
+
+    double p_T_is_k_when_S_is_K = p_hypergeometric(i_K, n, k);
+    double p_S_is_K = ctx->p_K[i_K];
+    return (p_T_is_k_when_S_is_K * p_S_is_K / ctx->p_T_is_k_table[idx]);
 }
 
 
 static void init_allbitflips_array(void) {
     for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-        uint32_t *bitset = all_bitflips_bitarray[odd_even] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
+        uint32_t *bitset = ctx->all_bitflips_bitarray[odd_even] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1 << 19));
         if (bitset == NULL) {
             printf("Out of memory in init_allbitflips_array(). Aborting...");
             exit(4);
         }
         set_bitarray24(bitset);
-        all_bitflips_bitarray_dirty[odd_even] = false;
-        num_all_bitflips_bitarray[odd_even] = 1 << 24;
+        ctx->all_bitflips_bitarray_dirty[odd_even] = false;
+        ctx->num_all_bitflips_bitarray[odd_even] = 1 << 24;
     }
 }
 
 
 static void update_allbitflips_array(void) {
-    if (hardnested_stage & CHECK_2ND_BYTES) {
+    if (ctx->hardnested_stage & CHECK_2ND_BYTES) {
         for (uint16_t i = 0; i < 256; i++) {
             for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-                if (nonces[i].all_bitflips_dirty[odd_even]) {
-                    uint32_t old_count = num_all_bitflips_bitarray[odd_even];
-                    num_all_bitflips_bitarray[odd_even] = count_bitarray_low20_AND(all_bitflips_bitarray[odd_even], nonces[i].states_bitarray[odd_even]);
-                    nonces[i].all_bitflips_dirty[odd_even] = false;
-                    if (num_all_bitflips_bitarray[odd_even] != old_count) {
-                        all_bitflips_bitarray_dirty[odd_even] = true;
+                if (ctx->nonces[i].all_bitflips_dirty[odd_even]) {
+                    uint32_t old_count = ctx->num_all_bitflips_bitarray[odd_even];
+                    ctx->num_all_bitflips_bitarray[odd_even] = count_bitarray_low20_AND(ctx->all_bitflips_bitarray[odd_even], ctx->nonces[i].states_bitarray[odd_even]);
+                    ctx->nonces[i].all_bitflips_dirty[odd_even] = false;
+                    if (ctx->num_all_bitflips_bitarray[odd_even] != old_count) {
+                        ctx->all_bitflips_bitarray_dirty[odd_even] = true;
                     }
                 }
             }
@@ -681,20 +962,20 @@ static void update_allbitflips_array(void) {
 
 
 static uint32_t estimated_num_states_part_sum_coarse(uint16_t part_sum_a0_idx, uint16_t part_sum_a8_idx, odd_even_t odd_even) {
-    return part_sum_count[odd_even][part_sum_a0_idx][part_sum_a8_idx];
+    return ctx->part_sum_count[odd_even][part_sum_a0_idx][part_sum_a8_idx];
 }
 
 
 static uint32_t estimated_num_states_part_sum(uint8_t first_byte, uint16_t part_sum_a0_idx, uint16_t part_sum_a8_idx, odd_even_t odd_even) {
     if (odd_even == ODD_STATE) {
-        return count_bitarray_AND3(part_sum_a0_bitarrays[odd_even][part_sum_a0_idx],
-                                   part_sum_a8_bitarrays[odd_even][part_sum_a8_idx],
-                                   nonces[first_byte].states_bitarray[odd_even]);
+        return count_bitarray_AND3(ctx->part_sum_a0_bitarrays[odd_even][part_sum_a0_idx],
+                                   ctx->part_sum_a8_bitarrays[odd_even][part_sum_a8_idx],
+                                   ctx->nonces[first_byte].states_bitarray[odd_even]);
     } else {
-        return count_bitarray_AND4(part_sum_a0_bitarrays[odd_even][part_sum_a0_idx],
-                                   part_sum_a8_bitarrays[odd_even][part_sum_a8_idx],
-                                   nonces[first_byte].states_bitarray[odd_even],
-                                   nonces[first_byte ^ 0x80].states_bitarray[odd_even]);
+        return count_bitarray_AND4(ctx->part_sum_a0_bitarrays[odd_even][part_sum_a0_idx],
+                                   ctx->part_sum_a8_bitarrays[odd_even][part_sum_a8_idx],
+                                   ctx->nonces[first_byte].states_bitarray[odd_even],
+                                   ctx->nonces[first_byte ^ 0x80].states_bitarray[odd_even]);
     }
 
 }
@@ -741,38 +1022,39 @@ static uint64_t estimated_num_states_coarse(uint16_t sum_a0, uint16_t sum_a8) {
 
 
 static void update_p_K(void) {
-    if (hardnested_stage & CHECK_2ND_BYTES) {
+    if (ctx->hardnested_stage & CHECK_2ND_BYTES) {
         uint64_t total_count = 0;
-        uint16_t sum_a0 = sums[first_byte_Sum];
+        uint16_t sum_a0 = sums[ctx->first_byte_Sum];
         for (uint8_t sum_a8_idx = 0; sum_a8_idx < NUM_SUMS; sum_a8_idx++) {
             uint16_t sum_a8 = sums[sum_a8_idx];
             total_count += estimated_num_states_coarse(sum_a0, sum_a8);
         }
         for (uint8_t sum_a8_idx = 0; sum_a8_idx < NUM_SUMS; sum_a8_idx++) {
             uint16_t sum_a8 = sums[sum_a8_idx];
-            my_p_K[sum_a8_idx] = (float) estimated_num_states_coarse(sum_a0, sum_a8) / total_count;
+            ctx->my_p_K[sum_a8_idx] = (float) estimated_num_states_coarse(sum_a0, sum_a8) / total_count;
         }
-        p_K = my_p_K;
+        ctx->p_K = ctx->my_p_K;
+        ctx->p_K_generation++; // invalidates the cached normalizers in sum_probability()
     }
 }
 
 
 static void update_sum_bitarrays(odd_even_t odd_even) {
-    if (all_bitflips_bitarray_dirty[odd_even]) {
+    if (ctx->all_bitflips_bitarray_dirty[odd_even]) {
         for (uint8_t part_sum = 0; part_sum < NUM_PART_SUMS; part_sum++) {
-            bitarray_AND(part_sum_a0_bitarrays[odd_even][part_sum], all_bitflips_bitarray[odd_even]);
-            bitarray_AND(part_sum_a8_bitarrays[odd_even][part_sum], all_bitflips_bitarray[odd_even]);
+            bitarray_AND(ctx->part_sum_a0_bitarrays[odd_even][part_sum], ctx->all_bitflips_bitarray[odd_even]);
+            bitarray_AND(ctx->part_sum_a8_bitarrays[odd_even][part_sum], ctx->all_bitflips_bitarray[odd_even]);
         }
         for (uint16_t i = 0; i < 256; i++) {
-            nonces[i].num_states_bitarray[odd_even] = count_bitarray_AND(nonces[i].states_bitarray[odd_even], all_bitflips_bitarray[odd_even]);
+            ctx->nonces[i].num_states_bitarray[odd_even] = count_bitarray_AND(ctx->nonces[i].states_bitarray[odd_even], ctx->all_bitflips_bitarray[odd_even]);
         }
         for (uint8_t part_sum_a0 = 0; part_sum_a0 < NUM_PART_SUMS; part_sum_a0++) {
             for (uint8_t part_sum_a8 = 0; part_sum_a8 < NUM_PART_SUMS; part_sum_a8++) {
-                part_sum_count[odd_even][part_sum_a0][part_sum_a8]
-                += count_bitarray_AND2(part_sum_a0_bitarrays[odd_even][part_sum_a0], part_sum_a8_bitarrays[odd_even][part_sum_a8]);
+                ctx->part_sum_count[odd_even][part_sum_a0][part_sum_a8]
+                += count_bitarray_AND2(ctx->part_sum_a0_bitarrays[odd_even][part_sum_a0], ctx->part_sum_a8_bitarrays[odd_even][part_sum_a8]);
             }
         }
-        all_bitflips_bitarray_dirty[odd_even] = false;
+        ctx->all_bitflips_bitarray_dirty[odd_even] = false;
     }
 }
 
@@ -780,8 +1062,8 @@ static void update_sum_bitarrays(odd_even_t odd_even) {
 static int compare_expected_num_brute_force(const void *b1, const void *b2) {
     uint8_t index1 = *(uint8_t *)b1;
     uint8_t index2 = *(uint8_t *)b2;
-    float score1 = nonces[index1].expected_num_brute_force;
-    float score2 = nonces[index2].expected_num_brute_force;
+    float score1 = ctx->nonces[index1].expected_num_brute_force;
+    float score2 = ctx->nonces[index2].expected_num_brute_force;
     return (score1 > score2) - (score1 < score2);
 }
 
@@ -793,15 +1075,49 @@ static int compare_sum_a8_guess(const void *b1, const void *b2) {
 }
 
 
+// The Sum(a8) guesses are searched in order of their probability per state. This minimizes the expected number of
+// brute forces, whereas going by probability alone would first search a likely but huge guess.
+static float sum_a8_guess_density(const guess_sum_a8_t *guess) {
+    return guess->num_states == 0 ? 0.0 : guess->prob / (float) guess->num_states;
+}
+
+
+static void schedule_sum_a8_guesses(uint8_t first_byte, uint8_t *order) {
+    guess_sum_a8_t *guesses = ctx->nonces[first_byte].sum_a8_guess;
+    for (uint8_t i = 0; i < NUM_SUMS; i++) {
+        uint8_t j = i;
+        while (j > 0 && sum_a8_guess_density(&guesses[order[j - 1]]) < sum_a8_guess_density(&guesses[i])) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+}
+
+
+static void calc_expected_num_brute_force(uint8_t first_byte) {
+    uint8_t order[NUM_SUMS];
+    schedule_sum_a8_guesses(first_byte, order);
+    float prob_all_failed = 1.0;
+    ctx->nonces[first_byte].expected_num_brute_force = 0.0;
+    for (uint8_t i = 0; i < NUM_SUMS; i++) {
+        guess_sum_a8_t *guess = &ctx->nonces[first_byte].sum_a8_guess[order[i]];
+        ctx->nonces[first_byte].expected_num_brute_force += guess->prob * (float) guess->num_states / 2.0;
+        prob_all_failed -= guess->prob;
+        ctx->nonces[first_byte].expected_num_brute_force += prob_all_failed * (float) guess->num_states / 2.0;
+    }
+}
+
+
 static float check_smallest_bitflip_bitarrays(void) {
     uint64_t smallest = 1LL << 48;
     // initialize best_first_bytes, do a rough estimation on remaining states
     for (uint16_t i = 0; i < 256; i++) {
-        uint32_t num_odd = nonces[i].num_states_bitarray[ODD_STATE];
-        uint32_t num_even = nonces[i].num_states_bitarray[EVEN_STATE]; // * (float)nonces[i^0x80].num_states_bitarray[EVEN_STATE] / num_all_bitflips_bitarray[EVEN_STATE];
+        uint32_t num_odd = ctx->nonces[i].num_states_bitarray[ODD_STATE];
+        uint32_t num_even = ctx->nonces[i].num_states_bitarray[EVEN_STATE]; // * (float)ctx->nonces[i^0x80].num_states_bitarray[EVEN_STATE] / ctx->num_all_bitflips_bitarray[EVEN_STATE];
         if ((uint64_t)num_odd * num_even < smallest) {
             smallest = (uint64_t)num_odd * num_even;
-            best_first_byte_smallest_bitarray = i;
+            ctx->best_first_byte_smallest_bitarray = i;
         }
     }
     return (float)smallest / 2.0;
@@ -811,19 +1127,13 @@ static float check_smallest_bitflip_bitarrays(void) {
 static void update_expected_brute_force(uint8_t best_byte) {
     float total_prob = 0.0;
     for (uint8_t i = 0; i < NUM_SUMS; i++) {
-        total_prob += nonces[best_byte].sum_a8_guess[i].prob;
+        total_prob += ctx->nonces[best_byte].sum_a8_guess[i].prob;
     }
     // linear adjust probabilities to result in total_prob = 1.0;
     for (uint8_t i = 0; i < NUM_SUMS; i++) {
-        nonces[best_byte].sum_a8_guess[i].prob /= total_prob;
-    }
-    float prob_all_failed = 1.0;
-    nonces[best_byte].expected_num_brute_force = 0.0;
-    for (uint8_t i = 0; i < NUM_SUMS; i++) {
-        nonces[best_byte].expected_num_brute_force += nonces[best_byte].sum_a8_guess[i].prob * (float)nonces[best_byte].sum_a8_guess[i].num_states / 2.0;
-        prob_all_failed -= nonces[best_byte].sum_a8_guess[i].prob;
-        nonces[best_byte].expected_num_brute_force += prob_all_failed * (float)nonces[best_byte].sum_a8_guess[i].num_states / 2.0;
+        ctx->nonces[best_byte].sum_a8_guess[i].prob /= total_prob;
     }
+    calc_expected_num_brute_force(best_byte);
     return;
 }
 
@@ -832,119 +1142,154 @@ static float sort_best_first_bytes(void) {
     // initialize best_first_bytes, do a rough estimation on remaining states for each Sum_a8 property
     // and the expected number of states to brute force
     for (uint16_t i = 0; i < 256; i++) {
-        best_first_bytes[i] = i;
-        float prob_all_failed = 1.0;
-        nonces[i].expected_num_brute_force = 0.0;
+        ctx->best_first_bytes[i] = i;
         for (uint8_t j = 0; j < NUM_SUMS; j++) {
-            nonces[i].sum_a8_guess[j].num_states = estimated_num_states_coarse(sums[first_byte_Sum], sums[nonces[i].sum_a8_guess[j].sum_a8_idx]);
-            nonces[i].expected_num_brute_force += nonces[i].sum_a8_guess[j].prob * (float) nonces[i].sum_a8_guess[j].num_states / 2.0;
-            prob_all_failed -= nonces[i].sum_a8_guess[j].prob;
-            nonces[i].expected_num_brute_force += prob_all_failed * (float) nonces[i].sum_a8_guess[j].num_states / 2.0;
+            ctx->nonces[i].sum_a8_guess[j].num_states = estimated_num_states_coarse(sums[ctx->first_byte_Sum], sums[ctx->nonces[i].sum_a8_guess[j].sum_a8_idx]);
         }
+        calc_expected_num_brute_force(i);
     }
 
     // sort based on expected number of states to brute force
-    qsort(best_first_bytes, 256, 1, compare_expected_num_brute_force);
+    qsort(ctx->best_first_bytes, 256, 1, compare_expected_num_brute_force);
 
     // refine scores for the best:
     for (uint16_t i = 0; i < NUM_REFINES; i++) {
-        uint16_t first_byte = best_first_bytes[i];
-        for (uint8_t j = 0; j < NUM_SUMS && nonces[first_byte].sum_a8_guess[j].prob > 0.05; j++) {
-            nonces[first_byte].sum_a8_guess[j].num_states = estimated_num_states(first_byte, sums[first_byte_Sum], sums[nonces[first_byte].sum_a8_guess[j].sum_a8_idx]);
-        }
-
-        float prob_all_failed = 1.0;
-        nonces[first_byte].expected_num_brute_force = 0.0;
-        for (uint8_t j = 0; j < NUM_SUMS; j++) {
-            nonces[first_byte].expected_num_brute_force += nonces[first_byte].sum_a8_guess[j].prob * (float)nonces[first_byte].sum_a8_guess[j].num_states / 2.0;
-            prob_all_failed -= nonces[first_byte].sum_a8_guess[j].prob;
-            nonces[first_byte].expected_num_brute_force += prob_all_failed * (float)nonces[first_byte].sum_a8_guess[j].num_states / 2.0;
+        uint16_t first_byte = ctx->best_first_bytes[i];
+        for (uint8_t j = 0; j < NUM_SUMS && ctx->nonces[first_byte].sum_a8_guess[j].prob > 0.05; j++) {
+            ctx->nonces[first_byte].sum_a8_guess[j].num_states = estimated_num_states(first_byte, sums[ctx->first_byte_Sum], sums[ctx->nonces[first_byte].sum_a8_guess[j].sum_a8_idx]);
         }
+        calc_expected_num_brute_force(first_byte);
     }
 
     // copy best byte to front:
     float least_expected_brute_force = (1LL << 48);
     uint8_t best_byte = 0;
     for (uint16_t i = 0; i < 10; i++) {
-        uint16_t first_byte = best_first_bytes[i];
-        if (nonces[first_byte].expected_num_brute_force < least_expected_brute_force) {
-            least_expected_brute_force = nonces[first_byte].expected_num_brute_force;
+        uint16_t first_byte = ctx->best_first_bytes[i];
+        if (ctx->nonces[first_byte].expected_num_brute_force < least_expected_brute_force) {
+            least_expected_brute_force = ctx->nonces[first_byte].expected_num_brute_force;
             best_byte = i;
         }
     }
     if (best_byte != 0) {
-        uint8_t tmp = best_first_bytes[0];
-        best_first_bytes[0] = best_first_bytes[best_byte];
-        best_first_bytes[best_byte] = tmp;
+        uint8_t tmp = ctx->best_first_bytes[0];
+        ctx->best_first_bytes[0] = ctx->best_first_bytes[best_byte];
+        ctx->best_first_bytes[best_byte] = tmp;
     }
-    return nonces[best_first_bytes[0]].expected_num_brute_force;
+    return ctx->nonces[ctx->best_first_bytes[0]].expected_num_brute_force;
+}
+
+
+static void init_cost_model(void) {
+    ctx->cost_model.num_samples = 0;
 }
 
 
-static float update_reduction_rate(float last, bool init) {
-    static float queue[QUEUE_LEN];
+static float effective_brute_force_rate(void) {
+    // brute force rate including the time needed to generate the candidates
+    pthread_mutex_lock(&generation_cost_mutex);
+    float generation_cost_per_state = tables->generation_cost_per_state;
+    pthread_mutex_unlock(&generation_cost_mutex);
+    return 1.0 / (1.0 / tables->brute_force_per_second + generation_cost_per_state);
+}
 
-    for (uint16_t i = 0; i < QUEUE_LEN - 1; i++) {
-        if (init) {
-            queue[i] = (float)(1LL << 48);
-        } else {
-            queue[i] = queue[i + 1];
-        }
+
+static void update_generation_cost(uint64_t generation_time, float expected_brute_force) {
+    if (expected_brute_force < 1.0) {
+        return;
     }
-    if (init) {
-        queue[QUEUE_LEN - 1] = (float)(1LL << 48);
+    float cost = (float) generation_time / 1000.0 / expected_brute_force;
+    pthread_mutex_lock(&generation_cost_mutex);
+    if (tables->generation_cost_per_state == 0.0) {
+        tables->generation_cost_per_state = cost;
     } else {
-        queue[QUEUE_LEN - 1] = last;
+        tables->generation_cost_per_state = (tables->generation_cost_per_state + cost) / 2;
+    }
+    pthread_mutex_unlock(&generation_cost_mutex);
+}
+
+
+static bool update_cost_model(float brute_forces) {
+    // The expected total time to key is T(n) = t_acquire(n) + brute_forces(n) / effective_brute_force_rate.
+    // Acquiring more nonces pays off as long as dT/dn < 0, i.e. as long as the brute force time saved by one
+    // more nonce exceeds the time needed to acquire it.
+    uint32_t idx = ctx->cost_model.num_samples % COST_MODEL_SAMPLES;
+    ctx->cost_model.nonces[idx] = ctx->num_acquired_nonces;
+    ctx->cost_model.time[idx] = msclock();
+    ctx->cost_model.log_brute_force[idx] = log(brute_forces);
+    ctx->cost_model.num_samples++;
+
+    uint32_t n = MIN(ctx->cost_model.num_samples, COST_MODEL_SAMPLES);
+    if (n < MIN_COST_MODEL_SAMPLES) {
+        return false;
     }
 
-    // linear regression
-    float avg_y = 0.0;
+    // linear regression of log(brute_forces) over the number of nonces gives the relative reduction per nonce
     float avg_x = 0.0;
-    for (uint16_t i = 0; i < QUEUE_LEN; i++) {
-        avg_x += i;
-        avg_y += queue[i];
+    float avg_y = 0.0;
+    for (uint32_t i = 0; i < n; i++) {
+        avg_x += ctx->cost_model.nonces[i];
+        avg_y += ctx->cost_model.log_brute_force[i];
     }
-    avg_x /= QUEUE_LEN;
-    avg_y /= QUEUE_LEN;
+    avg_x /= n;
+    avg_y /= n;
 
     float dev_xy = 0.0;
     float dev_x2 = 0.0;
-    for (uint16_t i = 0; i < QUEUE_LEN; i++) {
-        dev_xy += (i - avg_x) * (queue[i] - avg_y);
-        dev_x2 += (i - avg_x) * (i - avg_x);
+    for (uint32_t i = 0; i < n; i++) {
+        dev_xy += (ctx->cost_model.nonces[i] - avg_x) * (ctx->cost_model.log_brute_force[i] - avg_y);
+        dev_x2 += (ctx->cost_model.nonces[i] - avg_x) * (ctx->cost_model.nonces[i] - avg_x);
+    }
+    if (dev_x2 == 0.0) {
+        return false;
+    }
+    float log_reduction_per_nonce = -1.0 * dev_xy / dev_x2;
+    if (log_reduction_per_nonce <= 0.0) {
+        return false; // no reduction (plateau, or a Sum(a8) re-estimation raised the estimate). Keep acquiring
     }
 
-    float reduction_rate = -1.0 * dev_xy / dev_x2;  // the negative slope of the linear regression
+    // nonce acquisition rate over the same window
+    uint32_t oldest = ctx->cost_model.num_samples % COST_MODEL_SAMPLES;
+    if (ctx->cost_model.num_samples < COST_MODEL_SAMPLES) {
+        oldest = 0;
+    }
+    uint64_t window_time = ctx->cost_model.time[idx] - ctx->cost_model.time[oldest];
+    uint32_t window_nonces = ctx->cost_model.nonces[idx] - ctx->cost_model.nonces[oldest];
+    if (window_time == 0 || window_nonces == 0) {
+        return false;
+    }
+    float nonces_per_second = (float) window_nonces * 1000.0 / window_time;
 
-    return reduction_rate;
+    // brute force states saved per second of further acquisition vs. states brute forced per second
+    float saved_per_second = log_reduction_per_nonce * brute_forces * nonces_per_second;
+    return (saved_per_second < effective_brute_force_rate());
 }
 
 
 static bool shrink_key_space(float *brute_forces) {
     float brute_forces1 = check_smallest_bitflip_bitarrays();
     float brute_forces2 = (float)(1LL << 47);
-    if (hardnested_stage & CHECK_2ND_BYTES) {
+    if (ctx->hardnested_stage & CHECK_2ND_BYTES) {
         brute_forces2 = sort_best_first_bytes();
     }
     *brute_forces = MIN(brute_forces1, brute_forces2);
-    float reduction_rate = update_reduction_rate(*brute_forces, false);
+    bool minimum_reached = update_cost_model(*brute_forces);
 
-    return ((hardnested_stage & CHECK_2ND_BYTES) &&
-            reduction_rate >= 0.0 &&
-            (reduction_rate < brute_force_per_second * (float)sample_period / 1000.0  || *brute_forces < 0xF00000));
+    return ((ctx->hardnested_stage & CHECK_2ND_BYTES) &&
+            (minimum_reached || *brute_forces < 0xF00000));
 }
 
 
 static void estimate_sum_a8(void) {
-    if (first_byte_num == 256) {
+    if (ctx->first_byte_num == 256) {
         for (uint16_t i = 0; i < 256; i++) {
-            if (nonces[i].sum_a8_guess_dirty) {
+            if (ctx->nonces[i].sum_a8_guess_dirty) {
                 for (uint16_t j = 0; j < NUM_SUMS; j++) {
-                    uint16_t sum_a8_idx = nonces[i].sum_a8_guess[j].sum_a8_idx;
-                    nonces[i].sum_a8_guess[j].prob = sum_probability(sum_a8_idx, nonces[i].num, nonces[i].Sum);
+                    uint16_t sum_a8_idx = ctx->nonces[i].sum_a8_guess[j].sum_a8_idx;
+                    ctx->nonces[i].sum_a8_guess[j].prob = sum_probability(sum_a8_idx, ctx->nonces[i].num, ctx->nonces[i].Sum);
                 }
-                qsort(nonces[i].sum_a8_guess, NUM_SUMS, sizeof(guess_sum_a8_t), compare_sum_a8_guess);
-                nonces[i].sum_a8_guess_dirty = false;
+                qsort(ctx->nonces[i].sum_a8_guess, NUM_SUMS, sizeof(guess_sum_a8_t), compare_sum_a8_guess);
+                ctx->nonces[i].sum_a8_guess_dirty = false;
             }
         }
     }
@@ -952,7 +1297,7 @@ static void estimate_sum_a8(void) {
 
 
 static noncelistentry_t *SearchFor2ndByte(uint8_t b1, uint8_t b2) {
-    noncelistentry_t *p = nonces[b1].first;
+    noncelistentry_t *p = ctx->nonces[b1].first;
     while (p != NULL) {
         if ((p->nonce_enc >> 16 & 0xff) == b2) {
             return p;
@@ -964,9 +1309,108 @@ static noncelistentry_t *SearchFor2ndByte(uint8_t b1, uint8_t b2) {
 
 
 static bool timeout(void) {
-    return (msclock() > last_sample_clock + sample_period);
+    return (msclock() > ctx->last_sample_clock + ctx->sample_period);
+}
+
+struct bitflip_thread_args {
+    hardnested_ctx_t *ctx;
+    uint8_t first_byte;
+    uint8_t last_byte;
+    bool time_budget;
+    uint16_t bitflips_to_go;
+};
+
+
+static void apply_bitflip(uint16_t byte, uint16_t bitflip) {
+    ctx->nonces[byte].BitFlips[bitflip] = 1;
+    for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+        uint32_t *bitflip_data = get_bitflip_data(odd_even, bitflip);
+        if (bitflip_data != NULL) {
+            uint32_t old_count = ctx->nonces[byte].num_states_bitarray[odd_even];
+            ctx->nonces[byte].num_states_bitarray[odd_even] = count_bitarray_AND(ctx->nonces[byte].states_bitarray[odd_even], bitflip_data);
+            if (ctx->nonces[byte].num_states_bitarray[odd_even] != old_count) {
+                ctx->nonces[byte].all_bitflips_dirty[odd_even] = true;
+            }
+        }
+        remove_bitflip_data(odd_even, bitflip);
+    }
+}
+
+
+// whether the nonces show the Bit Flip Property bitflip of first byte byte, which is not yet applied
+static bool has_1st_byte_bitflip(uint16_t byte, uint16_t bitflip) {
+    if (ctx->nonces[byte].BitFlips[bitflip] == 0 && ctx->nonces[byte].BitFlips[bitflip ^ 0x100] == 0
+            && ctx->nonces[byte].first != NULL && ctx->nonces[byte ^ (bitflip & 0xff)].first != NULL) {
+        uint8_t parity1 = (ctx->nonces[byte].first->par_enc) >> 3;                     // parity of first byte
+        uint8_t parity2 = (ctx->nonces[byte ^ (bitflip & 0xff)].first->par_enc) >> 3;  // parity of nonce with bits flipped
+        return (parity1 == parity2 && !(bitflip & 0x100))          // bitflip
+               || (parity1 != parity2 && (bitflip & 0x100));       // not bitflip
+    }
+    return false;
+}
+
+
+// whether the nonces show the Bit Flip Property bitflip of the 2nd bytes following first byte byte
+static bool has_2nd_byte_bitflip(uint16_t byte, uint16_t bitflip) {
+    for (uint16_t j = 0; j < 256; j++) { // for each 2nd Byte
+        noncelistentry_t *byte1 = SearchFor2ndByte(byte, j);
+        noncelistentry_t *byte2 = SearchFor2ndByte(byte, j^(bitflip & 0xff));
+        if (byte1 != NULL && byte2 != NULL) {
+            uint8_t parity1 = byte1->par_enc >> 2 & 0x01; // parity of 2nd byte
+            uint8_t parity2 = byte2->par_enc >> 2 & 0x01; // parity of 2nd byte with bits flipped
+            if ((parity1 == parity2 && !(bitflip & 0x100)) // bitflip
+                    || (parity1 != parity2 && (bitflip & 0x100))) { // not bitflip
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+// Apply the bitflip properties all_effective_bitflip[first_idx..end_idx) to the thread's bytes. Each byte takes them
+// in the order of all_effective_bitflip, i.e. by their gain. The next one always goes to the byte where it is expected
+// to remove the most states (gain * odd * even states): a byte with few states left gains little from another AND.
+// Returns the number of (byte, bitflip) checks which didn't make it within the time budget.
+static uint32_t apply_bitflips(struct bitflip_thread_args *args, uint16_t first_idx, uint16_t end_idx, bool second_byte) {
+    uint16_t next_idx[256];
+    for (uint16_t i = args->first_byte; i <= args->last_byte; i++) {
+        next_idx[i] = first_idx;
+    }
+    while (true) {
+        uint16_t best_byte = 256;
+        float best_drop = -1.0;
+        for (uint16_t i = args->first_byte; i <= args->last_byte; i++) {
+            // skip what can't be applied now, 2nd bytes are checked when they are due only (it takes a search)
+            while (next_idx[i] < end_idx && (second_byte ? ctx->nonces[i].BitFlips[tables->all_effective_bitflip[next_idx[i]]] != 0
+                                                           : !has_1st_byte_bitflip(i, tables->all_effective_bitflip[next_idx[i]]))) {
+                next_idx[i]++;
+            }
+            if (next_idx[i] == end_idx) continue;
+            float drop = (float) ctx->nonces[i].num_states_bitarray[ODD_STATE] * ctx->nonces[i].num_states_bitarray[EVEN_STATE] * tables->bitflip_gain[tables->all_effective_bitflip[next_idx[i]]];
+            if (drop > best_drop) {
+                best_drop = drop;
+                best_byte = i;
+            }
+        }
+        if (best_byte == 256) {
+            return 0;
+        }
+        if (args->time_budget && timeout()) {
+            uint32_t to_go = 0;
+            for (uint16_t i = args->first_byte; i <= args->last_byte; i++) {
+                to_go += end_idx - next_idx[i];
+            }
+            return to_go;
+        }
+        uint16_t bitflip = tables->all_effective_bitflip[next_idx[best_byte]++];
+        if (!second_byte || has_2nd_byte_bitflip(best_byte, bitflip)) {
+            apply_bitflip(best_byte, bitflip);
+        }
+    }
 }
 
+
 static void
 #ifdef __has_attribute
 #if __has_attribute(force_align_arg_pointer)
@@ -974,77 +1418,20 @@ __attribute__((force_align_arg_pointer))
 #endif
 #endif
 * check_for_BitFlipProperties_thread(void *args) {
-    uint8_t first_byte = ((uint8_t *) args)[0];
-    uint8_t last_byte = ((uint8_t *) args)[1];
-    uint8_t time_budget = ((uint8_t *) args)[2];
-
-    if (hardnested_stage & CHECK_1ST_BYTES) {
-        for (uint16_t bitflip_idx = 0; bitflip_idx < num_1st_byte_effective_bitflips; bitflip_idx++) {
-            uint16_t bitflip = all_effective_bitflip[bitflip_idx];
-            if (time_budget & timeout()) {  
-                return NULL;
-            }
-            for (uint16_t i = first_byte; i <= last_byte; i++) {
-                if (nonces[i].BitFlips[bitflip] == 0 && nonces[i].BitFlips[bitflip ^ 0x100] == 0
-                        && nonces[i].first != NULL && nonces[i ^ (bitflip & 0xff)].first != NULL) {
-                    uint8_t parity1 = (nonces[i].first->par_enc) >> 3;                  // parity of first byte
-                    uint8_t parity2 = (nonces[i ^ (bitflip & 0xff)].first->par_enc) >> 3; // parity of nonce with bits flipped
-                    if ((parity1 == parity2 && !(bitflip & 0x100))          // bitflip
-                            || (parity1 != parity2 && (bitflip & 0x100))) {     // not bitflip
-                        nonces[i].BitFlips[bitflip] = 1;
-                        for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-                            if (get_bitflip_data(odd_even, bitflip) != NULL) {
-                                uint32_t old_count = nonces[i].num_states_bitarray[odd_even];
-                                nonces[i].num_states_bitarray[odd_even] = count_bitarray_AND(nonces[i].states_bitarray[odd_even], get_bitflip_data(odd_even, bitflip));
-                                if (nonces[i].num_states_bitarray[odd_even] != old_count) {
-                                    nonces[i].all_bitflips_dirty[odd_even] = true;
-                                }
-                            } 
-                            remove_bitflip_data(odd_even, bitflip);
-                        }
-                    }
-                }
-            }
-            ((uint8_t *) args)[1] = num_1st_byte_effective_bitflips - bitflip_idx - 1; // bitflips still to go in stage 1
+    struct bitflip_thread_args *thread_args = (struct bitflip_thread_args *) args;
+    bind_ctx(thread_args->ctx);
+
+    if (ctx->hardnested_stage & CHECK_1ST_BYTES) {
+        uint32_t to_go = apply_bitflips(thread_args, 0, tables->num_1st_byte_effective_bitflips, false);
+        if (to_go != 0) {
+            thread_args->bitflips_to_go = MIN(to_go, 0xffff); // bitflips still to go in stage 1
+            return NULL;
         }
     }
-    ((uint8_t *) args)[1] = 0; // stage 1 definitely completed
+    thread_args->bitflips_to_go = 0; // stage 1 definitely completed
 
-    if (hardnested_stage & CHECK_2ND_BYTES) {
-        for (uint16_t bitflip_idx = num_1st_byte_effective_bitflips; bitflip_idx < num_all_effective_bitflips; bitflip_idx++) {
-            uint16_t bitflip = all_effective_bitflip[bitflip_idx];
-            if (time_budget & timeout()) {
-                return NULL;
-            }
-            for (uint16_t i = first_byte; i <= last_byte; i++) {
-                // Check for Bit Flip Property of 2nd bytes
-                if (nonces[i].BitFlips[bitflip] == 0) {
-                    for (uint16_t j = 0; j < 256; j++) { // for each 2nd Byte
-                        noncelistentry_t *byte1 = SearchFor2ndByte(i, j);
-                        noncelistentry_t *byte2 = SearchFor2ndByte(i, j^(bitflip & 0xff));
-                        if (byte1 != NULL && byte2 != NULL) {
-                            uint8_t parity1 = byte1->par_enc >> 2 & 0x01; // parity of 2nd byte
-                            uint8_t parity2 = byte2->par_enc >> 2 & 0x01; // parity of 2nd byte with bits flipped
-                            if ((parity1 == parity2 && !(bitflip & 0x100)) // bitflip
-                                    || (parity1 != parity2 && (bitflip & 0x100))) { // not bitflip
-                                nonces[i].BitFlips[bitflip] = 1;
-                                for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-                                    if (get_bitflip_data(odd_even, bitflip) != NULL) {
-                                        uint32_t old_count = nonces[i].num_states_bitarray[odd_even];
-                                        nonces[i].num_states_bitarray[odd_even] = count_bitarray_AND(nonces[i].states_bitarray[odd_even], get_bitflip_data(odd_even, bitflip));
-                                        if (nonces[i].num_states_bitarray[odd_even] != old_count) {
-                                            nonces[i].all_bitflips_dirty[odd_even] = true;
-                                        }
-                                    }
-                                    remove_bitflip_data(odd_even, bitflip);
-                                }
-                                break;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+    if (ctx->hardnested_stage & CHECK_2ND_BYTES) {
+        apply_bitflips(thread_args, tables->num_1st_byte_effective_bitflips, tables->num_all_effective_bitflips, true);
     }
     return NULL;
 }
@@ -1053,41 +1440,30 @@ __attribute__((force_align_arg_pointer))
 static void check_for_BitFlipProperties(bool time_budget) {
     // create and run worker threads
     uint8_t num_core = num_CPUs();
-    pthread_t* thread_id = (pthread_t*)malloc(sizeof(pthread_t) * num_core);
-    uint8_t** args = malloc(num_core * sizeof(*args));
-    for (uint8_t i = 0; i < num_core; i++)
-        args[i] = (uint8_t*)malloc(3 *sizeof(*args[0]));
+    struct bitflip_thread_args *args = malloc(num_core * sizeof(*args));
 
     uint16_t bytes_per_thread = (256 + (num_core / 2)) / num_core;
     for (uint8_t i = 0; i < num_core; i++) {
-          args[i][0] = i * bytes_per_thread;
-          args[i][1] = MIN(args[i][0] + bytes_per_thread - 1, 255);
-          args[i][2] = time_budget;
-    }
-
-    // start threads
-    for (uint8_t i = 0; i < num_core; i++) {
-        pthread_create(&thread_id[i], NULL, check_for_BitFlipProperties_thread, args[i]);
+          args[i].ctx = ctx;
+          args[i].first_byte = MIN(i * bytes_per_thread, 255);
+          args[i].last_byte = MIN(i * bytes_per_thread + bytes_per_thread - 1, 255);
+          args[i].time_budget = time_budget;
+          args[i].bitflips_to_go = 0;
     }
 
-    // wait for threads to terminate:
-    for (uint8_t i = 0; i < num_core; i++) {
-        pthread_join(thread_id[i], NULL);
-    }
-    free(thread_id);
+    // run them on the shared worker pool and wait for them to complete
+    hardnested_pool_run(check_for_BitFlipProperties_thread, args, sizeof(*args), num_core);
 
-    if (hardnested_stage & CHECK_2ND_BYTES) {
-        hardnested_stage &= ~CHECK_1ST_BYTES; // we are done with 1st stage, except...
+    if (ctx->hardnested_stage & CHECK_2ND_BYTES) {
+        ctx->hardnested_stage &= ~CHECK_1ST_BYTES; // we are done with 1st stage, except...
         for (uint16_t i = 0; i < num_core; i++) {
-            if (args[i][1] != 0) {
-                hardnested_stage |= CHECK_1ST_BYTES; // ... when any of the threads didn't complete in time
+            if (args[i].bitflips_to_go != 0) {
+                ctx->hardnested_stage |= CHECK_1ST_BYTES; // ... when any of the threads didn't complete in time
                 break;
             }
         }
     }
 
-    for (uint8_t i = 0; i < num_core; i++)
-            free(args[i]);
     free(args);
 }
 
@@ -1103,185 +1479,96 @@ static void update_nonce_data(bool time_budget) {
 
 
 static void apply_sum_a0(void) {
-    uint32_t old_count = num_all_bitflips_bitarray[EVEN_STATE];
-    num_all_bitflips_bitarray[EVEN_STATE] = count_bitarray_AND(all_bitflips_bitarray[EVEN_STATE], sum_a0_bitarrays[EVEN_STATE][first_byte_Sum]);
-    if (num_all_bitflips_bitarray[EVEN_STATE] != old_count) {
-        all_bitflips_bitarray_dirty[EVEN_STATE] = true;
-    }
-    old_count = num_all_bitflips_bitarray[ODD_STATE];
-    num_all_bitflips_bitarray[ODD_STATE] = count_bitarray_AND(all_bitflips_bitarray[ODD_STATE], sum_a0_bitarrays[ODD_STATE][first_byte_Sum]);
-    if (num_all_bitflips_bitarray[ODD_STATE] != old_count) {
-        all_bitflips_bitarray_dirty[ODD_STATE] = true;
+    uint32_t old_count = ctx->num_all_bitflips_bitarray[EVEN_STATE];
+    ctx->num_all_bitflips_bitarray[EVEN_STATE] = count_bitarray_AND(ctx->all_bitflips_bitarray[EVEN_STATE], tables->sum_a0_bitarrays[EVEN_STATE][ctx->first_byte_Sum]);
+    if (ctx->num_all_bitflips_bitarray[EVEN_STATE] != old_count) {
+        ctx->all_bitflips_bitarray_dirty[EVEN_STATE] = true;
+    }
+    old_count = ctx->num_all_bitflips_bitarray[ODD_STATE];
+    ctx->num_all_bitflips_bitarray[ODD_STATE] = count_bitarray_AND(ctx->all_bitflips_bitarray[ODD_STATE], tables->sum_a0_bitarrays[ODD_STATE][ctx->first_byte_Sum]);
+    if (ctx->num_all_bitflips_bitarray[ODD_STATE] != old_count) {
+        ctx->all_bitflips_bitarray_dirty[ODD_STATE] = true;
+    }
+}
+
+
+// The checks of remaining_bits_match(), done for a state against all 16 states of its aligned block at once. Bit
+// (15 - r) of each lane mask belongs to the block's state r. For the check at state bit k, invariant[k] has the state
+// bit and filter differences (which must equal the byte difference bit for the invariant to hold), invalid[k] the state
+// bit differences (which must equal the byte difference bit for the state to be valid).
+typedef struct {
+    uint16_t invariant[4];
+    uint16_t invalid[4];
+} remaining_bits_lanes_t;
+
+
+static void init_remaining_bits_lanes(uint32_t state1, remaining_bits_lanes_t *lanes) {
+    for (uint_fast8_t state_bit = 0; state_bit < 4; state_bit++) {
+        uint_fast8_t filter1 = filter(state1 >> (4 - state_bit));
+        lanes->invariant[state_bit] = 0;
+        lanes->invalid[state_bit] = 0;
+        for (uint_fast8_t r = 0; r < 16; r++) {
+            uint_fast32_t state2 = (state1 & 0xfffffff0) | r;
+            uint_fast8_t filter_diff = filter1 ^ filter(state2 >> (4 - state_bit)); // difference in filter function
+            uint_fast8_t y12_y13_diff = (state1 ^ state2) & (0xc0 >> state_bit); // difference in state bits 12 and 13
+            uint_fast8_t y13_y16_diff = (state1 ^ state2) & (0x48 >> state_bit); // difference in state bits 13 and 16
+            lanes->invariant[state_bit] |= (evenparity8(y12_y13_diff) ^ filter_diff) << (15 - r);
+            lanes->invalid[state_bit] |= evenparity8(y13_y16_diff) << (15 - r);
+        }
+    }
+}
+
+
+// lanes of the block for which remaining_bits_match(num_common_bits, byte_diff, state1, state2, odd_even) is true
+static inline uint16_t remaining_bits_match_lanes(const remaining_bits_lanes_t *lanes, uint_fast8_t num_common_bits, uint_fast8_t byte_diff, odd_even_t odd_even) {
+    uint16_t undecided = 0xffff;
+    uint16_t valid = 0;
+    // the checks run in the same order as the fallthrough in remaining_bits_match(): where an invariant doesn't hold
+    // the state is valid, where it is an invalid state it is not, the others go on to the next check
+    uint_fast8_t num_checks = odd_even ? 8 : 7;
+    for (uint_fast8_t check = num_common_bits; check < num_checks && undecided; check++) {
+        bool is_invariant = odd_even ? !(check & 0x01) : (check & 0x01);
+        uint_fast8_t bit = odd_even ? check | 0x01 : (check + 1) & ~0x01; // bit j of the byte difference
+        uint_fast8_t state_bit = odd_even ? check / 2 : (check + 1) / 2;
+        if (is_invariant) {
+            uint16_t holds = (byte_diff >> (bit - 1) & 0x01) ? lanes->invariant[state_bit] : ~lanes->invariant[state_bit];
+            valid |= undecided & ~holds;
+            undecided &= holds;
+        } else {
+            uint16_t invalid = (byte_diff >> bit & 0x01) ? ~lanes->invalid[state_bit] : lanes->invalid[state_bit];
+            undecided &= ~invalid;
+        }
     }
+    return valid | undecided;
 }
 
 
-static int acquire_nonces(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType) {
-    last_sample_clock = msclock();
-    sample_period = 2000; // initial rough estimate. Will be refined.
-    hardnested_stage = CHECK_1ST_BYTES;
-    bool acquisition_completed = false;
-    float brute_force;
-    bool reported_suma8 = false;
-
-    num_acquired_nonces = 0;
-
-    int e_sector = block_to_sector(blockNo);
-    int a_sector = block_to_sector(trgBlockNo);
-    pKeys pk = {NULL, 0};
-    bool dumpKeysA = (trgKeyType == MC_AUTH_A ? true : false);
-    //            
-    uint32_t enc_bytes = 0;
-    uint8_t parbits = 0;
-    do {
-        nfc_device_set_property_bool(r.pdi, NP_HANDLE_CRC, true);
-        nfc_device_set_property_bool(r.pdi, NP_HANDLE_PARITY, true);
-        mf_enhanced_auth(e_sector, a_sector, t, r, 0, &pk, 'h', dumpKeysA, &enc_bytes, &parbits);
-        
-        mf_configure(r.pdi);
-        mf_anticollision(t, r);
-        
-        num_acquired_nonces += add_nonce(enc_bytes, parbits);
-        if (first_byte_num == 256) {
-            if (hardnested_stage == CHECK_1ST_BYTES) {
-                for (uint16_t i = 0; i < NUM_SUMS; i++) {
-                    if (first_byte_Sum == sums[i]) {
-                        first_byte_Sum = i;
-                        break;
-                    }
-                }
-                hardnested_stage |= CHECK_2ND_BYTES;
-                apply_sum_a0();
-            }
-            update_nonce_data(true);
-            acquisition_completed = shrink_key_space(&brute_force);
-            if (!reported_suma8) {
-                char progress_string[80];
-                sprintf(progress_string, "Apply Sum property. Sum(a0) = %d", sums[first_byte_Sum]);
-                hardnested_print_progress(num_acquired_nonces, progress_string, brute_force, 0, trgBlockNo, trgKeyType, true);
-                reported_suma8 = true;
-            } else {
-                hardnested_print_progress(num_acquired_nonces, "Apply bit flip properties", brute_force, 0, trgBlockNo, trgKeyType, false);
+static void init_statelist_cache(void) {
+    for (uint16_t i = 0; i < NUM_PART_SUMS; i++) {
+        for (uint16_t j = 0; j < NUM_PART_SUMS; j++) {
+            for (uint16_t k = 0; k < 2; k++) {
+                ctx->sl_cache[i][j][k].sl = NULL;
+                ctx->sl_cache[i][j][k].len = 0;
+                ctx->sl_cache[i][j][k].cache_status = TO_BE_DONE;
             }
-        } else {
-            update_nonce_data(true);
-            acquisition_completed = shrink_key_space(&brute_force);
-            hardnested_print_progress(num_acquired_nonces, "Apply bit flip properties", brute_force, 0, trgBlockNo, trgKeyType, false);
-        }
-
-        if (msclock() - last_sample_clock < sample_period) {
-            sample_period = msclock() - last_sample_clock;
         }
-        last_sample_clock = msclock();
-    } while (!acquisition_completed);
-    nfc_device_set_property_bool(r.pdi, NP_HANDLE_CRC, true);
-    nfc_device_set_property_bool(r.pdi, NP_HANDLE_PARITY, true);
-    return 0;
+    }
 }
 
 
-static inline bool invariant_holds(uint_fast8_t byte_diff, uint_fast32_t state1, uint_fast32_t state2, uint_fast8_t bit, uint_fast8_t state_bit) {
-    uint_fast8_t j_1_bit_mask = 0x01 << (bit - 1);
-    uint_fast8_t bit_diff = byte_diff & j_1_bit_mask; // difference of (j-1)th bit
-    uint_fast8_t filter_diff = filter(state1 >> (4 - state_bit)) ^ filter(state2 >> (4 - state_bit)); // difference in filter function
-    uint_fast8_t mask_y12_y13 = 0xc0 >> state_bit;
-    uint_fast8_t state_bits_diff = (state1 ^ state2) & mask_y12_y13; // difference in state bits 12 and 13
-    uint_fast8_t all_diff = evenparity8(bit_diff ^ state_bits_diff ^ filter_diff); // use parity function to XOR all bits
-    return !all_diff;
+static void free_statelist_cache(void) {
+    for (uint16_t i = 0; i < NUM_PART_SUMS; i++) {
+        for (uint16_t j = 0; j < NUM_PART_SUMS; j++) {
+            for (uint16_t k = 0; k < 2; k++) {
+                free(ctx->sl_cache[i][j][k].sl);
+            }
+        }
+    }
 }
 
 
-static inline bool invalid_state(uint_fast8_t byte_diff, uint_fast32_t state1, uint_fast32_t state2, uint_fast8_t bit, uint_fast8_t state_bit) {
-    uint_fast8_t j_bit_mask = 0x01 << bit;
-    uint_fast8_t bit_diff = byte_diff & j_bit_mask; // difference of jth bit
-    uint_fast8_t mask_y13_y16 = 0x48 >> state_bit;
-    uint_fast8_t state_bits_diff = (state1 ^ state2) & mask_y13_y16; // difference in state bits 13 and 16
-    uint_fast8_t all_diff = evenparity8(bit_diff ^ state_bits_diff); // use parity function to XOR all bits
-    return all_diff;
-}
-
-
-static inline bool remaining_bits_match(uint_fast8_t num_common_bits, uint_fast8_t byte_diff, uint_fast32_t state1, uint_fast32_t state2, odd_even_t odd_even) {
-    if (odd_even) {
-        // odd bits
-        switch (num_common_bits) {
-            case 0: if (!invariant_holds(byte_diff, state1, state2, 1, 0)) return true;
-            case 1: if (invalid_state(byte_diff, state1, state2, 1, 0)) return false;
-            case 2: if (!invariant_holds(byte_diff, state1, state2, 3, 1)) return true;
-            case 3: if (invalid_state(byte_diff, state1, state2, 3, 1)) return false;
-            case 4: if (!invariant_holds(byte_diff, state1, state2, 5, 2)) return true;
-            case 5: if (invalid_state(byte_diff, state1, state2, 5, 2)) return false;
-            case 6: if (!invariant_holds(byte_diff, state1, state2, 7, 3)) return true;
-            case 7: if (invalid_state(byte_diff, state1, state2, 7, 3)) return false;
-        }
-    } else {
-        // even bits
-        switch (num_common_bits) {
-            case 0: if (invalid_state(byte_diff, state1, state2, 0, 0)) return false;
-            case 1: if (!invariant_holds(byte_diff, state1, state2, 2, 1)) return true;
-            case 2: if (invalid_state(byte_diff, state1, state2, 2, 1)) return false;
-            case 3: if (!invariant_holds(byte_diff, state1, state2, 4, 2)) return true;
-            case 4: if (invalid_state(byte_diff, state1, state2, 4, 2)) return false;
-            case 5: if (!invariant_holds(byte_diff, state1, state2, 6, 3)) return true;
-            case 6: if (invalid_state(byte_diff, state1, state2, 6, 3)) return false;
-        }
-    }
-    return true; // valid state
-}
-
-
-static struct sl_cache_entry {
-    uint32_t *sl;
-    uint32_t len;
-    work_status_t cache_status;
-} sl_cache[NUM_PART_SUMS][NUM_PART_SUMS][2];
-
-
-static void init_statelist_cache(void) {
-    // create mutexes for accessing the statelist cache and our "book of work"
-    pthread_mutex_lock(&statelist_cache_mutex);
-    for (uint16_t i = 0; i < NUM_PART_SUMS; i++) {
-        for (uint16_t j = 0; j < NUM_PART_SUMS; j++) {
-            for (uint16_t k = 0; k < 2; k++) {
-                sl_cache[i][j][k].sl = NULL;
-                sl_cache[i][j][k].len = 0;
-                sl_cache[i][j][k].cache_status = TO_BE_DONE;
-            }
-        }
-    }
-    pthread_mutex_unlock(&statelist_cache_mutex);
-}
-
-
-static void free_statelist_cache(void) {
-    pthread_mutex_lock(&statelist_cache_mutex);
-    for (uint16_t i = 0; i < NUM_PART_SUMS; i++) {
-        for (uint16_t j = 0; j < NUM_PART_SUMS; j++) {
-            for (uint16_t k = 0; k < 2; k++) {
-                free(sl_cache[i][j][k].sl);
-            }
-        }
-    }
-    pthread_mutex_unlock(&statelist_cache_mutex);
-}
-
-
-static inline bool bitflips_match(uint8_t byte, uint32_t state, odd_even_t odd_even, bool quiet) {
-    uint32_t *bitset = nonces[byte].states_bitarray[odd_even];
-    bool possible = test_bit24(bitset, state);
-    if (!possible) {
-        if (!quiet && known_target_key != -1 && state == test_state[odd_even]) {
-            printf("Initial state lists: %s test state eliminated by bitflip property.\n", odd_even == EVEN_STATE ? "even" : "odd");
-            sprintf(failstr, "Initial %s Byte Bitflip property", odd_even == EVEN_STATE ? "even" : "odd");
-        }
-        return false;
-    }
-    return true;
-}
-
-
-static uint_fast8_t reverse(uint_fast8_t b) {
-    return (b * 0x0202020202ULL & 0x010884422010ULL) % 1023;
+static uint_fast8_t reverse(uint_fast8_t b) {
+    return (b * 0x0202020202ULL & 0x010884422010ULL) % 1023;
 }
 
 
@@ -1290,26 +1577,29 @@ static bool all_bitflips_match(uint8_t byte, uint32_t state, odd_even_t odd_even
         {0x00fffff0, 0x00fffff8, 0x00fffff8, 0x00fffffc, 0x00fffffc, 0x00fffffe, 0x00fffffe, 0x00ffffff},
         {0x00fffff0, 0x00fffff0, 0x00fffff8, 0x00fffff8, 0x00fffffc, 0x00fffffc, 0x00fffffe, 0x00fffffe}
     };
+    remaining_bits_lanes_t lanes;
+    init_remaining_bits_lanes(state, &lanes);
 
     for (uint16_t i = 1; i < 256; i++) {
         uint_fast8_t bytes_diff = reverse(i); // start with most common bits
         uint_fast8_t byte2 = byte ^ bytes_diff;
         uint_fast8_t num_common = trailing_zeros(bytes_diff);
         uint32_t mask = masks[odd_even][num_common];
-        bool found_match = false;
-        for (uint8_t remaining_bits = 0; remaining_bits <= (~mask & 0xff); remaining_bits++) {
-            if (remaining_bits_match(num_common, bytes_diff, state, (state & mask) | remaining_bits, odd_even)) {
-                if (bitflips_match(byte2, (state & mask) | remaining_bits, odd_even, true)) {    
-                    found_match = true;
-                    break;
-                }
-            }
-        }
+        // the candidate states of byte2 are aligned within the block of state, i.e. they are all in one half word of
+        // its bitarray. Check them at once
+        uint_fast8_t first = state & mask & 0x0f;
+        uint_fast8_t num_remaining = (~mask & 0xff) + 1;
+        uint16_t candidates = (0xffff >> first) & ~(0xffff >> (first + num_remaining));
+        candidates &= remaining_bits_match_lanes(&lanes, num_common, bytes_diff, odd_even);
+        if (candidates) {
+            candidates &= ctx->nonces[byte2].states_bitarray[odd_even][state >> 5] << (state & 0x10) >> 16;
+        }
+        bool found_match = candidates != 0;
         if (!found_match) {   
-            if (known_target_key != -1 && state == test_state[odd_even]) {
+            if (ctx->known_target_key != -1 && state == ctx->test_state[odd_even]) {
                 printf("all_bitflips_match() 1st Byte: %s test state (0x%06x): Eliminated. Bytes = %02x, %02x, Common Bits = %d\n",
                         odd_even == ODD_STATE ? "odd" : "even",
-                        test_state[odd_even],
+                        ctx->test_state[odd_even],
                         byte, byte2, num_common);
                 if (failstr[0] == '\0') {
                     sprintf(failstr, "Other 1st Byte %s, all_bitflips_match(), no match", odd_even ? "odd" : "even");
@@ -1323,61 +1613,126 @@ static bool all_bitflips_match(uint8_t byte, uint32_t state, odd_even_t odd_even
 }
 
 
+#define BITARRAY_TO_LIST_CHUNK  (1 << 16)   // states per bitarray_to_list task
+
+struct bitarray_to_list_args {
+    hardnested_ctx_t *ctx;
+    uint8_t byte;
+    uint32_t *bitarray;
+    odd_even_t odd_even;
+    uint32_t first_state;
+    uint32_t *states;                   // result: the matching states of this chunk
+    uint32_t len;
+};
+
+static void *bitarray_to_list_task(void *x) {
+    struct bitarray_to_list_args *args = (struct bitarray_to_list_args *)x;
+    bind_ctx(args->ctx);
+    uint32_t *words = args->bitarray + (args->first_state >> 5);
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < BITARRAY_TO_LIST_CHUNK / 32; i++) {
+        count += __builtin_popcount(words[i]);
+    }
+    args->states = NULL;
+    args->len = 0;
+    if (count == 0) {
+        return NULL;
+    }
+    args->states = (uint32_t *) malloc(sizeof (uint32_t) * count);
+    if (args->states == NULL) {
+        PrintAndLog(true, "Out of memory error in bitarray_to_list_task().\n");
+        exit(4);
+    }
+
+    for (uint32_t i = 0; i < BITARRAY_TO_LIST_CHUNK / 32; i++) {
+        uint32_t line = words[i];
+        while (line != 0) {
+            uint8_t bit = __builtin_clz(line);
+            uint32_t state = args->first_state + i * 32 + bit;
+            if (all_bitflips_match(args->byte, state, args->odd_even)) {
+                args->states[args->len++] = state;
+            }
+            line &= ~(0x80000000 >> bit);
+        }
+    }
+    return NULL;
+}
+
+
+// Convert the bitarray into a list of states which additionally match all other first bytes' bitflip properties. The 24
+// bit range is split into chunks which are checked on the worker pool.
 static void bitarray_to_list(uint8_t byte, uint32_t *bitarray, uint32_t *state_list, uint32_t *len, odd_even_t odd_even) {
+    uint32_t num_tasks = (1 << 24) / BITARRAY_TO_LIST_CHUNK;
+    struct bitarray_to_list_args *args = malloc(num_tasks * sizeof(*args));
+    if (args == NULL) {
+        PrintAndLog(true, "Out of memory error in bitarray_to_list().\n");
+        exit(4);
+    }
+    for (uint32_t i = 0; i < num_tasks; i++) {
+        args[i].ctx = ctx;
+        args[i].byte = byte;
+        args[i].bitarray = bitarray;
+        args[i].odd_even = odd_even;
+        args[i].first_state = i * BITARRAY_TO_LIST_CHUNK;
+    }
+    hardnested_pool_run(bitarray_to_list_task, args, sizeof(*args), num_tasks);
+
     uint32_t *p = state_list;
-    for (uint32_t state = next_state(bitarray, -1L); state < (1 << 24); state = next_state(bitarray, state)) {
-        if (all_bitflips_match(byte, state, odd_even)) {
-            *p++ = state;
+    for (uint32_t i = 0; i < num_tasks; i++) {
+        if (args[i].len != 0) {
+            memcpy(p, args[i].states, sizeof (uint32_t) * args[i].len);
+            p += args[i].len;
         }
+        free(args[i].states);
     }
+    free(args);
     // add End Of List marker
     *p = 0xffffffff;
     *len = p - state_list;
 }
 
 
-static void add_cached_states(statelist_t *candidates, uint16_t part_sum_a0, uint16_t part_sum_a8, odd_even_t odd_even) {
-    candidates->states[odd_even] = sl_cache[part_sum_a0 / 2][part_sum_a8 / 2][odd_even].sl;
-    candidates->len[odd_even] = sl_cache[part_sum_a0 / 2][part_sum_a8 / 2][odd_even].len;
+static void add_cached_states(statelist_t *current_candidates, uint16_t part_sum_a0, uint16_t part_sum_a8, odd_even_t odd_even) {
+    current_candidates->states[odd_even] = ctx->sl_cache[part_sum_a0 / 2][part_sum_a8 / 2][odd_even].sl;
+    current_candidates->len[odd_even] = ctx->sl_cache[part_sum_a0 / 2][part_sum_a8 / 2][odd_even].len;
     return;
 }
 
 
-static void add_matching_states(statelist_t *candidates, uint8_t part_sum_a0, uint8_t part_sum_a8, odd_even_t odd_even) {
+// calculate the statelist cache entry for the partial sums. Each entry is calculated by exactly one task, no locking required
+static void add_matching_states(uint8_t part_sum_a0, uint8_t part_sum_a8, odd_even_t odd_even) {
     const uint32_t worstcase_size = 1 << 20;
-    candidates->states[odd_even] = (uint32_t *) malloc(sizeof (uint32_t) * worstcase_size);
-    if (candidates->states[odd_even] == NULL) {
+    struct sl_cache_entry *entry = &ctx->sl_cache[part_sum_a0 / 2][part_sum_a8 / 2][odd_even];
+    entry->sl = (uint32_t *) malloc(sizeof (uint32_t) * worstcase_size);
+    if (entry->sl == NULL) {
         PrintAndLog(true, "Out of memory error in add_matching_states() - statelist.\n");
         exit(4);
     }
     uint32_t *candidates_bitarray = (uint32_t *) malloc_bitarray(sizeof (uint32_t) * worstcase_size);
     if (candidates_bitarray == NULL) {
         PrintAndLog(true, "Out of memory error in add_matching_states() - bitarray.\n");
-        free(candidates->states[odd_even]);
+        free(entry->sl);
         exit(4);
     }
 
-    uint32_t *bitarray_a0 = part_sum_a0_bitarrays[odd_even][part_sum_a0 / 2];
-    uint32_t *bitarray_a8 = part_sum_a8_bitarrays[odd_even][part_sum_a8 / 2];
-    uint32_t *bitarray_bitflips = nonces[best_first_bytes[0]].states_bitarray[odd_even];
+    uint32_t *bitarray_a0 = ctx->part_sum_a0_bitarrays[odd_even][part_sum_a0 / 2];
+    uint32_t *bitarray_a8 = ctx->part_sum_a8_bitarrays[odd_even][part_sum_a8 / 2];
+    uint32_t *bitarray_bitflips = ctx->nonces[ctx->best_first_bytes[0]].states_bitarray[odd_even];
 
     bitarray_AND4(candidates_bitarray, bitarray_a0, bitarray_a8, bitarray_bitflips);
 
-    bitarray_to_list(best_first_bytes[0], candidates_bitarray, candidates->states[odd_even], &(candidates->len[odd_even]), odd_even);
-    if (candidates->len[odd_even] == 0) {
-        free(candidates->states[odd_even]);
-        candidates->states[odd_even] = NULL;
-    } else if (candidates->len[odd_even] + 1 < worstcase_size) {
-        candidates->states[odd_even] = realloc(candidates->states[odd_even], sizeof (uint32_t) * (candidates->len[odd_even] + 1));
+    bitarray_to_list(ctx->best_first_bytes[0], candidates_bitarray, entry->sl, &(entry->len), odd_even);
+    if (entry->len == 0) {
+        free(entry->sl);
+        entry->sl = NULL;
+    } else if (entry->len + 1 < worstcase_size) {
+        entry->sl = realloc(entry->sl, sizeof (uint32_t) * (entry->len + 1));
     }
     free_bitarray(candidates_bitarray);
 
 
-    pthread_mutex_lock(&statelist_cache_mutex);
-    sl_cache[part_sum_a0 / 2][part_sum_a8 / 2][odd_even].sl = candidates->states[odd_even];
-    sl_cache[part_sum_a0 / 2][part_sum_a8 / 2][odd_even].len = candidates->len[odd_even];
-    sl_cache[part_sum_a0 / 2][part_sum_a8 / 2][odd_even].cache_status = COMPLETED;
-    pthread_mutex_unlock(&statelist_cache_mutex);
+    entry->cache_status = COMPLETED;
 
     return;
 }
@@ -1385,11 +1740,11 @@ static void add_matching_states(statelist_t *candidates, uint8_t part_sum_a0, ui
 
 static statelist_t *add_more_candidates(void) {
     statelist_t *new_candidates;
-    if (candidates == NULL) {
-        candidates = (statelist_t *) malloc(sizeof (statelist_t));
-        new_candidates = candidates;
+    if (ctx->candidates == NULL) {
+        ctx->candidates = (statelist_t *) malloc(sizeof (statelist_t));
+        new_candidates = ctx->candidates;
     } else {
-        new_candidates = candidates;
+        new_candidates = ctx->candidates;
         while (new_candidates->next != NULL) {
             new_candidates = new_candidates->next;
         }
@@ -1408,14 +1763,14 @@ static void add_bitflip_candidates(uint8_t byte) {
     statelist_t *candidates1 = add_more_candidates();
 
     for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-        uint32_t worstcase_size = nonces[byte].num_states_bitarray[odd_even] + 1;
+        uint32_t worstcase_size = ctx->nonces[byte].num_states_bitarray[odd_even] + 1;
         candidates1->states[odd_even] = (uint32_t *) malloc(sizeof (uint32_t) * worstcase_size);
         if (candidates1->states[odd_even] == NULL) {
             PrintAndLog(true, "Out of memory error in add_bitflip_candidates().\n");
             exit(4);
         }
 
-        bitarray_to_list(byte, nonces[byte].states_bitarray[odd_even], candidates1->states[odd_even], &(candidates1->len[odd_even]), odd_even);
+        bitarray_to_list(byte, ctx->nonces[byte].states_bitarray[odd_even], candidates1->states[odd_even], &(candidates1->len[odd_even]), odd_even);
 
         if (candidates1->len[odd_even] + 1 < worstcase_size) {
             candidates1->states[odd_even] = realloc(candidates1->states[odd_even], sizeof (uint32_t) * (candidates1->len[odd_even] + 1));
@@ -1426,15 +1781,15 @@ static void add_bitflip_candidates(uint8_t byte) {
 
 
 static bool TestIfKeyExists(uint64_t key) {
-    struct Crypto1State *pcs;
-    pcs = crypto1_create(key);
-    crypto1_byte(pcs, (cuid >> 24) ^ best_first_bytes[0], true);
+    struct Crypto1State cs;
+    crypto1_init(&cs, key);
+    crypto1_byte(&cs, (ctx->cuid >> 24) ^ ctx->best_first_bytes[0], true);
 
-    uint32_t state_odd = pcs->odd & 0x00ffffff;
-    uint32_t state_even = pcs->even & 0x00ffffff;
+    uint32_t state_odd = cs.odd & 0x00ffffff;
+    uint32_t state_even = cs.even & 0x00ffffff;
 
     uint64_t count = 0;
-    for (statelist_t *p = candidates; p != NULL; p = p->next) {
+    for (statelist_t *p = ctx->candidates; p != NULL; p = p->next) {
         bool found_odd = false;
         bool found_even = false;
         uint32_t *p_odd = p->states[ODD_STATE];
@@ -1456,204 +1811,416 @@ static bool TestIfKeyExists(uint64_t key) {
             count += (uint64_t) (p_odd - p->states[ODD_STATE]) * (uint64_t) (p_even - p->states[EVEN_STATE]);
         }
         if (found_odd && found_even) {
-            num_keys_tested += count;
-            hardnested_print_progress(num_acquired_nonces, "(Test: Key found)", 0.0, 0, targetBLOCK, targetKEY, true);
-            crypto1_destroy(pcs);
+            ctx->num_keys_tested += count;
+            hardnested_print_progress(ctx, ctx->num_acquired_nonces, "(Test: Key found)", 0.0, 0, true);
             return true;
         }
     }
 
-    num_keys_tested += count;
-    hardnested_print_progress(num_acquired_nonces, "(Test: Key NOT found)", 0.0, 0, targetBLOCK, targetKEY, true);
+    ctx->num_keys_tested += count;
+    hardnested_print_progress(ctx, ctx->num_acquired_nonces, "(Test: Key NOT found)", 0.0, 0, true);
 
-    crypto1_destroy(pcs);
     return false;
 }
 
 
-static void init_book_of_work(void) {
-    for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
-        for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
-            for (uint8_t r = 0; r < NUM_PART_SUMS; r++) {
-                for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
-                    book_of_work[p][q][r][s] = TO_BE_DONE;
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// secondary Sum(a8) filters
+// A first byte b1 which shares its lowest common_bits bits with the best first byte b0 leads to a state which differs
+// from the candidate state of b0 in some of the 4 lowest bits of each half only (bits 4..23 are equal). A candidate
+// pair is therefore dropped when none of the possible completions of these bits gives the guessed Sum(a8) of b1.
+// This is a check on the half states (partial sums) only, i.e. cheap, but weaker than rolling each pair to the state
+// of b1: of the wrong pairs about 28% (common_bits = 7) to 45% (common_bits = 5) pass it.
+
+// per number of common bits: the bits of the lowest nibble which are the same for both first bytes {even, odd}
+static const uint8_t common_state_bits[8][2] = {
+    {0x0, 0x0}, {0x8, 0x0}, {0x8, 0x8}, {0xc, 0x8}, {0xc, 0xc}, {0xe, 0xc}, {0xe, 0xe}, {0xf, 0xe}
+};
+
+
+// the partial sums (bits, PartialSumProperty() / 2) the state of the secondary first byte can have
+static uint16_t possible_part_sums(uint32_t state, odd_even_t odd_even, uint8_t common_bits) {
+    uint8_t known = common_state_bits[common_bits][odd_even];
+    uint16_t part_sums = 0;
+    for (uint8_t n = 0; n < 16; n++) {
+        if ((n & known) == (state & known)) {
+            part_sums |= 1 << tables->part_sum_idx[odd_even][(state & 0xffff0) | n];
+        }
+    }
+    return part_sums;
+}
+
+
+// Use the most probable Sum(a8) of the secondary first bytes which share most bits with best_byte, as long as the
+// probability of at least one of these guesses being wrong stays below tables->sum_a8_risk.
+static void select_sum_a8_filters(uint8_t best_byte) {
+    float risk = 0.0;
+    ctx->num_sum_a8_filters = 0;
+    for (int8_t k = 7; k >= 5 && tables->sum_a8_risk > 0.0; k--) {
+        for (uint16_t h = 0; h < (1 << (7 - k)); h++) {
+            uint8_t first_byte = best_byte ^ (1 << k) ^ (h << (k + 1));
+            noncelist_t *nonces = &ctx->nonces[first_byte];
+            float total_prob = 0.0;
+            for (uint8_t i = 0; i < NUM_SUMS; i++) {
+                total_prob += nonces->sum_a8_guess[i].prob;
+            }
+            if (nonces->num == 0 || total_prob == 0.0) continue;
+            float guess_risk = 1.0 - nonces->sum_a8_guess[0].prob / total_prob;
+            if (risk + guess_risk > tables->sum_a8_risk) continue;
+            risk += guess_risk;
+            struct sum_a8_filter *filter = &ctx->sum_a8_filter[ctx->num_sum_a8_filters++];
+            filter->first_byte = first_byte;
+            filter->common_bits = k;
+            uint16_t sum_a8 = sums[nonces->sum_a8_guess[0].sum_a8_idx];
+            for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
+                filter->allowed_odd[s] = 0;
+                for (uint8_t r = 0; r < NUM_PART_SUMS; r++) {
+                    if (2 * r * (16 - 2 * s) + (16 - 2 * r)*2 * s == sum_a8) {
+                        filter->allowed_odd[s] |= 1 << r;
+                    }
                 }
             }
         }
     }
+    if (ctx->num_sum_a8_filters > 0) {
+        char progress_text[80];
+        sprintf(progress_text, "Apply Sum(a8) of %u secondary bytes (p(key excluded) <= %1.4f)", ctx->num_sum_a8_filters, risk);
+        hardnested_print_progress(ctx, ctx->num_acquired_nonces, progress_text, ctx->nonces[best_byte].expected_num_brute_force, 0, true);
+    }
+}
+
+
+static void add_filtered_bucket(statelist_t **filtered, uint32_t *num_filtered, uint32_t *size, statelist_t bucket) {
+    if (*num_filtered == *size) {
+        *size = 2 * *size + 16;
+        *filtered = realloc(*filtered, *size * sizeof(statelist_t));
+        if (*filtered == NULL) {
+            PrintAndLog(true, "Out of memory error in add_filtered_bucket().\n");
+            exit(4);
+        }
+    }
+    (*filtered)[(*num_filtered)++] = bucket;
+}
+
+
+// Split bucket into the buckets of the pairs which pass filter. The even states are grouped by the odd partial sums
+// they allow, each group gets the odd states with at least one of them. The brute force pads each even statelist to
+// whole bitsliced blocks, i.e. a group of a few even states costs as much as a full block. With merge_small, the groups
+// smaller than a block are therefore packed into pools of at most one block, each getting the odd states of all its
+// groups. A pool never needs more blocks than its groups, but it loses the distinction between them for later filters.
+static void filter_bucket(const struct sum_a8_filter *filter, const statelist_t *bucket, bool merge_small, statelist_t **filtered, uint32_t *num_filtered, uint32_t *size) {
+    uint16_t *even_allowed = malloc(bucket->len[EVEN_STATE] * sizeof(uint16_t));
+    uint16_t *odd_part_sums = malloc(bucket->len[ODD_STATE] * sizeof(uint16_t));
+    uint32_t *group_size = calloc(1 << NUM_PART_SUMS, sizeof(uint32_t));
+    uint32_t *odd_count = calloc(1 << NUM_PART_SUMS, sizeof(uint32_t));
+    if (even_allowed == NULL || odd_part_sums == NULL || group_size == NULL || odd_count == NULL) {
+        PrintAndLog(true, "Out of memory error in filter_bucket().\n");
+        exit(4);
+    }
+    for (uint32_t i = 0; i < bucket->len[EVEN_STATE]; i++) {
+        uint16_t part_sums = possible_part_sums(bucket->states[EVEN_STATE][i], EVEN_STATE, filter->common_bits);
+        even_allowed[i] = 0;
+        for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
+            if (part_sums & (1 << s)) {
+                even_allowed[i] |= filter->allowed_odd[s];
+            }
+        }
+        group_size[even_allowed[i]]++;
+    }
+    for (uint32_t i = 0; i < bucket->len[ODD_STATE]; i++) {
+        odd_part_sums[i] = possible_part_sums(bucket->states[ODD_STATE][i], ODD_STATE, filter->common_bits);
+        odd_count[odd_part_sums[i]]++;
+    }
+
+    if (merge_small) {
+        const uint32_t block_states = brute_force_bs_block_states();
+        uint16_t pool_allowed[1 << NUM_PART_SUMS];
+        uint32_t pool_size[1 << NUM_PART_SUMS];
+        uint16_t pool_of[1 << NUM_PART_SUMS];
+        uint16_t num_pools = 0;
+        for (uint16_t allowed = 1; allowed < (1 << NUM_PART_SUMS); allowed++) {
+            if (group_size[allowed] == 0 || group_size[allowed] >= block_states) continue;
+            uint16_t pool = 0;
+            while (pool < num_pools && pool_size[pool] + group_size[allowed] > block_states) {
+                pool++;
+            }
+            if (pool == num_pools) {
+                pool_allowed[num_pools] = 0;
+                pool_size[num_pools++] = 0;
+            }
+            pool_allowed[pool] |= allowed;
+            pool_size[pool] += group_size[allowed];
+            pool_of[allowed] = pool;
+        }
+        // a pool may end up with the same allowed odd partial sums as another pool or group. They are merged then,
+        // which doesn't need more blocks either
+        for (uint32_t i = 0; i < bucket->len[EVEN_STATE]; i++) {
+            if (even_allowed[i] != 0 && group_size[even_allowed[i]] < block_states) {
+                even_allowed[i] = pool_allowed[pool_of[even_allowed[i]]];
+            }
+        }
+        memset(group_size, 0, (1 << NUM_PART_SUMS) * sizeof(uint32_t));
+        for (uint32_t i = 0; i < bucket->len[EVEN_STATE]; i++) {
+            group_size[even_allowed[i]]++;
+        }
+    }
+
+    for (uint16_t allowed = 1; allowed < (1 << NUM_PART_SUMS); allowed++) {
+        if (group_size[allowed] == 0) continue;
+        uint32_t len_odd = 0;
+        for (uint16_t part_sums = 1; part_sums < (1 << NUM_PART_SUMS); part_sums++) {
+            if (part_sums & allowed) len_odd += odd_count[part_sums];
+        }
+        if (len_odd == 0) continue;
+        statelist_t sub_bucket = {.next = NULL};
+        sub_bucket.states[ODD_STATE] = malloc((len_odd + 1) * sizeof(uint32_t));
+        sub_bucket.states[EVEN_STATE] = malloc((group_size[allowed] + 1) * sizeof(uint32_t));
+        if (sub_bucket.states[ODD_STATE] == NULL || sub_bucket.states[EVEN_STATE] == NULL) {
+            PrintAndLog(true, "Out of memory error in filter_bucket().\n");
+            exit(4);
+        }
+        for (uint32_t i = 0; i < bucket->len[ODD_STATE]; i++) {
+            if (odd_part_sums[i] & allowed) {
+                sub_bucket.states[ODD_STATE][sub_bucket.len[ODD_STATE]++] = bucket->states[ODD_STATE][i];
+            }
+        }
+        for (uint32_t i = 0; i < bucket->len[EVEN_STATE]; i++) {
+            if (even_allowed[i] == allowed) {
+                sub_bucket.states[EVEN_STATE][sub_bucket.len[EVEN_STATE]++] = bucket->states[EVEN_STATE][i];
+            }
+        }
+        sub_bucket.states[ODD_STATE][len_odd] = 0xffffffff;
+        sub_bucket.states[EVEN_STATE][group_size[allowed]] = 0xffffffff;
+        add_filtered_bucket(filtered, num_filtered, size, sub_bucket);
+    }
+
+    free(odd_count);
+    free(group_size);
+    free(odd_part_sums);
+    free(even_allowed);
+}
+
+
+// Brute force the pairs of the buckets which pass all secondary Sum(a8) filters
+static void brute_force_filtered_buckets(bf_run_t *bf_run, statelist_t **buckets, uint16_t num_buckets) {
+    statelist_t *current = malloc((num_buckets + 1) * sizeof(statelist_t));
+    if (current == NULL) {
+        PrintAndLog(true, "Out of memory error in brute_force_filtered_buckets().\n");
+        exit(4);
+    }
+    uint32_t num_current = 0;
+    for (uint16_t i = 0; i < num_buckets; i++) {
+        if (buckets[i]->len[ODD_STATE] > 0 && buckets[i]->len[EVEN_STATE] > 0) {
+            current[num_current++] = *buckets[i];
+        }
+    }
+    for (uint8_t f = 0; f < ctx->num_sum_a8_filters; f++) {
+        statelist_t *filtered = NULL;
+        uint32_t num_filtered = 0;
+        uint32_t size = 0;
+        for (uint32_t i = 0; i < num_current; i++) {
+            // only the last filter pools small groups, the ones before would lose more pairs than the padding costs
+            filter_bucket(&ctx->sum_a8_filter[f], &current[i], f == ctx->num_sum_a8_filters - 1, &filtered, &num_filtered, &size);
+            if (f > 0) {
+                free(current[i].states[ODD_STATE]);
+                free(current[i].states[EVEN_STATE]);
+            }
+        }
+        free(current);
+        current = filtered;
+        num_current = num_filtered;
+    }
+
+    statelist_t **filtered_buckets = malloc((num_current + 1) * sizeof(statelist_t *));
+    if (filtered_buckets == NULL) {
+        PrintAndLog(true, "Out of memory error in brute_force_filtered_buckets().\n");
+        exit(4);
+    }
+    for (uint32_t i = 0; i < num_current; i++) {
+        filtered_buckets[i] = &current[i];
+    }
+    if (num_current > 0) {
+        brute_force_bs_buckets(bf_run, filtered_buckets, num_current);
+    }
+    for (uint32_t i = 0; i < num_current; i++) {
+        free(current[i].states[ODD_STATE]);
+        free(current[i].states[EVEN_STATE]);
+    }
+    free(filtered_buckets);
+    free(current);
 }
 
+
+struct statelist_task_args {
+    hardnested_ctx_t *ctx;
+    uint8_t part_sum_a0;
+    uint8_t part_sum_a8;
+    odd_even_t odd_even;
+    bf_run_t *bf_run;               // even statelists only: the run which gets the buckets completed by this statelist
+    statelist_t **buckets;
+    uint16_t num_buckets;
+    uint64_t *generation_time;
+    uint64_t *num_states;           // even statelists only: the number of candidate states of the buckets
+};
+
+
 static void
 #ifdef __has_attribute
 #if __has_attribute(force_align_arg_pointer)
 __attribute__((force_align_arg_pointer))
 #endif
 #endif
-* generate_candidates_worker_thread(void *args) {
-    uint16_t *sum_args = (uint16_t *) args;
-    uint16_t sum_a0 = sums[sum_args[0]];
-    uint16_t sum_a8 = sums[sum_args[1]];
-    bool there_might_be_more_work = true;
-    do {
-        there_might_be_more_work = false;
-        for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
-            for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
-                if (2 * p * (16 - 2 * q) + (16 - 2 * p)*2 * q == sum_a0) {
-                    for (uint8_t r = 0; r < NUM_PART_SUMS; r++) {
-                        for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
-                            if (2 * r * (16 - 2 * s) + (16 - 2 * r)*2 * s == sum_a8) {
-                                pthread_mutex_lock(&book_of_work_mutex);
-                                if (book_of_work[p][q][r][s] != TO_BE_DONE) { // this has been done or is currently been done by another thread. Look for some other work.
-                                    pthread_mutex_unlock(&book_of_work_mutex);
-                                    continue;
-                                }
-
-                                pthread_mutex_lock(&statelist_cache_mutex);
-                                if (sl_cache[p][r][ODD_STATE].cache_status == WORK_IN_PROGRESS
-                                        || sl_cache[q][s][EVEN_STATE].cache_status == WORK_IN_PROGRESS) { // defer until not blocked by another thread.
-                                    pthread_mutex_unlock(&statelist_cache_mutex);
-                                    pthread_mutex_unlock(&book_of_work_mutex);
-                                    there_might_be_more_work = true;
-                                    continue;
-                                }
-
-                                // we finally can do some work.
-                                book_of_work[p][q][r][s] = WORK_IN_PROGRESS;
-                                statelist_t *current_candidates = add_more_candidates();
-
-                                // Check for cached results and add them first
-                                bool odd_completed = false;
-                                if (sl_cache[p][r][ODD_STATE].cache_status == COMPLETED) {
-                                    add_cached_states(current_candidates, 2 * p, 2 * r, ODD_STATE);
-                                    odd_completed = true;
-                                }
-                                bool even_completed = false;
-                                if (sl_cache[q][s][EVEN_STATE].cache_status == COMPLETED) {
-                                    add_cached_states(current_candidates, 2 * q, 2 * s, EVEN_STATE);
-                                    even_completed = true;
-                                }
-
-                                bool work_required = true;
-
-                                // if there had been two cached results, there is no more work to do
-                                if (even_completed && odd_completed) {
-                                    work_required = false;
-                                }
-
-                                // if there had been one cached empty result, there is no need to calculate the other part:
-                                if (work_required) {
-                                    if (even_completed && !current_candidates->len[EVEN_STATE]) {
-                                        current_candidates->len[ODD_STATE] = 0;
-                                        current_candidates->states[ODD_STATE] = NULL;
-                                        work_required = false;
-                                    }
-                                    if (odd_completed && !current_candidates->len[ODD_STATE]) {
-                                        current_candidates->len[EVEN_STATE] = 0;
-                                        current_candidates->states[EVEN_STATE] = NULL;
-                                        work_required = false;
-                                    }
-                                }
-
-                                if (!work_required) {
-                                    pthread_mutex_unlock(&statelist_cache_mutex);
-                                    pthread_mutex_unlock(&book_of_work_mutex);
-                                } else {
-                                    // we really need to calculate something
-                                    if (even_completed) { // we had one cache hit with non-zero even states
-                                        sl_cache[p][r][ODD_STATE].cache_status = WORK_IN_PROGRESS;
-                                        pthread_mutex_unlock(&statelist_cache_mutex);
-                                        pthread_mutex_unlock(&book_of_work_mutex);
-                                        add_matching_states(current_candidates, 2 * p, 2 * r, ODD_STATE);
-                                        work_required = false;
-                                    } else if (odd_completed) { // we had one cache hit with non-zero odd_states
-                                        sl_cache[q][s][EVEN_STATE].cache_status = WORK_IN_PROGRESS;
-                                        pthread_mutex_unlock(&statelist_cache_mutex);
-                                        pthread_mutex_unlock(&book_of_work_mutex);
-                                        add_matching_states(current_candidates, 2 * q, 2 * s, EVEN_STATE);
-                                        work_required = false;
-                                    }
-                                }
-
-                                if (work_required) { // we had no cached result. Need to calculate both odd and even
-                                    sl_cache[p][r][ODD_STATE].cache_status = WORK_IN_PROGRESS;
-                                    sl_cache[q][s][EVEN_STATE].cache_status = WORK_IN_PROGRESS;
-                                    pthread_mutex_unlock(&statelist_cache_mutex);
-                                    pthread_mutex_unlock(&book_of_work_mutex);
-
-                                    add_matching_states(current_candidates, 2 * p, 2 * r, ODD_STATE);
-                                    if (current_candidates->len[ODD_STATE]) {
-                                        add_matching_states(current_candidates, 2 * q, 2 * s, EVEN_STATE);
-                                    } else { // no need to calculate even states yet
-                                        pthread_mutex_lock(&statelist_cache_mutex);
-                                        sl_cache[q][s][EVEN_STATE].cache_status = TO_BE_DONE;
-                                        pthread_mutex_unlock(&statelist_cache_mutex);
-                                        current_candidates->len[EVEN_STATE] = 0;
-                                        current_candidates->states[EVEN_STATE] = NULL;
-                                    }
-                                }
-
-                                // update book of work
-                                pthread_mutex_lock(&book_of_work_mutex);
-                                book_of_work[p][q][r][s] = COMPLETED;
-                                pthread_mutex_unlock(&book_of_work_mutex);
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    } while (there_might_be_more_work);
+* statelist_task(void *args) {
+    struct statelist_task_args *task_args = (struct statelist_task_args *) args;
+    bind_ctx(task_args->ctx);
+    if (task_args->bf_run == NULL) {
+        add_matching_states(task_args->part_sum_a0, task_args->part_sum_a8, task_args->odd_even);
+        return NULL;
+    }
+    if (brute_force_bs_key_found(task_args->bf_run)) {
+        return NULL;
+    }
+    uint64_t start_time = msclock();
+    add_matching_states(task_args->part_sum_a0, task_args->part_sum_a8, task_args->odd_even);
+    __sync_fetch_and_add(task_args->generation_time, msclock() - start_time);
+    for (uint16_t i = 0; i < task_args->num_buckets; i++) {
+        add_cached_states(task_args->buckets[i], task_args->part_sum_a0, task_args->part_sum_a8, EVEN_STATE);
+    }
+    uint64_t num_states = 0;
+    for (uint16_t i = 0; i < task_args->num_buckets; i++) {
+        num_states += (uint64_t) task_args->buckets[i]->len[ODD_STATE] * task_args->buckets[i]->len[EVEN_STATE];
+    }
+    __sync_fetch_and_add(task_args->num_states, num_states);
+    if (ctx->num_sum_a8_filters > 0) {
+        brute_force_filtered_buckets(task_args->bf_run, task_args->buckets, task_args->num_buckets);
+    } else {
+        brute_force_bs_buckets(task_args->bf_run, task_args->buckets, task_args->num_buckets);
+    }
     return NULL;
 }
 
 
-static void generate_candidates(uint8_t sum_a0_idx, uint8_t sum_a8_idx) {
-    // create mutexes for accessing the statelist cache and our "book of work"
-    pthread_mutex_init(&statelist_cache_mutex, NULL);
-    pthread_mutex_init(&book_of_work_mutex, NULL);
+// The candidates for (p, q, r, s) are the odd states with partial sums (2p, 2r) combined with the even states with
+// partial sums (2q, 2s). Each needed statelist is calculated by one task. The odd statelists go first, such that the even
+// statelists which would only be combined with empty odd statelists can be skipped. The buckets are then handed to
+// bf_run as soon as their even statelist is done, i.e. brute forcing starts while the candidates are still being
+// generated. Once the key is found or bf_run is cancelled, the remaining even statelists are skipped. generation_time
+// returns the time spent on the statelists alone. With secondary Sum(a8) filters only the pairs passing them are handed
+// to bf_run. ctx->maximum_states counts all candidate pairs nevertheless: the generation cost and the expected brute
+// force of the other guesses are based on unfiltered numbers as well.
+static void generate_candidates(uint8_t sum_a0_idx, uint8_t sum_a8_idx, bf_run_t *bf_run, uint64_t *generation_time) {
+    uint16_t sum_a0 = sums[sum_a0_idx];
+    uint16_t sum_a8 = sums[sum_a8_idx];
+    bool needed[NUM_PART_SUMS][NUM_PART_SUMS] = {{false}};
+    struct statelist_task_args *args = malloc(NUM_PART_SUMS * NUM_PART_SUMS * sizeof(*args));
+    if (args == NULL) {
+        PrintAndLog(true, "Out of memory error in generate_candidates().\n");
+        exit(4);
+    }
 
     init_statelist_cache();
-    init_book_of_work();
 
-    // create and run worker threads
-    uint8_t num_core = num_CPUs();
-    pthread_t* thread_id = (pthread_t*)malloc(sizeof(pthread_t) * num_core);
-    uint16_t** sums = malloc(num_core * sizeof(*sums));
-    for (uint8_t i = 0; i < num_core; i++)
-        sums[i] = (uint16_t*)malloc(3 * sizeof(*sums[0]));
-
-    for (uint16_t i = 0; i < num_core; i++) {
-        sums[i][0] = sum_a0_idx;
-        sums[i][1] = sum_a8_idx;
-        sums[i][2] = i + 1;
-        pthread_create(thread_id + i, NULL, generate_candidates_worker_thread, sums[i]);
+    // the odd statelists
+    uint64_t start_time = msclock();
+    uint16_t num_tasks = 0;
+    uint16_t num_buckets = 0;
+    for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
+        for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
+            if (2 * p * (16 - 2 * q) + (16 - 2 * p)*2 * q != sum_a0) continue;
+            for (uint8_t r = 0; r < NUM_PART_SUMS; r++) {
+                for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
+                    if (2 * r * (16 - 2 * s) + (16 - 2 * r)*2 * s != sum_a8) continue;
+                    num_buckets++;
+                    if (needed[p][r]) continue;
+                    needed[p][r] = true;
+                    args[num_tasks].ctx = ctx;
+                    args[num_tasks].part_sum_a0 = 2 * p;
+                    args[num_tasks].part_sum_a8 = 2 * r;
+                    args[num_tasks].odd_even = ODD_STATE;
+                    args[num_tasks].bf_run = NULL;
+                    num_tasks++;
+                }
+            }
+        }
     }
+    hardnested_pool_run(statelist_task, args, sizeof(*args), num_tasks);
+    *generation_time = msclock() - start_time;
 
-    // wait for threads to terminate:
-    for (uint16_t i = 0; i < num_core; i++) {
-        pthread_join(thread_id[i], NULL);
+    // the buckets, grouped by the even statelist they are waiting for
+    statelist_t **buckets = malloc(num_buckets * sizeof(*buckets));
+    uint8_t (*even_part_sums)[2] = malloc(num_buckets * sizeof(*even_part_sums));
+    if (buckets == NULL || even_part_sums == NULL) {
+        PrintAndLog(true, "Out of memory error in generate_candidates().\n");
+        exit(4);
     }
-
-    free(thread_id);
-
-    maximum_states = 0;
-    for (statelist_t *sl = candidates; sl != NULL; sl = sl->next) {
-        maximum_states += (uint64_t) sl->len[ODD_STATE] * sl->len[EVEN_STATE];
+    num_buckets = 0;
+    num_tasks = 0;
+    memset(needed, 0, sizeof(needed));
+    for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
+        for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
+            if (2 * p * (16 - 2 * q) + (16 - 2 * p)*2 * q != sum_a0) continue;
+            for (uint8_t r = 0; r < NUM_PART_SUMS; r++) {
+                for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
+                    if (2 * r * (16 - 2 * s) + (16 - 2 * r)*2 * s != sum_a8) continue;
+                    statelist_t *current_candidates = add_more_candidates();
+                    add_cached_states(current_candidates, 2 * p, 2 * r, ODD_STATE);
+                    if (current_candidates->len[ODD_STATE] == 0) continue;
+                    buckets[num_buckets] = current_candidates;
+                    even_part_sums[num_buckets][0] = q;
+                    even_part_sums[num_buckets][1] = s;
+                    num_buckets++;
+                    if (needed[q][s]) continue;
+                    needed[q][s] = true;
+                    args[num_tasks].ctx = ctx;
+                    args[num_tasks].part_sum_a0 = 2 * q;
+                    args[num_tasks].part_sum_a8 = 2 * s;
+                    args[num_tasks].odd_even = EVEN_STATE;
+                    args[num_tasks].bf_run = bf_run;
+                    args[num_tasks].generation_time = generation_time;
+                    args[num_tasks].num_states = &ctx->maximum_states;
+                    num_tasks++;
+                }
+            }
+        }
+    }
+    statelist_t **grouped_buckets = malloc(num_buckets * sizeof(*grouped_buckets));
+    if (grouped_buckets == NULL) {
+        PrintAndLog(true, "Out of memory error in generate_candidates().\n");
+        exit(4);
     }
+    uint16_t num_grouped = 0;
+    for (uint16_t i = 0; i < num_tasks; i++) {
+        args[i].buckets = &grouped_buckets[num_grouped];
+        args[i].num_buckets = 0;
+        for (uint16_t j = 0; j < num_buckets; j++) {
+            if (2 * even_part_sums[j][0] == args[i].part_sum_a0 && 2 * even_part_sums[j][1] == args[i].part_sum_a8) {
+                grouped_buckets[num_grouped++] = buckets[j];
+                args[i].num_buckets++;
+            }
+        }
+    }
+    free(even_part_sums);
+    free(buckets);
+
+    // the even statelists and the brute force of their buckets. The statelists run on all cores in parallel,
+    // the time they need is therefore accounted for once per core
+    uint64_t odd_time = *generation_time;
+    *generation_time = 0;
+    ctx->maximum_states = 0;
+    hardnested_pool_run(statelist_task, args, sizeof(*args), num_tasks);
+    *generation_time = odd_time + *generation_time / num_CPUs();
+    free(grouped_buckets);
+    free(args);
 
     for (uint8_t i = 0; i < NUM_SUMS; i++) {
-        if (nonces[best_first_bytes[0]].sum_a8_guess[i].sum_a8_idx == sum_a8_idx) {
-            nonces[best_first_bytes[0]].sum_a8_guess[i].num_states = maximum_states;
+        if (ctx->nonces[ctx->best_first_bytes[0]].sum_a8_guess[i].sum_a8_idx == sum_a8_idx) {
+            ctx->nonces[ctx->best_first_bytes[0]].sum_a8_guess[i].num_states = ctx->maximum_states;
             break;
         }
     }
 
-    for (uint8_t i = 0; i < num_core; i++)
-        free(sums[i]);
-    free(sums);
-
-    update_expected_brute_force(best_first_bytes[0]);
-    hardnested_print_progress(num_acquired_nonces, "Apply Sum(a8) and all bytes bitflip properties", nonces[best_first_bytes[0]].expected_num_brute_force, 0, targetBLOCK, targetKEY, true);
+    update_expected_brute_force(ctx->best_first_bytes[0]);
+    hardnested_print_progress(ctx, ctx->num_acquired_nonces, "Apply Sum(a8) and all bytes bitflip properties", ctx->nonces[ctx->best_first_bytes[0]].expected_num_brute_force, 0, true);
 }
 
 
@@ -1666,29 +2233,80 @@ static void free_candidates_memory(statelist_t *sl) {
 }
 
 
+static void pre_XOR_nonce(noncelistentry_t *test_nonce) {
+    // XOR the cryptoUID and its parity
+    test_nonce->nonce_enc ^= ctx->cuid;
+    test_nonce->par_enc ^= oddparity8(ctx->cuid >> 0 & 0xff) << 0;
+    test_nonce->par_enc ^= oddparity8(ctx->cuid >> 8 & 0xff) << 1;
+    test_nonce->par_enc ^= oddparity8(ctx->cuid >> 16 & 0xff) << 2;
+    test_nonce->par_enc ^= oddparity8(ctx->cuid >> 24 & 0xff) << 3;
+}
+
+
 static void pre_XOR_nonces(void) {
     // prepare acquired nonces for faster brute forcing. 
-
-    // XOR the cryptoUID and its parity
     for (uint16_t i = 0; i < 256; i++) {
-        noncelistentry_t *test_nonce = nonces[i].first;
+        noncelistentry_t *test_nonce = ctx->nonces[i].first;
         while (test_nonce != NULL) {
-            test_nonce->nonce_enc ^= cuid;
-            test_nonce->par_enc ^= oddparity8(cuid >> 0 & 0xff) << 0;
-            test_nonce->par_enc ^= oddparity8(cuid >> 8 & 0xff) << 1;
-            test_nonce->par_enc ^= oddparity8(cuid >> 16 & 0xff) << 2;
-            test_nonce->par_enc ^= oddparity8(cuid >> 24 & 0xff) << 3;
+            pre_XOR_nonce(test_nonce);
             test_nonce = test_nonce->next;
         }
     }
 }
 
 
-static bool brute_force(uint8_t trgBlock, uint8_t trgKey) {
-    if (known_target_key != -1) {
-        TestIfKeyExists(known_target_key);
+// make run the one hardnested_cancel() stops (NULL: none). A run started after the cancel is stopped right away
+static void set_current_run(bf_run_t *run) {
+    pthread_mutex_lock(&cancel_mutex);
+    ctx->bf_run = run;
+    if (run != NULL && ctx->cancelled) {
+        brute_force_bs_cancel(run);
+    }
+    pthread_mutex_unlock(&cancel_mutex);
+}
+
+
+void hardnested_cancel(hardnested_ctx_t *attack) {
+    pthread_mutex_lock(&cancel_mutex);
+    attack->cancelled = true;
+    if (attack->bf_run != NULL) {
+        brute_force_bs_cancel(attack->bf_run);
     }
-    return brute_force_bs(NULL, candidates, cuid, num_acquired_nonces, maximum_states, nonces, best_first_bytes, trgBlock, trgKey);
+    pthread_mutex_unlock(&cancel_mutex);
+}
+
+
+static bool is_cancelled(void) {
+    pthread_mutex_lock(&cancel_mutex);
+    bool cancelled = ctx->cancelled;
+    pthread_mutex_unlock(&cancel_mutex);
+    return cancelled;
+}
+
+
+static bool brute_force(void) {
+    if (ctx->known_target_key != -1) {
+        TestIfKeyExists(ctx->known_target_key);
+    }
+    bf_run_t *bf_run = brute_force_bs_start(false, ctx, ctx->cuid, ctx->num_acquired_nonces, ctx->nonces, ctx->best_first_bytes, &ctx->bf_test_nonces);
+    set_current_run(bf_run);
+    uint32_t num_buckets = 0;
+    for (statelist_t *p = ctx->candidates; p != NULL; p = p->next) {
+        num_buckets++;
+    }
+    statelist_t **buckets = malloc(num_buckets * sizeof(*buckets));
+    if (buckets == NULL) {
+        PrintAndLog(true, "Out of memory error in brute_force().\n");
+        exit(4);
+    }
+    num_buckets = 0;
+    for (statelist_t *p = ctx->candidates; p != NULL; p = p->next) {
+        buckets[num_buckets++] = p;
+    }
+    brute_force_bs_buckets(bf_run, buckets, num_buckets);
+    free(buckets);
+    set_current_run(NULL);
+    return brute_force_bs_finish(bf_run, NULL, &ctx->found_key);
 }
 
 
@@ -1701,22 +2319,22 @@ static uint16_t SumProperty(struct Crypto1State *s) {
 
 static void Tests() {
 
-    if (known_target_key == -1)
+    if (ctx->known_target_key == -1)
         return;
 
     for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-        uint32_t *bitset = nonces[best_first_bytes[0]].states_bitarray[odd_even];
-        if (!test_bit24(bitset, test_state[odd_even])) {
+        uint32_t *bitset = ctx->nonces[ctx->best_first_bytes[0]].states_bitarray[odd_even];
+        if (!test_bit24(bitset, ctx->test_state[odd_even])) {
                 printf("\nBUG: known target key's %s state is not member of first nonce byte's (0x%02x) states_bitarray!\n",
                           odd_even == EVEN_STATE ? "even" : "odd ",
-                          best_first_bytes[0]);
+                          ctx->best_first_bytes[0]);
         }
     }
 
-    if (known_target_key != -1) {
+    if (ctx->known_target_key != -1) {
         for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-            uint32_t *bitset = all_bitflips_bitarray[odd_even];
-            if (!test_bit24(bitset, test_state[odd_even])) {
+            uint32_t *bitset = ctx->all_bitflips_bitarray[odd_even];
+            if (!test_bit24(bitset, ctx->test_state[odd_even])) {
                 printf("\nBUG: known target key's %s state is not member of all_bitflips_bitarray!\n",
                         odd_even == EVEN_STATE ? "even" : "odd ");
             }
@@ -1727,21 +2345,21 @@ static void Tests() {
 
 static void Tests2(void) {
 
-    if (known_target_key == -1)
+    if (ctx->known_target_key == -1)
         return;
 
     for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-        uint32_t *bitset = nonces[best_first_byte_smallest_bitarray].states_bitarray[odd_even];
-        if (!test_bit24(bitset, test_state[odd_even])) {
+        uint32_t *bitset = ctx->nonces[ctx->best_first_byte_smallest_bitarray].states_bitarray[odd_even];
+        if (!test_bit24(bitset, ctx->test_state[odd_even])) {
       printf("\nBUG: known target key's %s state is not member of first nonce byte's (0x%02x) states_bitarray!\n",
       odd_even == EVEN_STATE ? "even" : "odd ",
-      best_first_byte_smallest_bitarray);
+      ctx->best_first_byte_smallest_bitarray);
     }
   }
 
   for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-  uint32_t *bitset = all_bitflips_bitarray[odd_even];
-    if (!test_bit24(bitset, test_state[odd_even])) {
+  uint32_t *bitset = ctx->all_bitflips_bitarray[odd_even];
+    if (!test_bit24(bitset, ctx->test_state[odd_even])) {
       printf("\nBUG: known target key's %s state is not member of all_bitflips_bitarray!\n",
       odd_even == EVEN_STATE ? "even" : "odd ");
     }
@@ -1750,25 +2368,509 @@ static void Tests2(void) {
 
 
 static void set_test_state(uint8_t byte) {
-    struct Crypto1State *pcs;
-    pcs = crypto1_create(known_target_key);
-    crypto1_byte(pcs, (cuid >> 24) ^ byte, true);
-    test_state[ODD_STATE] = pcs->odd & 0x00ffffff;
-    test_state[EVEN_STATE] = pcs->even & 0x00ffffff;
-    real_sum_a8 = SumProperty(pcs);
-    crypto1_destroy(pcs);
+    struct Crypto1State cs;
+    crypto1_init(&cs, ctx->known_target_key);
+    crypto1_byte(&cs, (ctx->cuid >> 24) ^ byte, true);
+    ctx->test_state[ODD_STATE] = cs.odd & 0x00ffffff;
+    ctx->test_state[EVEN_STATE] = cs.even & 0x00ffffff;
+    ctx->real_sum_a8 = SumProperty(&cs);
 }
 
 
-int mfnestedhard(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, bool hard_low_memory) {
-    
-    targetBLOCK = trgBlockNo;
-    targetKEY = trgKeyType;
-    
-    hard_LOW_MEM = hard_low_memory;
-    
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// speculative brute force
+// As soon as the bitflip candidates of the best first byte can be brute forced within SPECULATION_TIME, a background
+// thread starts brute forcing them while the acquisition goes on. It works on a snapshot of the nonces and candidates
+// and drops the states excluded by the acquisition meanwhile before each batch of odd states. The acquisition updates
+// the bitarrays in place, so the thread reads copies of them, which the acquisition refreshes under the speculation's
+// mutex. A found key ends the acquisition.
+
+typedef struct speculation {
+    uint8_t best_first_bytes[256];
+    noncelist_t *nonces;                // snapshot of the nonce lists, XORed like pre_XOR_nonces() does
+    bf_test_nonces_t test_nonces;
+    uint32_t *states[2];
+    uint32_t len[2];
+    uint8_t byte;
+    uint32_t *states_bitarray[2];       // copies of the first byte's bitarrays, see refresh_speculation()
+    uint32_t num_states_bitarray[2];    // number of states in the copies
+    pthread_mutex_t mutex;              // guards states_bitarray
+    uint32_t batch_size;                // odd states per batch
+    bf_run_t *run;
+    bool stop;
+    pthread_t thread;
+} speculation_t;
+
+
+// keep the states which are still set in bitarray. pruned may be states itself
+static uint32_t prune_states(uint32_t *states, uint32_t len, uint32_t *bitarray, uint32_t *pruned) {
+    uint32_t num_states = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        if (test_bit24(bitarray, states[i])) {
+            pruned[num_states++] = states[i];
+        }
+    }
+    pruned[num_states] = 0xffffffff;
+    return num_states;
+}
+
+
+static void
+#ifdef __has_attribute
+#if __has_attribute(force_align_arg_pointer)
+__attribute__((force_align_arg_pointer))
+#endif
+#endif
+*speculation_thread(void *args) {
+    speculation_t *spec = (speculation_t *) args;
+    uint32_t *odd_states = malloc((spec->batch_size + 1) * sizeof(uint32_t));
+    if (odd_states == NULL) {
+        PrintAndLog(true, "Out of memory error in speculation_thread().\n");
+        exit(4);
+    }
+
+    for (uint32_t first = 0; first < spec->len[ODD_STATE] && !__atomic_load_n(&spec->stop, __ATOMIC_ACQUIRE); first += spec->batch_size) {
+        statelist_t batch;
+        pthread_mutex_lock(&spec->mutex);
+        spec->len[EVEN_STATE] = prune_states(spec->states[EVEN_STATE], spec->len[EVEN_STATE], spec->states_bitarray[EVEN_STATE], spec->states[EVEN_STATE]);
+        batch.len[ODD_STATE] = prune_states(spec->states[ODD_STATE] + first, MIN(spec->batch_size, spec->len[ODD_STATE] - first), spec->states_bitarray[ODD_STATE], odd_states);
+        pthread_mutex_unlock(&spec->mutex);
+        if (spec->len[EVEN_STATE] == 0) {
+            break;
+        }
+        batch.states[ODD_STATE] = odd_states;
+        batch.states[EVEN_STATE] = spec->states[EVEN_STATE];
+        batch.len[EVEN_STATE] = spec->len[EVEN_STATE];
+        batch.next = NULL;
+        statelist_t *bucket = &batch;
+        if (batch.len[ODD_STATE] != 0 && brute_force_bs_buckets(spec->run, &bucket, 1)) {
+            break;
+        }
+    }
+
+    free(odd_states);
+    return NULL;
+}
+
+
+static speculation_t *start_speculation(uint8_t byte) {
+    speculation_t *spec = calloc(1, sizeof(speculation_t));
+    noncelist_t *nonces = calloc(256, sizeof(noncelist_t));
+    if (spec == NULL || nonces == NULL) {
+        PrintAndLog(true, "Out of memory error in start_speculation().\n");
+        exit(4);
+    }
+
+    for (uint16_t i = 0; i < 256; i++) {
+        noncelistentry_t **tail = &nonces[i].first;
+        for (noncelistentry_t *p = ctx->nonces[i].first; p != NULL; p = p->next) {
+            noncelistentry_t *copy = malloc(sizeof(noncelistentry_t));
+            if (copy == NULL) {
+                PrintAndLog(true, "Out of memory error in start_speculation().\n");
+                exit(4);
+            }
+            copy->nonce_enc = p->nonce_enc;
+            copy->par_enc = p->par_enc;
+            pre_XOR_nonce(copy);
+            *tail = copy;
+            tail = (noncelistentry_t **) &copy->next;
+        }
+        *tail = NULL;
+    }
+    spec->nonces = nonces;
+
+    // brute force with byte as the best first byte, as hardnested_solve() does with the bitflip candidates
+    memcpy(spec->best_first_bytes, ctx->best_first_bytes, sizeof(spec->best_first_bytes));
+    for (uint16_t i = 0; i < 256; i++) {
+        if (spec->best_first_bytes[i] == byte) {
+            spec->best_first_bytes[i] = spec->best_first_bytes[0];
+            spec->best_first_bytes[0] = byte;
+            break;
+        }
+    }
+    prepare_bf_test_nonces(spec->nonces, byte, &spec->test_nonces);
+
+    spec->byte = byte;
+    for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+        spec->states_bitarray[odd_even] = (uint32_t *) malloc_bitarray(sizeof(uint32_t) * (1 << 19));
+        spec->states[odd_even] = malloc(sizeof(uint32_t) * (ctx->nonces[byte].num_states_bitarray[odd_even] + 1));
+        if (spec->states_bitarray[odd_even] == NULL || spec->states[odd_even] == NULL) {
+            PrintAndLog(true, "Out of memory error in start_speculation().\n");
+            exit(4);
+        }
+        memcpy(spec->states_bitarray[odd_even], ctx->nonces[byte].states_bitarray[odd_even], sizeof(uint32_t) * (1 << 19));
+        spec->num_states_bitarray[odd_even] = ctx->nonces[byte].num_states_bitarray[odd_even];
+        bitarray_to_list(byte, spec->states_bitarray[odd_even], spec->states[odd_even], &spec->len[odd_even], odd_even);
+    }
+    pthread_mutex_init(&spec->mutex, NULL);
+    spec->batch_size = MAX(1, tables->brute_force_per_second * SPECULATION_BATCH_TIME / MAX(1, spec->len[EVEN_STATE]));
+
+    spec->run = brute_force_bs_start(true, ctx, ctx->cuid, ctx->num_acquired_nonces, spec->nonces, spec->best_first_bytes, &spec->test_nonces);
+    spec->stop = false;
+    if (pthread_create(&spec->thread, NULL, speculation_thread, spec)) {
+        printf("Couldn't start the speculative brute force. Aborting...\n");
+        exit(4);
+    }
+    return spec;
+}
+
+
+// copy the states the acquisition has excluded since the last call into the speculation's bitarrays
+static void refresh_speculation(speculation_t *spec) {
+    uint32_t *const *bitarray = ctx->nonces[spec->byte].states_bitarray;
+    const uint32_t *num_states = ctx->nonces[spec->byte].num_states_bitarray;
+    if (num_states[ODD_STATE] == spec->num_states_bitarray[ODD_STATE] && num_states[EVEN_STATE] == spec->num_states_bitarray[EVEN_STATE]) {
+        return;
+    }
+    pthread_mutex_lock(&spec->mutex);
+    for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+        memcpy(spec->states_bitarray[odd_even], bitarray[odd_even], sizeof(uint32_t) * (1 << 19));
+        spec->num_states_bitarray[odd_even] = num_states[odd_even];
+    }
+    pthread_mutex_unlock(&spec->mutex);
+}
+
+
+static bool finish_speculation(speculation_t *spec, uint64_t *key) {
+    __atomic_store_n(&spec->stop, true, __ATOMIC_RELEASE);
+    pthread_join(spec->thread, NULL);
+    bool key_found = brute_force_bs_finish(spec->run, NULL, key);
+    for (uint16_t i = 0; i < 256; i++) {
+        free_nonce_list(spec->nonces[i].first);
+    }
+    free(spec->nonces);
+    free(spec->states[ODD_STATE]);
+    free(spec->states[EVEN_STATE]);
+    free_bitarray(spec->states_bitarray[ODD_STATE]);
+    free_bitarray(spec->states_bitarray[EVEN_STATE]);
+    pthread_mutex_destroy(&spec->mutex);
+    free(spec);
+    return key_found;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// nonce acquisition pipeline
+// The reader thread talks to the card and pushes the encrypted nonces into a lock-free single producer / single
+// consumer ring. The analysis loop drains the ring in batches, applies the properties and tells the reader when to stop.
+// Either side sleeps on the ring's condition variable while the ring is empty (or full) and is woken by the other.
+
+struct nonce_reader_args {
+    hardnested_ctx_t *ctx;
+    mftag *tag;                 // tag and reader of the thread which started the acquisition
+    mfreader *reader;
+    int e_sector;
+    int a_sector;
+    bool dumpKeysA;
+};
+
+
+// wake up the other side of the ring after head, tail or one of the flags has been updated
+static void notify_nonce_ring(void) {
+    pthread_mutex_lock(&ctx->nonce_ring.mutex);
+    pthread_cond_broadcast(&ctx->nonce_ring.cond);
+    pthread_mutex_unlock(&ctx->nonce_ring.mutex);
+}
+
+
+static void
+#ifdef __has_attribute
+#if __has_attribute(force_align_arg_pointer)
+__attribute__((force_align_arg_pointer))
+#endif
+#endif
+*nonce_reader_thread(void *args) {
+    struct nonce_reader_args *reader_args = (struct nonce_reader_args *) args;
+    bind_ctx(reader_args->ctx);
+    pKeys pk = {NULL, 0};
+    uint32_t enc_bytes = 0;
+    uint8_t parbits = 0;
+
+    while (!__atomic_load_n(&ctx->nonce_ring.stop, __ATOMIC_ACQUIRE)) {
+        uint32_t head = ctx->nonce_ring.head;
+        if (head - __atomic_load_n(&ctx->nonce_ring.tail, __ATOMIC_ACQUIRE) == NONCE_RING_SIZE) { // ring is full. Wait for the analysis to catch up
+            pthread_mutex_lock(&ctx->nonce_ring.mutex);
+            while (head - __atomic_load_n(&ctx->nonce_ring.tail, __ATOMIC_ACQUIRE) == NONCE_RING_SIZE
+                    && !__atomic_load_n(&ctx->nonce_ring.stop, __ATOMIC_ACQUIRE)) {
+                pthread_cond_wait(&ctx->nonce_ring.cond, &ctx->nonce_ring.mutex);
+            }
+            pthread_mutex_unlock(&ctx->nonce_ring.mutex);
+            continue;
+        }
+
+        nfc_device_set_property_bool(reader_args->reader->pdi, NP_HANDLE_CRC, true);
+        nfc_device_set_property_bool(reader_args->reader->pdi, NP_HANDLE_PARITY, true);
+        if (mf_enhanced_auth(reader_args->e_sector, reader_args->a_sector, *reader_args->tag, *reader_args->reader, 0, &pk, 'h', reader_args->dumpKeysA, &enc_bytes, &parbits) == AUTH_TAG_LOST) {
+            __atomic_store_n(&ctx->nonce_ring.tag_lost, true, __ATOMIC_RELEASE);
+            notify_nonce_ring();
+            break;
+        }
+
+        if (!mf_configure(reader_args->reader->pdi) || !mf_anticollision(*reader_args->tag, *reader_args->reader)) {
+            __atomic_store_n(&ctx->nonce_ring.tag_lost, true, __ATOMIC_RELEASE);
+            notify_nonce_ring();
+            break;
+        }
+
+        ctx->nonce_ring.entry[head & (NONCE_RING_SIZE - 1)].nonce_enc = enc_bytes;
+        ctx->nonce_ring.entry[head & (NONCE_RING_SIZE - 1)].par_enc = parbits;
+        __atomic_store_n(&ctx->nonce_ring.head, head + 1, __ATOMIC_RELEASE);
+        notify_nonce_ring();
+    }
+
+    nfc_device_set_property_bool(reader_args->reader->pdi, NP_HANDLE_CRC, true);
+    nfc_device_set_property_bool(reader_args->reader->pdi, NP_HANDLE_PARITY, true);
+    return NULL;
+}
+
+
+static uint32_t drain_nonce_ring(void) {
+    uint32_t head = __atomic_load_n(&ctx->nonce_ring.head, __ATOMIC_ACQUIRE);
+    if (head == ctx->nonce_ring.tail) { // nothing to do yet
+        pthread_mutex_lock(&ctx->nonce_ring.mutex);
+        while ((head = __atomic_load_n(&ctx->nonce_ring.head, __ATOMIC_ACQUIRE)) == ctx->nonce_ring.tail
+                && !__atomic_load_n(&ctx->nonce_ring.tag_lost, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&ctx->nonce_ring.cond, &ctx->nonce_ring.mutex);
+        }
+        pthread_mutex_unlock(&ctx->nonce_ring.mutex);
+        if (head == ctx->nonce_ring.tail) {
+            return 0; // the tag is lost, there will be nothing any more
+        }
+    }
+
+    uint32_t num_new_nonces = 0;
+    for (uint32_t tail = ctx->nonce_ring.tail; tail != head; tail++) {
+        nonce_ring_entry_t *entry = &ctx->nonce_ring.entry[tail & (NONCE_RING_SIZE - 1)];
+        num_new_nonces += add_nonce(entry->nonce_enc, entry->par_enc);
+    }
+    __atomic_store_n(&ctx->nonce_ring.tail, head, __ATOMIC_RELEASE);
+    notify_nonce_ring();
+    return num_new_nonces;
+}
+
+
+// Cards which will never give the nonces the attack needs are recognized within the first few windows: a static
+// encrypted nonce (or a reader returning the same frame again and again) gives hardly any new nonces, a biased one
+// leaves out first bytes, and corrupted frames contradict the parity bits of earlier ones.
+static int check_acquisition_health(void) {
+    uint32_t samples = ctx->health.num_samples - ctx->health.window_samples;
+    if (samples < HEALTH_WINDOW) {
+        return HARDNESTED_OK;
+    }
+    uint32_t new_nonces = ctx->num_acquired_nonces - ctx->health.window_new_nonces;
+    uint32_t parity_errors = ctx->health.num_parity_errors - ctx->health.window_parity_errors;
+    ctx->health.window_samples = ctx->health.num_samples;
+    ctx->health.window_new_nonces = ctx->num_acquired_nonces;
+    ctx->health.window_parity_errors = ctx->health.num_parity_errors;
+
+    if (new_nonces < HEALTH_MIN_NEW_RATE * samples) {
+        return HARDNESTED_STATIC_NONCE;
+    }
+    if (parity_errors > HEALTH_MAX_PARITY_ERRORS * samples) {
+        return HARDNESTED_PARITY_ERRORS;
+    }
+    // uniform first bytes cover 256 * (1 - (255/256)^n) values after n nonces, e.g. 162 after 256 nonces
+    float expected_first_bytes = 256.0 * (1.0 - pow(255.0 / 256.0, ctx->health.num_samples));
+    if (ctx->first_byte_num < expected_first_bytes / 2
+            || (ctx->health.num_samples >= HEALTH_FULL_COVERAGE && ctx->first_byte_num < 256)) {
+        return HARDNESTED_BIASED_NONCE;
+    }
+    return HARDNESTED_OK;
+}
+
+
+// tell the reader to stop and wait for its last transaction to complete
+static void stop_nonce_reader(pthread_t reader_thread) {
+    __atomic_store_n(&ctx->nonce_ring.stop, true, __ATOMIC_RELEASE);
+    notify_nonce_ring();
+    pthread_join(reader_thread, NULL);
+    pthread_cond_destroy(&ctx->nonce_ring.cond);
+    pthread_mutex_destroy(&ctx->nonce_ring.mutex);
+}
+
+
+static int acquire_nonces(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType) {
+    ctx->last_sample_clock = msclock();
+    ctx->sample_period = 2000; // initial rough estimate. Will be refined.
+    ctx->hardnested_stage = CHECK_1ST_BYTES;
+    bool acquisition_completed = false;
+    float brute_force;
+    bool reported_suma8 = false;
+    speculation_t *spec = NULL;
+    int status = HARDNESTED_OK;
+
+    ctx->num_acquired_nonces = 0;
+
+    struct nonce_reader_args reader_args;
+    reader_args.ctx = ctx;
+    reader_args.tag = &t;
+    reader_args.reader = &r;
+    reader_args.e_sector = block_to_sector(blockNo);
+    reader_args.a_sector = block_to_sector(trgBlockNo);
+    reader_args.dumpKeysA = (trgKeyType == MC_AUTH_A ? true : false);
+
+    ctx->nonce_ring.head = 0;
+    ctx->nonce_ring.tail = 0;
+    ctx->nonce_ring.stop = false;
+    ctx->nonce_ring.tag_lost = false;
+    pthread_mutex_init(&ctx->nonce_ring.mutex, NULL);
+    pthread_cond_init(&ctx->nonce_ring.cond, NULL);
+    pthread_t reader_thread;
+    if (pthread_create(&reader_thread, NULL, nonce_reader_thread, &reader_args)) {
+        hardnested_print_progress(ctx, 0, "Aborting: couldn't start the nonce reader", 0, 0, true);
+        pthread_cond_destroy(&ctx->nonce_ring.cond);
+        pthread_mutex_destroy(&ctx->nonce_ring.mutex);
+        return HARDNESTED_NO_READER;
+    }
+
+    do {
+        ctx->num_acquired_nonces += drain_nonce_ring();
+        if (__atomic_load_n(&ctx->nonce_ring.tag_lost, __ATOMIC_ACQUIRE)) {
+            status = HARDNESTED_TAG_LOST;
+            break;
+        }
+        if ((status = check_acquisition_health()) != HARDNESTED_OK) {
+            break;
+        }
+        if (ctx->first_byte_num == 256) {
+            if (ctx->hardnested_stage == CHECK_1ST_BYTES) {
+                for (uint16_t i = 0; i < NUM_SUMS; i++) {
+                    if (ctx->first_byte_Sum == sums[i]) {
+                        ctx->first_byte_Sum = i;
+                        break;
+                    }
+                }
+                ctx->hardnested_stage |= CHECK_2ND_BYTES;
+                apply_sum_a0();
+            }
+            update_nonce_data(true);
+            acquisition_completed = shrink_key_space(&brute_force);
+            if (!reported_suma8) {
+                char progress_string[80];
+                sprintf(progress_string, "Apply Sum property. Sum(a0) = %d", sums[ctx->first_byte_Sum]);
+                hardnested_print_progress(ctx, ctx->num_acquired_nonces, progress_string, brute_force, 0, true);
+                reported_suma8 = true;
+            } else {
+                hardnested_print_progress(ctx, ctx->num_acquired_nonces, "Apply bit flip properties", brute_force, 0, false);
+            }
+        } else {
+            update_nonce_data(true);
+            acquisition_completed = shrink_key_space(&brute_force);
+            hardnested_print_progress(ctx, ctx->num_acquired_nonces, "Apply bit flip properties", brute_force, 0, false);
+        }
+
+        if (tables->speculative && spec == NULL && !acquisition_completed && (ctx->hardnested_stage & CHECK_2ND_BYTES)) {
+            uint8_t byte = ctx->best_first_byte_smallest_bitarray;
+            float num_states = (float) ctx->nonces[byte].num_states_bitarray[ODD_STATE] * ctx->nonces[byte].num_states_bitarray[EVEN_STATE];
+            if (num_states / tables->brute_force_per_second < SPECULATION_TIME) {
+                hardnested_print_progress(ctx, ctx->num_acquired_nonces, "Starting speculative brute force", num_states / 2.0, 0, true);
+                spec = start_speculation(byte);
+            }
+        }
+        if (spec != NULL) {
+            refresh_speculation(spec);
+            if (brute_force_bs_key_found(spec->run)) {
+                acquisition_completed = true;
+            }
+        }
+
+        if (msclock() - ctx->last_sample_clock < ctx->sample_period) {
+            ctx->sample_period = msclock() - ctx->last_sample_clock;
+        }
+        ctx->last_sample_clock = msclock();
+    } while (!acquisition_completed);
+
+    if (spec != NULL) {
+        ctx->key_found = finish_speculation(spec, &ctx->found_key);
+    }
+
+    if (status != HARDNESTED_OK && !ctx->key_found) {
+        stop_nonce_reader(reader_thread);
+        char progress_text[80];
+        sprintf(progress_text, "Aborting: %s (%" PRIu32 " of %" PRIu32 " nonces new)",
+                status == HARDNESTED_STATIC_NONCE ? "static encrypted nonce" : status == HARDNESTED_BIASED_NONCE ? "biased encrypted nonce" :
+                status == HARDNESTED_PARITY_ERRORS ? "inconsistent parity bits" : "tag removed",
+                ctx->num_acquired_nonces, ctx->health.num_samples);
+        hardnested_print_progress(ctx, ctx->num_acquired_nonces, progress_text, 0, 0, true);
+        return status;
+    }
+
+    ctx->acquisition_end_time = msclock();
+    ctx->predicted_time_to_key = brute_force / effective_brute_force_rate();
+    char progress_text[80];
+    sprintf(progress_text, "Predicted time to key: %1.0fs", ctx->predicted_time_to_key);
+    hardnested_print_progress(ctx, ctx->num_acquired_nonces, progress_text, brute_force, 0, true);
+
+    stop_nonce_reader(reader_thread);
+    return HARDNESTED_OK;
+}
+
+
+hardnested_tables_t *hardnested_tables_create(bool hard_low_memory, bool hard_speculative, float hard_sum_a8_risk) {
+    hardnested_tables_t *new_tables = calloc(1, sizeof(hardnested_tables_t));
+    if (new_tables == NULL) {
+        printf("Out of memory error in hardnested_tables_create(). Aborting...\n");
+        exit(4);
+    }
+    tables = new_tables;
+    tables->low_memory = hard_low_memory;
+    tables->speculative = hard_speculative;
+    tables->sum_a8_risk = hard_sum_a8_risk;
+
+    srand((unsigned) time(NULL));
+    tables->brute_force_per_second = brute_force_benchmark();
+    init_bitflip_bitarrays();
+    for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+        tables->part_sum_idx[odd_even] = malloc(1 << 20);
+        if (tables->part_sum_idx[odd_even] == NULL) {
+            printf("Out of memory error in hardnested_tables_create(). Aborting...\n");
+            exit(4);
+        }
+    }
+    calc_part_sum_idx(tables->part_sum_idx);
+    init_sum_bitarrays();
+    if (!tables->low_memory) {
+        // low memory mode recalculates them for each target instead
+        calc_part_sum_bitarrays(tables->precalc_part_sum_a0_bitarrays, tables->precalc_part_sum_a8_bitarrays);
+    }
+    init_hypergeometric_tables();
+    return new_tables;
+}
+
+
+void hardnested_tables_free(hardnested_tables_t *old_tables) {
+    if (old_tables == NULL) {
+        return;
+    }
+    tables = old_tables;
+    free_hypergeometric_tables();
+    free_sum_bitarrays();
+    if (!tables->low_memory) {
+        free_part_sum_bitarrays_of(tables->precalc_part_sum_a0_bitarrays, tables->precalc_part_sum_a8_bitarrays);
+    }
+    free(tables->part_sum_idx[ODD_STATE]);
+    free(tables->part_sum_idx[EVEN_STATE]);
+    free_bitflip_bitarrays();
+    free(tables);
+    tables = NULL;
+}
+
+
+hardnested_ctx_t *hardnested_acquire(hardnested_tables_t *hardnested_tables, uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, int *status) {
+    hardnested_ctx_t *attack = calloc(1, sizeof(hardnested_ctx_t));
+    if (attack == NULL) {
+        printf("Out of memory error in hardnested_acquire(). Aborting...\n");
+        exit(4);
+    }
+    attack->tables = hardnested_tables;
+    bind_ctx(attack);
+    ctx->targetBLOCK = trgBlockNo;
+    ctx->targetKEY = trgKeyType;
+    ctx->cuid = t.authuid;
+    ctx->p_K_generation = 1;
+    ctx->known_target_key = -1;
+
     char progress_text[80];
-    cuid = t.authuid;
 
 #ifdef X86_SIMD
     char instr_set[12] = {0};
@@ -1776,88 +2878,306 @@ int mfnestedhard(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBloc
     PrintAndLog(true, "Using %s SIMD core.", instr_set);
 #endif
 
-    srand((unsigned) time(NULL));
-    brute_force_per_second = brute_force_benchmark();
-    write_stats = false;
-    start_time = msclock();
+    ctx->start_time = msclock();
     print_progress_header();
-    sprintf(progress_text, "Brute force benchmark: %1.0f million (2^%1.1f) keys/s", brute_force_per_second / 1000000, log(brute_force_per_second) / log(2.0));
-    hardnested_print_progress(0, progress_text, (float) (1LL << 47), 0, targetBLOCK, targetKEY, true);
-    init_bitflip_bitarrays();
-//    exit(0);
+    sprintf(progress_text, "Brute force benchmark: %1.0f million (2^%1.1f) keys/s", tables->brute_force_per_second / 1000000, log(tables->brute_force_per_second) / log(2.0));
+    hardnested_print_progress(ctx, 0, progress_text, (float) (1LL << 47), 0, true);
+    sprintf(progress_text, "Using %d precalculated bitflip state tables", tables->num_all_effective_bitflips);
+    hardnested_print_progress(ctx, 0, progress_text, (float) (1LL << 47), 0, true);
     init_part_sum_bitarrays();
-    init_sum_bitarrays();
     init_allbitflips_array();
     init_nonce_memory();
-    update_reduction_rate(0.0, true);
+    init_cost_model();
 
-    uint16_t is_OK = acquire_nonces(blockNo, keyType, key, trgBlockNo, trgKeyType);
-    if (is_OK != 0) {
-		free_bitflip_bitarrays();
-        free_nonces_memory();
-        free_bitarray(all_bitflips_bitarray[ODD_STATE]);
-        free_bitarray(all_bitflips_bitarray[EVEN_STATE]);
-        free_sum_bitarrays();
-        free_part_sum_bitarrays();
-        return is_OK;
-    }
+    *status = acquire_nonces(blockNo, keyType, key, trgBlockNo, trgKeyType);
+    return attack;
+}
 
-    known_target_key = -1;
+
+void hardnested_ctx_free(hardnested_ctx_t *attack) {
+    bind_ctx(attack);
+    free_nonces_memory();
+    free_bitarray(ctx->all_bitflips_bitarray[ODD_STATE]);
+    free_bitarray(ctx->all_bitflips_bitarray[EVEN_STATE]);
+    free_part_sum_bitarrays();
+    free(attack);
+    ctx = NULL;
+}
+
+
+bool hardnested_solve(hardnested_ctx_t *attack, uint64_t *found_key) {
+    bind_ctx(attack);
+    char progress_text[80];
+
+    if (ctx->key_found) { // by the speculative brute force during the acquisition
+        if (found_key != NULL) {
+            *found_key = ctx->found_key;
+        }
+        return true;
+    }
 
     Tests();
 
-    free_bitflip_bitarrays();
-    bool key_found = false;
-    num_keys_tested = 0;
-    uint32_t num_odd = nonces[best_first_byte_smallest_bitarray].num_states_bitarray[ODD_STATE];
-    uint32_t num_even = nonces[best_first_byte_smallest_bitarray].num_states_bitarray[EVEN_STATE];
+    ctx->key_found = false;
+    ctx->num_keys_tested = 0;
+    uint32_t num_odd = ctx->nonces[ctx->best_first_byte_smallest_bitarray].num_states_bitarray[ODD_STATE];
+    uint32_t num_even = ctx->nonces[ctx->best_first_byte_smallest_bitarray].num_states_bitarray[EVEN_STATE];
     float expected_brute_force1 = (float) num_odd * num_even / 2.0;
-    float expected_brute_force2 = nonces[best_first_bytes[0]].expected_num_brute_force;
+    float expected_brute_force2 = ctx->nonces[ctx->best_first_bytes[0]].expected_num_brute_force;
     if (expected_brute_force1 < expected_brute_force2) {
-        hardnested_print_progress(num_acquired_nonces, "(Ignoring Sum(a8) properties)", expected_brute_force1, 0, trgBlockNo, trgKeyType, true);
-        set_test_state(best_first_byte_smallest_bitarray);
-        add_bitflip_candidates(best_first_byte_smallest_bitarray);
+        hardnested_print_progress(ctx, ctx->num_acquired_nonces, "(Ignoring Sum(a8) properties)", expected_brute_force1, 0, true);
+        set_test_state(ctx->best_first_byte_smallest_bitarray);
+        uint64_t generation_start = msclock();
+        add_bitflip_candidates(ctx->best_first_byte_smallest_bitarray);
+        update_generation_cost(msclock() - generation_start, expected_brute_force1);
         Tests2();
-        maximum_states = 0;
-        for (statelist_t *sl = candidates; sl != NULL; sl = sl->next) {
-            maximum_states += (uint64_t) sl->len[ODD_STATE] * sl->len[EVEN_STATE];
+        ctx->maximum_states = 0;
+        for (statelist_t *sl = ctx->candidates; sl != NULL; sl = sl->next) {
+            ctx->maximum_states += (uint64_t) sl->len[ODD_STATE] * sl->len[EVEN_STATE];
         }
-        best_first_bytes[0] = best_first_byte_smallest_bitarray;
+        ctx->best_first_bytes[0] = ctx->best_first_byte_smallest_bitarray;
         pre_XOR_nonces();
-        prepare_bf_test_nonces(nonces, best_first_bytes[0]);
-        hardnested_print_progress(num_acquired_nonces, "Starting brute force...", expected_brute_force1, 0, trgBlockNo, trgKeyType, true);
-        brute_force(trgBlockNo, trgKeyType);
-        free(candidates->states[ODD_STATE]);
-        free(candidates->states[EVEN_STATE]);
-        free_candidates_memory(candidates);
-        candidates = NULL;
+        prepare_bf_test_nonces(ctx->nonces, ctx->best_first_bytes[0], &ctx->bf_test_nonces);
+        hardnested_print_progress(ctx, ctx->num_acquired_nonces, "Starting brute force...", expected_brute_force1, 0, true);
+        ctx->key_found = brute_force();
+        free(ctx->candidates->states[ODD_STATE]);
+        free(ctx->candidates->states[EVEN_STATE]);
+        free_candidates_memory(ctx->candidates);
+        ctx->candidates = NULL;
     } else {
         pre_XOR_nonces();
-        prepare_bf_test_nonces(nonces, best_first_bytes[0]);
-        for (uint8_t j = 0; j < NUM_SUMS && !key_found; j++) {
-            float expected_brute_force = nonces[best_first_bytes[0]].expected_num_brute_force;
-            sprintf(progress_text, "(%d. guess: Sum(a8) = %" PRIu16 ")", j + 1, sums[nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx]);
-            hardnested_print_progress(num_acquired_nonces, progress_text, expected_brute_force, 0, trgBlockNo, trgKeyType, true);
-            generate_candidates(first_byte_Sum, nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx);
-            hardnested_print_progress(num_acquired_nonces, "Starting brute force...", expected_brute_force, 0, trgBlockNo, trgKeyType, true);
-            key_found = brute_force(trgBlockNo, trgKeyType);
-            free_statelist_cache();
-            free_candidates_memory(candidates);
-            candidates = NULL;
-            if (!key_found) {
-                // update the statistics
-                nonces[best_first_bytes[0]].sum_a8_guess[j].prob = 0;
-                nonces[best_first_bytes[0]].sum_a8_guess[j].num_states = 0;
-                // and calculate new expected number of brute forces
-                update_expected_brute_force(best_first_bytes[0]);
+        prepare_bf_test_nonces(ctx->nonces, ctx->best_first_bytes[0], &ctx->bf_test_nonces);
+        uint8_t best_byte = ctx->best_first_bytes[0];
+        guess_sum_a8_t sum_a8_guess[NUM_SUMS];
+        memcpy(sum_a8_guess, ctx->nonces[best_byte].sum_a8_guess, sizeof(sum_a8_guess));
+        select_sum_a8_filters(best_byte);
+        bool retry;
+        do {
+            bool tried[NUM_SUMS] = {false};
+            for (uint8_t j = 0; j < NUM_SUMS && !ctx->key_found && !is_cancelled(); j++) {
+                uint8_t order[NUM_SUMS];
+                schedule_sum_a8_guesses(ctx->best_first_bytes[0], order);
+                uint8_t k = 0;
+                while (tried[order[k]]) {
+                    k++;
+                }
+                tried[order[k]] = true;
+                guess_sum_a8_t *guess = &ctx->nonces[ctx->best_first_bytes[0]].sum_a8_guess[order[k]];
+                float expected_brute_force = ctx->nonces[ctx->best_first_bytes[0]].expected_num_brute_force;
+                sprintf(progress_text, "(%d. guess: Sum(a8) = %" PRIu16 ", p = %1.3f)", j + 1, sums[guess->sum_a8_idx], guess->prob);
+                hardnested_print_progress(ctx, ctx->num_acquired_nonces, progress_text, expected_brute_force, 0, true);
+                hardnested_print_progress(ctx, ctx->num_acquired_nonces, "Starting brute force...", expected_brute_force, 0, true);
+                bf_run_t *bf_run = brute_force_bs_start(false, ctx, ctx->cuid, ctx->num_acquired_nonces, ctx->nonces, ctx->best_first_bytes, &ctx->bf_test_nonces);
+                set_current_run(bf_run);
+                uint64_t generation_time;
+                generate_candidates(ctx->first_byte_Sum, guess->sum_a8_idx, bf_run, &generation_time);
+                update_generation_cost(generation_time, (float) ctx->maximum_states / 2.0);
+                if (ctx->known_target_key != -1) {
+                    TestIfKeyExists(ctx->known_target_key);
+                }
+                set_current_run(NULL);
+                ctx->key_found = brute_force_bs_finish(bf_run, NULL, &ctx->found_key);
+                free_statelist_cache();
+                free_candidates_memory(ctx->candidates);
+                ctx->candidates = NULL;
+                if (!ctx->key_found) {
+                    // update the statistics
+                    guess->prob = 0;
+                    guess->num_states = 0;
+                    // and calculate new expected number of brute forces
+                    update_expected_brute_force(ctx->best_first_bytes[0]);
+                }
+            }
+            // all guesses failed: the Sum(a8) of a secondary byte must have been wrong. Start over without them
+            retry = !ctx->key_found && ctx->num_sum_a8_filters > 0 && !is_cancelled();
+            if (retry) {
+                ctx->num_sum_a8_filters = 0;
+                memcpy(ctx->nonces[best_byte].sum_a8_guess, sum_a8_guess, sizeof(sum_a8_guess));
+                update_expected_brute_force(best_byte);
+                hardnested_print_progress(ctx, ctx->num_acquired_nonces, "(Key not found, retrying without the secondary Sum(a8) filters)", ctx->nonces[best_byte].expected_num_brute_force, 0, true);
             }
+        } while (retry);
+    }
+
+    sprintf(progress_text, "Actual time to key: %1.0fs (predicted %1.0fs)", (float) (msclock() - ctx->acquisition_end_time) / 1000.0, ctx->predicted_time_to_key);
+    hardnested_print_progress(ctx, ctx->num_acquired_nonces, progress_text, 0, 0, true);
+
+    if (ctx->key_found && found_key != NULL) {
+        *found_key = ctx->found_key;
+    }
+    return ctx->key_found;
+}
+
+
+static void store_found_key(uint8_t trgBlockNo, uint8_t trgKeyType, uint64_t key) {
+    if (trgKeyType == MC_AUTH_A) {
+        t.sectors[block_to_sector(trgBlockNo)].foundKeyA = true;
+        num_to_bytes(key, 6, t.sectors[block_to_sector(trgBlockNo)].KeyA);
+    } else {
+        t.sectors[block_to_sector(trgBlockNo)].foundKeyB = true;
+        num_to_bytes(key, 6, t.sectors[block_to_sector(trgBlockNo)].KeyB);
+    }
+}
+
+
+int mfnestedhard(hardnested_tables_t *hardnested_tables, uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType) {
+    int status;
+    hardnested_ctx_t *attack = hardnested_acquire(hardnested_tables, blockNo, keyType, key, trgBlockNo, trgKeyType, &status);
+    if (status == 0) {
+        uint64_t found_key;
+        if (hardnested_solve(attack, &found_key)) {
+            store_found_key(trgBlockNo, trgKeyType, found_key);
         }
     }
+    hardnested_ctx_free(attack);
+    return status;
+}
 
-    free_nonces_memory();
-    free_bitarray(all_bitflips_bitarray[ODD_STATE]);
-    free_bitarray(all_bitflips_bitarray[EVEN_STATE]);
-    free_sum_bitarrays();
-    free_part_sum_bitarrays();
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// background solving
+// Candidate generation and brute force of a target run on a background thread while the reader is free to acquire
+// the nonces of the next target. Concurrent solves share the worker pool and the tables. Jobs belong to the thread
+// which started them, so that each reader in fleet mode only collects the keys of its own card.
+
+typedef struct hardnested_job {
+    hardnested_ctx_t *attack;
+    pthread_t owner;
+    pthread_t thread;
+    bool done;
+    hardnested_result_t result;
+    struct hardnested_job *next;
+} hardnested_job_t;
+
+static hardnested_job_t *pending_jobs = NULL;
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+
+static void
+#ifdef __has_attribute
+#if __has_attribute(force_align_arg_pointer)
+__attribute__((force_align_arg_pointer))
+#endif
+#endif
+*hardnested_job_thread(void *args) {
+    hardnested_job_t *job = (hardnested_job_t *) args;
+
+    job->result.key_found = hardnested_solve(job->attack, &job->result.key);
+
+    pthread_mutex_lock(&jobs_mutex);
+    hardnested_ctx_t *attack = job->attack;
+    job->attack = NULL; // hardnested_background_cancel() can't reach it any more
+    pthread_mutex_unlock(&jobs_mutex);
+    hardnested_ctx_free(attack);
+
+    pthread_mutex_lock(&jobs_mutex);
+    job->done = true;
+    pthread_cond_broadcast(&jobs_cond);
+    pthread_mutex_unlock(&jobs_mutex);
+    return NULL;
+}
+
+
+int mfnestedhard_background(hardnested_tables_t *hardnested_tables, uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType) {
+    int status;
+    hardnested_ctx_t *attack = hardnested_acquire(hardnested_tables, blockNo, keyType, key, trgBlockNo, trgKeyType, &status);
+    if (status != 0) {
+        hardnested_ctx_free(attack);
+        return status;
+    }
+
+    hardnested_job_t *job = calloc(1, sizeof(hardnested_job_t));
+    if (job == NULL) {
+        printf("Out of memory error in mfnestedhard_background(). Aborting...\n");
+        exit(4);
+    }
+    job->attack = attack;
+    job->owner = pthread_self();
+    job->result.trgBlockNo = trgBlockNo;
+    job->result.trgKeyType = trgKeyType;
+
+    // the job is only linked once its thread runs. Holding the lock meanwhile is fine, the thread takes it when done
+    pthread_mutex_lock(&jobs_mutex);
+    if (pthread_create(&job->thread, NULL, hardnested_job_thread, job)) {
+        pthread_mutex_unlock(&jobs_mutex);
+        free(job);
+        printf("Couldn't start the background solve, solving now.\n");
+        uint64_t found_key;
+        if (hardnested_solve(attack, &found_key)) {
+            store_found_key(trgBlockNo, trgKeyType, found_key);
+        }
+        hardnested_ctx_free(attack);
+        return 0;
+    }
+    job->next = pending_jobs;
+    pending_jobs = job;
+    pthread_mutex_unlock(&jobs_mutex);
+    ctx = NULL; // the attack is owned by the job thread from now on
     return 0;
 }
+
+
+bool hardnested_background_pending(uint8_t trgBlockNo, uint8_t trgKeyType) {
+    bool pending = false;
+    pthread_mutex_lock(&jobs_mutex);
+    for (hardnested_job_t *job = pending_jobs; job != NULL; job = job->next) {
+        if (pthread_equal(job->owner, pthread_self()) && job->result.trgBlockNo == trgBlockNo && job->result.trgKeyType == trgKeyType) {
+            pending = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+    return pending;
+}
+
+
+void hardnested_background_cancel(void) {
+    pthread_mutex_lock(&jobs_mutex);
+    for (hardnested_job_t *job = pending_jobs; job != NULL; job = job->next) {
+        if (pthread_equal(job->owner, pthread_self()) && job->attack != NULL) {
+            hardnested_cancel(job->attack);
+        }
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+
+bool hardnested_background_result(hardnested_result_t *result, bool wait) {
+    hardnested_job_t *job = NULL;
+
+    pthread_mutex_lock(&jobs_mutex);
+    while (true) {
+        bool own_jobs = false;
+        hardnested_job_t **p;
+        for (p = &pending_jobs; *p != NULL; p = &(*p)->next) {
+            if (pthread_equal((*p)->owner, pthread_self())) {
+                own_jobs = true;
+                if ((*p)->done) {
+                    break;
+                }
+            }
+        }
+        if (*p != NULL) {
+            job = *p;
+            *p = job->next;
+            break;
+        }
+        if (!own_jobs || !wait) {
+            break;
+        }
+        pthread_cond_wait(&jobs_cond, &jobs_mutex);
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+
+    if (job == NULL) {
+        return false;
+    }
+    pthread_join(job->thread, NULL);
+    *result = job->result;
+    if (result->key_found) {
+        store_found_key(result->trgBlockNo, result->trgKeyType, result->key);
+    }
+    free(job);
+    return true;
+}
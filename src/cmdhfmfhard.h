@@ -53,8 +53,45 @@ typedef struct noncelist {
     noncelistentry_t *first;
 } noncelist_t;
 
-int mfnestedhard(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, bool hard_low_memory);
-void hardnested_print_progress(uint32_t nonces, char *activity, float brute_force, uint64_t min_diff_print_time, uint8_t trgKeyBlock, uint8_t trgKeyType, bool newline);
+// Target independent tables (bitflip and sum property bitarrays, brute force benchmark).
+// Create them once and reuse them for all sectors and key types of a card.
+typedef struct hardnested_tables hardnested_tables_t;
+
+// One attack on a target sector and key type. Holds the nonces and all other target dependent data.
+typedef struct hardnested_ctx hardnested_ctx_t;
+
+// status of hardnested_acquire(), mfnestedhard() and mfnestedhard_background()
+#define HARDNESTED_OK                   0
+#define HARDNESTED_STATIC_NONCE         1   // (nearly) no new encrypted nonces, e.g. a static nonce or stuck reader
+#define HARDNESTED_BIASED_NONCE         2   // the first bytes of the encrypted nonces don't cover all values
+#define HARDNESTED_PARITY_ERRORS        3   // the parity bits of the encrypted nonces contradict each other
+#define HARDNESTED_TAG_LOST             4   // the tag has been removed (or the reader failed) during the acquisition
+#define HARDNESTED_NO_READER            5   // the thread acquiring the nonces couldn't be started
+
+typedef struct hardnested_result {
+    uint8_t trgBlockNo;
+    uint8_t trgKeyType;
+    bool key_found;
+    uint64_t key;
+} hardnested_result_t;
+
+hardnested_tables_t *hardnested_tables_create(bool hard_low_memory, bool hard_speculative, float hard_sum_a8_risk);
+void hardnested_tables_free(hardnested_tables_t *tables);
+hardnested_ctx_t *hardnested_acquire(hardnested_tables_t *tables, uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, int *status);
+bool hardnested_solve(hardnested_ctx_t *attack, uint64_t *found_key);
+void hardnested_ctx_free(hardnested_ctx_t *attack);
+// Make hardnested_solve() of the attack give up as soon as possible, from any thread. It then returns false
+void hardnested_cancel(hardnested_ctx_t *attack);
+int mfnestedhard(hardnested_tables_t *tables, uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType);
+
+// Acquire the nonces for a target and solve it in the background. The results are collected with
+// hardnested_background_result() which also stores found keys in t.sectors.
+int mfnestedhard_background(hardnested_tables_t *tables, uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType);
+bool hardnested_background_pending(uint8_t trgBlockNo, uint8_t trgKeyType);
+// Cancel the background solves started by the calling thread. Their results still have to be collected
+void hardnested_background_cancel(void);
+bool hardnested_background_result(hardnested_result_t *result, bool wait);
+void hardnested_print_progress(hardnested_ctx_t *attack, uint32_t nonces, char *activity, float brute_force, uint64_t min_diff_print_time, bool newline);
 uint8_t block_to_sector(uint8_t block);
 
 #endif
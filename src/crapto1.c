@@ -20,7 +20,11 @@
 #include "crapto1.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "parity.h"
+#include "hardnested/hardnested_cpu_dispatch.h"
+#include "hardnested/hardnested_threadpool.h"
 
 typedef struct bucket {
     uint32_t *head;
@@ -95,11 +99,44 @@ update_contribution(uint32_t *item, const uint32_t mask1, const uint32_t mask2)
     *item = p << 24 | (*item & 0xffffff);
 }
 
+#ifdef X86_SIMD
 /** extend_table
  * using a bit of the keystream extend the table of possible lfsr states
+ * fl is scratch space parallel to tbl. It gets the filter bits of both extensions of all
+ * entries up front (vectorized, see filter_flags()), an entry's flags move along with it
  */
 static inline void
-extend_table(uint32_t *tbl, uint32_t **end, int bit, int m1, int m2, uint32_t in) {
+extend_table(uint32_t *tbl, uint32_t **end, int bit, int m1, int m2, uint32_t in, uint8_t *fl) {
+    uint8_t *fl_end = fl + (*end - tbl);
+    filter_flags(tbl, fl, *end - tbl + 1);
+    in <<= 24;
+    for (*tbl <<= 1; tbl <= *end; *++tbl <<= 1, ++fl)
+        if (*fl == 1 || *fl == 2) {
+            *tbl |= (*fl & 1) ^ bit;
+            update_contribution(tbl, m1, m2);
+            *tbl ^= in;
+        } else if ((*fl & 1) == bit) {
+            *++*end = tbl[1];
+            *++fl_end = fl[1];
+            tbl[1] = tbl[0] | 1;
+            update_contribution(tbl, m1, m2);
+            *tbl++ ^= in;
+            fl++;
+            update_contribution(tbl, m1, m2);
+            *tbl ^= in;
+        } else {
+            *tbl-- = *(*end)--;
+            *fl-- = *fl_end--;
+        }
+}
+#else
+/** extend_table
+ * using a bit of the keystream extend the table of possible lfsr states
+ * the scalar filter is cheaper evaluated in the loop than in a pass of its own, fl is unused
+ */
+static inline void
+extend_table(uint32_t *tbl, uint32_t **end, int bit, int m1, int m2, uint32_t in, uint8_t *fl) {
+    (void) fl;
     in <<= 24;
     for (*tbl <<= 1; tbl <= *end; *++tbl <<= 1)
         if (filter(*tbl) ^ filter(*tbl | 1)) {
@@ -116,6 +153,7 @@ extend_table(uint32_t *tbl, uint32_t **end, int bit, int m1, int m2, uint32_t in
         } else
             *tbl-- = *(*end)--;
 }
+#endif
 
 /** extend_table_simple
  * using a bit of the keystream extend the table of possible lfsr states
@@ -132,13 +170,50 @@ static inline void extend_table_simple(uint32_t *tbl, uint32_t **end, int bit) {
             *tbl-- = *(*end)--;
 }
 
+/** extend_table_simple_flags
+ * extend_table_simple for large tables, with the filter bits evaluated up front like in extend_table
+ */
+static inline void extend_table_simple_flags(uint32_t *tbl, uint32_t **end, int bit, uint8_t *fl) {
+#ifdef X86_SIMD
+    uint8_t *fl_end = fl + (*end - tbl);
+    filter_flags(tbl, fl, *end - tbl + 1);
+    for (*tbl <<= 1; tbl <= *end; *++tbl <<= 1, ++fl)
+        if (*fl == 1 || *fl == 2)
+            *tbl |= (*fl & 1) ^ bit;
+        else if ((*fl & 1) == bit) {
+            *++*end = *++tbl;
+            *++fl_end = *++fl;
+            *tbl = tbl[-1] | 1;
+
+        } else {
+            *tbl-- = *(*end)--;
+            *fl-- = *fl_end--;
+        }
+#else
+    (void) fl;
+    extend_table_simple(tbl, end, bit);
+#endif
+}
+
+/** lfsr_recovery32_workspace
+ * the tables needed by lfsr_recovery32. Allocated once and reused for any number of recoveries
+ */
+struct lfsr_recovery32_workspace {
+    uint32_t *odd, *even;
+    uint8_t *odd_flags, *even_flags;        // filter bits, parallel to odd and even
+    uint32_t *filter_set[2];                // all 21 bit values x with filter(x) == 0 and 1, in descending order
+    uint32_t filter_set_size[2];
+    struct Crypto1State *statelist;
+    bucket_array_t bucket;
+};
+
 /** recover
  * recursively narrow down the search space, 4 bits of keystream at a time
  */
 static struct Crypto1State*
 recover(uint32_t *o_head, uint32_t *o_tail, uint32_t oks,
         uint32_t *e_head, uint32_t *e_tail, uint32_t eks, int rem,
-        struct Crypto1State *sl, uint32_t in, bucket_array_t bucket) {
+        struct Crypto1State *sl, uint32_t in, struct lfsr_recovery32_workspace *ws) {
     uint32_t *o, *e, i;
     bucket_info_t bucket_info;
 
@@ -159,35 +234,250 @@ recover(uint32_t *o_head, uint32_t *o_tail, uint32_t oks,
         eks >>= 1;
         in >>= 2;
         extend_table(o_head, &o_tail, oks & 1, LF_POLY_EVEN << 1 | 1,
-                LF_POLY_ODD << 1, 0);
+                LF_POLY_ODD << 1, 0, ws->odd_flags + (o_head - ws->odd));
         if (o_head > o_tail)
             return sl;
 
         extend_table(e_head, &e_tail, eks & 1, LF_POLY_ODD,
-                LF_POLY_EVEN << 1 | 1, in & 3);
+                LF_POLY_EVEN << 1 | 1, in & 3, ws->even_flags + (e_head - ws->even));
         if (e_head > e_tail)
             return sl;
     }
-    bucket_sort_intersect(e_head, e_tail, o_head, o_tail, &bucket_info, bucket);
+    bucket_sort_intersect(e_head, e_tail, o_head, o_tail, &bucket_info, ws->bucket);
 
     for (int i = bucket_info.numbuckets - 1; i >= 0; i--) {
         sl = recover(bucket_info.bucket_info[1][i].head, bucket_info.bucket_info[1][i].tail, oks,
                 bucket_info.bucket_info[0][i].head, bucket_info.bucket_info[0][i].tail, eks,
-                rem, sl, in, bucket);
+                rem, sl, in, ws);
     }
 
     return sl;
 }
 
-/** lfsr_recovery
+/** workspace_create
+ * tables of 2^table_bits entries and buckets of 2^bucket_bits entries. The start value sets
+ * are only needed by workspaces which begin recoveries, not by those of recover_task()
+ */
+static struct lfsr_recovery32_workspace *
+workspace_create(uint32_t table_bits, uint32_t bucket_bits, uint32_t statelist_bits, int filter_sets) {
+    struct lfsr_recovery32_workspace *ws = calloc(1, sizeof (struct lfsr_recovery32_workspace));
+    if (!ws)
+        return 0;
+
+    ws->odd = malloc(sizeof (uint32_t) << table_bits);
+    ws->even = malloc(sizeof (uint32_t) << table_bits);
+    ws->odd_flags = malloc(1 << table_bits);
+    ws->even_flags = malloc(1 << table_bits);
+    ws->statelist = malloc(sizeof (struct Crypto1State) << statelist_bits);
+    if (!ws->odd || !ws->even || !ws->odd_flags || !ws->even_flags || !ws->statelist) {
+        lfsr_recovery32_workspace_destroy(ws);
+        return 0;
+    }
+
+    // memory for out of place bucket_sort
+    for (uint32_t i = 0; i < 2; i++)
+        for (uint32_t j = 0; j <= 0xff; j++) {
+            ws->bucket[i][j].head = malloc(sizeof (uint32_t) << bucket_bits);
+            if (!ws->bucket[i][j].head) {
+                lfsr_recovery32_workspace_destroy(ws);
+                return 0;
+            }
+        }
+
+    if (!filter_sets)
+        return ws;
+
+    ws->filter_set[0] = malloc(sizeof (uint32_t) << 20);
+    ws->filter_set[1] = malloc(sizeof (uint32_t) << 20);
+    if (!ws->filter_set[0] || !ws->filter_set[1]) {
+        lfsr_recovery32_workspace_destroy(ws);
+        return 0;
+    }
+
+    // the first step of every recovery only depends on one keystream bit. filter(x) of all
+    // 2^20 + 1 start values, as filter(y << 1) and filter(y << 1 | 1) of y = x >> 1
+    for (uint32_t y = 0; y <= 1 << 19; y++)
+        ws->odd[y] = y;
+    filter_flags(ws->odd, ws->odd_flags, (1 << 19) + 1);
+    for (int x = 1 << 20; x >= 0; --x) {
+        int f = ws->odd_flags[x >> 1] >> (x & 1) & 1;
+        ws->filter_set[f][ws->filter_set_size[f]++] = x;
+    }
+
+    return ws;
+}
+
+struct lfsr_recovery32_workspace *lfsr_recovery32_workspace_create(void) {
+    return workspace_create(21, 14, 18, 1);
+}
+
+void lfsr_recovery32_workspace_destroy(struct lfsr_recovery32_workspace *ws) {
+    if (!ws)
+        return;
+
+    free(ws->odd);
+    free(ws->even);
+    free(ws->odd_flags);
+    free(ws->even_flags);
+    free(ws->filter_set[0]);
+    free(ws->filter_set[1]);
+    free(ws->statelist);
+    for (uint32_t i = 0; i < 2; i++)
+        for (uint32_t j = 0; j <= 0xff; j++)
+            free(ws->bucket[i][j].head);
+    free(ws);
+}
+
+/** recover_task
+ * the recursion below one top level bucket. Runs on its own scratch workspace, which is
+ * taken from a free list, so there are only as many of them as tasks running at once.
+ * states is 0 if out of memory
+ */
+struct recover_task {
+    uint32_t *o_head, *o_tail, oks;
+    uint32_t *e_head, *e_tail, eks;
+    int rem;
+    uint32_t in;
+    struct Crypto1State *states;
+    uint32_t num_states;
+};
+
+static pthread_mutex_t scratch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct scratch {
+    struct lfsr_recovery32_workspace *ws;
+    struct scratch *next;
+} *scratch_free = 0;
+
+static void *
+#ifdef __has_attribute
+#if __has_attribute(force_align_arg_pointer)
+__attribute__((force_align_arg_pointer))
+#endif
+#endif
+recover_task(void *arg) {
+    struct recover_task *task = arg;
+    struct scratch *scratch;
+    uint32_t num_odd = task->o_tail - task->o_head + 1;
+    uint32_t num_even = task->e_tail - task->e_head + 1;
+
+    pthread_mutex_lock(&scratch_mutex);
+    scratch = scratch_free;
+    if (scratch)
+        scratch_free = scratch->next;
+    pthread_mutex_unlock(&scratch_mutex);
+    if (!scratch) {
+        scratch = malloc(sizeof (struct scratch));
+        // buckets below the top level are small, 2^19 leaves room for the tables to grow
+        if (!scratch || !(scratch->ws = workspace_create(19, 12, 16, 0))) {
+            free(scratch);
+            task->states = 0;
+            return 0;
+        }
+    }
+
+    memcpy(scratch->ws->odd, task->o_head, sizeof (uint32_t) * num_odd);
+    memcpy(scratch->ws->even, task->e_head, sizeof (uint32_t) * num_even);
+    task->num_states = recover(scratch->ws->odd, scratch->ws->odd + num_odd - 1, task->oks,
+            scratch->ws->even, scratch->ws->even + num_even - 1, task->eks,
+            task->rem, scratch->ws->statelist, task->in, scratch->ws) - scratch->ws->statelist;
+    task->states = malloc(sizeof (struct Crypto1State) * task->num_states + 1);
+    if (task->states)
+        memcpy(task->states, scratch->ws->statelist, sizeof (struct Crypto1State) * task->num_states);
+
+    pthread_mutex_lock(&scratch_mutex);
+    scratch->next = scratch_free;
+    scratch_free = scratch;
+    pthread_mutex_unlock(&scratch_mutex);
+    return 0;
+}
+
+/** lfsr_recovery32_release
+ * free the scratch workspaces of the parallel recoveries which aren't in use. They are
+ * allocated again by the next recovery
+ */
+void lfsr_recovery32_release(void) {
+    struct scratch *scratch;
+
+    pthread_mutex_lock(&scratch_mutex);
+    while ((scratch = scratch_free)) {
+        scratch_free = scratch->next;
+        lfsr_recovery32_workspace_destroy(scratch->ws);
+        free(scratch);
+    }
+    pthread_mutex_unlock(&scratch_mutex);
+}
+
+/** recover_parallel
+ * the top level of recover. The intersecting buckets are independent, their recursions run
+ * as tasks on the worker pool. The results are concatenated in the order of recover.
+ * Returns 0 if a task ran out of memory
+ */
+static struct Crypto1State*
+recover_parallel(uint32_t *o_head, uint32_t *o_tail, uint32_t oks,
+        uint32_t *e_head, uint32_t *e_tail, uint32_t eks, int rem,
+        struct Crypto1State *sl, uint32_t in, struct lfsr_recovery32_workspace *ws) {
+    struct recover_task tasks[0x100];
+    bucket_info_t bucket_info;
+    uint32_t i, num_tasks;
+
+    for (i = 0; i < 4 && rem--; i++) {
+        oks >>= 1;
+        eks >>= 1;
+        in >>= 2;
+        extend_table(o_head, &o_tail, oks & 1, LF_POLY_EVEN << 1 | 1,
+                LF_POLY_ODD << 1, 0, ws->odd_flags + (o_head - ws->odd));
+        if (o_head > o_tail)
+            return sl;
+
+        extend_table(e_head, &e_tail, eks & 1, LF_POLY_ODD,
+                LF_POLY_EVEN << 1 | 1, in & 3, ws->even_flags + (e_head - ws->even));
+        if (e_head > e_tail)
+            return sl;
+    }
+    bucket_sort_intersect(e_head, e_tail, o_head, o_tail, &bucket_info, ws->bucket);
+
+    num_tasks = bucket_info.numbuckets;
+    for (i = 0; i < num_tasks; i++) {
+        uint32_t b = num_tasks - 1 - i;
+        tasks[i].o_head = bucket_info.bucket_info[1][b].head;
+        tasks[i].o_tail = bucket_info.bucket_info[1][b].tail;
+        tasks[i].oks = oks;
+        tasks[i].e_head = bucket_info.bucket_info[0][b].head;
+        tasks[i].e_tail = bucket_info.bucket_info[0][b].tail;
+        tasks[i].eks = eks;
+        tasks[i].rem = rem;
+        tasks[i].in = in;
+    }
+    hardnested_pool_run(recover_task, tasks, sizeof (struct recover_task), num_tasks);
+
+    for (i = 0; i < num_tasks; i++)
+        if (!tasks[i].states)
+            sl = 0;
+    for (i = 0; i < num_tasks; i++) {
+        if (sl) {
+            memcpy(sl, tasks[i].states, sizeof (struct Crypto1State) * tasks[i].num_states);
+            sl += tasks[i].num_states;
+        }
+        free(tasks[i].states);
+    }
+    if (sl)
+        sl->odd = sl->even = 0;
+
+    return sl;
+}
+
+/** lfsr_recovery32_ws
  * recover the state of the lfsr given 32 bits of the keystream
  * additionally you can use the in parameter to specify the value
- * that was fed into the lfsr at the time the keystream was generated
+ * that was fed into the lfsr at the time the keystream was generated.
+ * The returned statelist lives in the workspace: it is valid until the
+ * next recovery with the same workspace and must not be freed. Returns 0
+ * if out of memory
  */
-struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in) {
-    struct Crypto1State *statelist;
-    uint32_t *odd_head = 0, *odd_tail = 0, oks = 0;
-    uint32_t *even_head = 0, *even_tail = 0, eks = 0;
+struct Crypto1State* lfsr_recovery32_ws(uint32_t ks2, uint32_t in, struct lfsr_recovery32_workspace *ws) {
+    struct Crypto1State *statelist = ws->statelist;
+    uint32_t *odd_head = ws->odd, *odd_tail = ws->odd - 1, oks = 0;
+    uint32_t *even_head = ws->even, *even_tail = ws->even - 1, eks = 0;
     int i;
 
     for (i = 31; i >= 0; i -= 2)
@@ -195,49 +485,40 @@ struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in) {
     for (i = 30; i >= 0; i -= 2)
         eks = eks << 1 | BEBIT(ks2, i);
 
-    odd_head = odd_tail = malloc(sizeof (uint32_t) << 21);
-    even_head = even_tail = malloc(sizeof (uint32_t) << 21);
-    statelist = malloc(sizeof (struct Crypto1State) << 18);
-    if (!odd_tail-- || !even_tail-- || !statelist) {
-        free(statelist);
-        statelist = 0;
-        goto out;
-    }
     statelist->odd = statelist->even = 0;
 
-    // allocate memory for out of place bucket_sort
-    bucket_array_t bucket;
-    for (uint32_t i = 0; i < 2; i++)
-        for (uint32_t j = 0; j <= 0xff; j++) {
-            bucket[i][j].head = malloc(sizeof (uint32_t) << 14);
-            if (!bucket[i][j].head) {
-                goto out;
-            }
-        }
-
-
-    for (i = 1 << 20; i >= 0; --i) {
-        if (filter(i) == (oks & 1))
-            *++odd_tail = i;
-        if (filter(i) == (eks & 1))
-            *++even_tail = i;
-    }
+    memcpy(odd_head, ws->filter_set[oks & 1], sizeof (uint32_t) * ws->filter_set_size[oks & 1]);
+    odd_tail += ws->filter_set_size[oks & 1];
+    memcpy(even_head, ws->filter_set[eks & 1], sizeof (uint32_t) * ws->filter_set_size[eks & 1]);
+    even_tail += ws->filter_set_size[eks & 1];
 
     for (i = 0; i < 4; i++) {
-        extend_table_simple(odd_head, &odd_tail, (oks >>= 1) & 1);
-        extend_table_simple(even_head, &even_tail, (eks >>= 1) & 1);
+        extend_table_simple_flags(odd_head, &odd_tail, (oks >>= 1) & 1, ws->odd_flags);
+        extend_table_simple_flags(even_head, &even_tail, (eks >>= 1) & 1, ws->even_flags);
     }
 
     in = (in >> 16 & 0xff) | (in << 16) | (in & 0xff00);
-    recover(odd_head, odd_tail, oks,
-            even_head, even_tail, eks, 11, statelist, in << 1, bucket);
+    if (!recover_parallel(odd_head, odd_tail, oks,
+            even_head, even_tail, eks, 11, statelist, in << 1, ws))
+        return 0;
 
-out:
-    free(odd_head);
-    free(even_head);
-    for (uint32_t i = 0; i < 2; i++)
-        for (uint32_t j = 0; j <= 0xff; j++)
-            free(bucket[i][j].head);
+    return statelist;
+}
+
+/** lfsr_recovery
+ * as lfsr_recovery32_ws, with a workspace of its own. The caller frees the returned statelist
+ */
+struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in) {
+    struct Crypto1State *statelist;
+    struct lfsr_recovery32_workspace *ws = lfsr_recovery32_workspace_create();
+
+    if (!ws)
+        return 0;
+
+    statelist = lfsr_recovery32_ws(ks2, in, ws);
+    if (statelist)
+        ws->statelist = 0; // handed over to the caller
+    lfsr_recovery32_workspace_destroy(ws);
 
     return statelist;
 }
@@ -379,26 +660,14 @@ uint32_t lfsr_rollback_word(struct Crypto1State *s, uint32_t in, int fb) {
 /** nonce_distance
  * x,y valid tag nonces, then prng_successor(x, nonce_distance(x, y)) = y
  */
-static uint16_t *dist = 0;
-
 int nonce_distance(uint32_t from, uint32_t to) {
-    uint16_t x, i;
-    if (!dist) {
-        dist = malloc(2 << 16);
-        if (!dist)
-            return -1;
-        for (x = i = 1; i; ++i) {
-            dist[(x & 0xff) << 8 | x >> 8] = i;
-            x = x >> 1 | (x ^ x >> 2 ^ x >> 3 ^ x >> 5) << 15;
-        }
-    }
+    const uint16_t *dist = prng_position_table();
     return (65535 + dist[to >> 16] - dist[from >> 16]) % 65535;
 }
 
 bool validate_prng_nonce(uint32_t nonce)
 {
-  // init prng table:
-  nonce_distance(nonce, nonce);
+  const uint16_t *dist = prng_position_table();
   return ((65535 - dist[nonce >> 16] + dist[nonce & 0xffff]) % 65535) == 16;
 }
 
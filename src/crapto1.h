@@ -28,15 +28,33 @@ extern "C" {
     struct Crypto1State {
         uint32_t odd, even;
     };
+    void crypto1_init(struct Crypto1State*, uint64_t key);
     struct Crypto1State *crypto1_create(uint64_t key);
     void crypto1_destroy(struct Crypto1State*);
     void crypto1_get_lfsr(struct Crypto1State*, uint64_t*);
     uint8_t crypto1_bit(struct Crypto1State*, uint8_t, int);
     uint8_t crypto1_byte(struct Crypto1State*, uint8_t, int);
     uint32_t crypto1_word(struct Crypto1State*, uint32_t, int);
+
+    // CRYPTO1_BATCH_SIZE states, bitsliced: bit j of odd[k] is bit k of the odd half of state j. The inputs and
+    // outputs of the batch functions are bitsliced the same way, in[k] holds bit k of the input of every state.
+#define CRYPTO1_BATCH_SIZE 64
+    struct Crypto1Batch {
+        uint64_t odd[24], even[24];
+    };
+    void crypto1_init_batch(struct Crypto1Batch*, const uint64_t *keys, uint32_t n);
+    void crypto1_byte_batch(struct Crypto1Batch*, const uint64_t in[8], uint64_t out[8], int is_encrypted);
+    void crypto1_word_batch(struct Crypto1Batch*, const uint64_t in[32], uint64_t out[32], int is_encrypted);
+
     uint32_t prng_successor(uint32_t x, uint32_t n);
+    const uint16_t *prng_position_table(void);
 
     struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in);
+    struct lfsr_recovery32_workspace;
+    struct lfsr_recovery32_workspace *lfsr_recovery32_workspace_create(void);
+    void lfsr_recovery32_workspace_destroy(struct lfsr_recovery32_workspace *ws);
+    struct Crypto1State* lfsr_recovery32_ws(uint32_t ks2, uint32_t in, struct lfsr_recovery32_workspace *ws);
+    void lfsr_recovery32_release(void);
     struct Crypto1State* lfsr_recovery64(uint32_t ks2, uint32_t ks3);
     uint32_t *lfsr_prefix_ks(uint8_t ks[8], int isodd);
     struct Crypto1State*
@@ -64,6 +82,17 @@ extern "C" {
         f |= 0x0d938 >> (x >> 16 & 0xf) & 1;
         return BIT(0xEC57E80A, f);
     }
+
+    // filter() without table lookups, from the boolean functions behind its tables. They are evaluated at every
+    // bit position of x at once, so the compiler can vectorize a loop over it even without a gather instruction
+    static inline int filter_bitsliced(uint32_t const x) {
+        uint32_t x1 = x >> 1, x2 = x >> 2, x3 = x >> 3;
+        uint32_t fa = ((x3 | x2) ^ (x3 & x)) ^ (x1 & ((x3 ^ x2) | x));   // 0x0d938 and 0x6c9c0
+        uint32_t fb = ((x3 & x2) | x1) ^ ((x3 ^ x2) & (x1 | x));         // 0xf22c0, 0x3c8b0 and 0x1e458
+        uint32_t a = fa >> 16, b = fb >> 12, c = fb >> 8, d = fa >> 4, e = fb;
+
+        return ((a | ((b | e) & (d ^ e))) ^ ((a ^ (b & d)) & ((c ^ d) | (b & e)))) & 1;
+    }
 #ifdef __cplusplus
 }
 #endif
@@ -20,19 +20,27 @@
 #include "crapto1.h"
 
 #include <stdlib.h>
+#include <pthread.h>
 #include "parity.h"
 
 #define SWAPENDIAN(x)\
 	(x = (x >> 8 & 0xff00ff) | (x & 0xff00ff) << 8, x = x >> 16 | x << 16)
 
-struct Crypto1State * crypto1_create(uint64_t key) {
-    struct Crypto1State *s = malloc(sizeof (*s));
+void crypto1_init(struct Crypto1State *s, uint64_t key) {
     int i;
 
-    for (i = 47; s && i > 0; i -= 2) {
+    s->odd = s->even = 0;
+    for (i = 47; i > 0; i -= 2) {
         s->odd = s->odd << 1 | BIT(key, (i - 1) ^ 7);
         s->even = s->even << 1 | BIT(key, i ^ 7);
     }
+}
+
+struct Crypto1State * crypto1_create(uint64_t key) {
+    struct Crypto1State *s = malloc(sizeof (*s));
+
+    if (s)
+        crypto1_init(s, key);
     return s;
 }
 
@@ -81,13 +89,106 @@ uint32_t crypto1_word(struct Crypto1State *s, uint32_t in, int is_encrypted) {
     return ret;
 }
 
+/* crypto1 batch functions
+ * run CRYPTO1_BATCH_SIZE states side by side, bitsliced: every bit of the
+ * states is a 64 bit word with one state per bit, so that all the bit
+ * operations of a step advance all states at once on any CPU. filter() is
+ * written as the boolean functions of its nibbles, and instead of swapping
+ * odd and even after every bit, the two halves take turns.
+ */
+#define f20a(a, b, c, d) (((a | b) ^ (a & d)) ^ (c & ((a ^ b) | d)))
+#define f20b(a, b, c, d) (((a & b) | c) ^ ((a ^ b) & (c | d)))
+#define f20c(a, b, c, d, e) ((a | ((b | e) & (d ^ e))) ^ ((a ^ (b & d)) & ((c ^ d) | (b & e))))
+
+void crypto1_init_batch(struct Crypto1Batch *s, const uint64_t *keys, uint32_t n) {
+    uint32_t j, k;
+
+    for (k = 0; k < 24; ++k) {
+        s->odd[k] = s->even[k] = 0;
+        for (j = 0; j < n; ++j) {
+            s->odd[k] |= (uint64_t) BIT(keys[j], (2 * k) ^ 7) << j;
+            s->even[k] |= (uint64_t) BIT(keys[j], (2 * k + 1) ^ 7) << j;
+        }
+    }
+}
+
+// one step of crypto1_bit() with a as the odd and b as the even half
+static inline uint64_t crypto1_bit_batch(uint64_t *a, uint64_t *b, uint64_t in, int is_encrypted) {
+    uint64_t feedin, ret;
+    int k;
+
+    ret = f20c(f20a(a[19], a[18], a[17], a[16]), f20b(a[15], a[14], a[13], a[12]),
+               f20b(a[11], a[10], a[9], a[8]), f20a(a[7], a[6], a[5], a[4]), f20b(a[3], a[2], a[1], a[0]));
+
+    feedin = is_encrypted ? ret ^ in : in;
+    feedin ^= a[2] ^ a[3] ^ a[4] ^ a[6] ^ a[9] ^ a[10] ^ a[11] ^ a[14] ^ a[15] ^ a[16] ^ a[19] ^ a[21]; // LF_POLY_ODD
+    feedin ^= b[2] ^ b[11] ^ b[16] ^ b[17] ^ b[18] ^ b[23]; // LF_POLY_EVEN
+    for (k = 23; k > 0; --k)
+        b[k] = b[k - 1];
+    b[0] = feedin;
+
+    return ret;
+}
+
+void crypto1_byte_batch(struct Crypto1Batch *s, const uint64_t in[8], uint64_t out[8], int is_encrypted) {
+    int i;
+
+    for (i = 0; i < 8; i += 2) {
+        out[i] = crypto1_bit_batch(s->odd, s->even, in[i], is_encrypted);
+        out[i + 1] = crypto1_bit_batch(s->even, s->odd, in[i + 1], is_encrypted);
+    }
+}
+
+void crypto1_word_batch(struct Crypto1Batch *s, const uint64_t in[32], uint64_t out[32], int is_encrypted) {
+    int i;
+
+    for (i = 0; i < 32; i += 2) {
+        out[i ^ 24] = crypto1_bit_batch(s->odd, s->even, in[i ^ 24], is_encrypted);
+        out[(i + 1) ^ 24] = crypto1_bit_batch(s->even, s->odd, in[(i + 1) ^ 24], is_encrypted);
+    }
+}
+
+/* prng tables
+ * the 16 bit prng visits all 65535 nonzero states. prng_sequence holds them in
+ * order, as the halves of a tag nonce read them, prng_position is its inverse.
+ * Both are filled exactly once, whichever thread asks first.
+ */
+static uint16_t prng_sequence[65535];
+static uint16_t prng_position[1 << 16];
+static pthread_once_t prng_tables_once = PTHREAD_ONCE_INIT;
+
+static void prng_tables_init(void) {
+    uint16_t x = 1;
+    for (uint32_t i = 0; i < 65535; ++i) {
+        prng_sequence[i] = (x & 0xff) << 8 | x >> 8;
+        prng_position[(x & 0xff) << 8 | x >> 8] = i;
+        x = x >> 1 | (x ^ x >> 2 ^ x >> 3 ^ x >> 5) << 15;
+    }
+}
+
+const uint16_t *prng_position_table(void) {
+    pthread_once(&prng_tables_once, prng_tables_init);
+    return prng_position;
+}
+
 /* prng_successor
  * helper used to obscure the keystream during authentication
+ * the upper half of a nonce is the lower half 16 steps earlier. After 16 steps
+ * nothing of the old upper half is left and both halves are a table lookup.
  */
 uint32_t prng_successor(uint32_t x, uint32_t n) {
-    SWAPENDIAN(x);
-    while (n--)
-        x = x >> 1 | (x >> 16 ^ x >> 18 ^ x >> 19 ^ x >> 21) << 31;
+    uint32_t pos;
+
+    if (n < 16) {
+        SWAPENDIAN(x);
+        while (n--)
+            x = x >> 1 | (x >> 16 ^ x >> 18 ^ x >> 19 ^ x >> 21) << 31;
+        return SWAPENDIAN(x);
+    }
 
-    return SWAPENDIAN(x);
+    if (!(x & 0xffff))
+        return 0;
+    pthread_once(&prng_tables_once, prng_tables_init);
+    pos = prng_position[x & 0xffff];
+    return (uint32_t) prng_sequence[(pos + (n - 16) % 65535) % 65535] << 16 | prng_sequence[(pos + n % 65535) % 65535];
 }
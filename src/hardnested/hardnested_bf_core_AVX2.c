@@ -103,16 +103,25 @@ static void *malloc_bitslice(size_t x) {
 #define free_bitslice(x) free(x)
 #endif
 
-// arrays of bitsliced states with identical values in all slices
-static bitslice_t bitsliced_encrypted_nonces[256][KEYSTREAM_SIZE];
-static bitslice_t bitsliced_encrypted_parity_bits[256][4];
-// 1 and 0 vectors
-static bitslice_t bs_ones;
-static bitslice_t bs_zeroes;
-
-void bitslice_test_nonces_AVX2(uint32_t nonces_to_bruteforce, uint32_t *bf_test_nonce, uint8_t *bf_test_nonce_par) {
+// arrays of bitsliced states with identical values in all slices. One per brute force run,
+// allocated by bitslice_test_nonces() and released with free_bitarray() by the caller.
+typedef struct {
+    bitslice_t nonces[256][KEYSTREAM_SIZE];
+    bitslice_t parity_bits[256][4];
+} bitsliced_test_nonces_t;
+
+void *bitslice_test_nonces_AVX2(uint32_t nonces_to_bruteforce, uint32_t *bf_test_nonce, uint8_t *bf_test_nonce_par) {
+
+    bitsliced_test_nonces_t *bitsliced_test_nonces = malloc_bitslice(sizeof (bitsliced_test_nonces_t));
+    if (bitsliced_test_nonces == NULL) {
+        printf("Out of memory error in bitslice_test_nonces(). Aborting...\n");
+        exit(4);
+    }
+    bitslice_t (* restrict bitsliced_encrypted_nonces)[KEYSTREAM_SIZE] = bitsliced_test_nonces->nonces;
+    bitslice_t (* restrict bitsliced_encrypted_parity_bits)[4] = bitsliced_test_nonces->parity_bits;
 
     // initialize 1 and 0 vectors
+    bitslice_t bs_ones, bs_zeroes;
     memset(bs_ones.bytes, 0xff, VECTOR_SIZE);
     memset(bs_zeroes.bytes, 0x00, VECTOR_SIZE);
 
@@ -139,9 +148,10 @@ void bitslice_test_nonces_AVX2(uint32_t nonces_to_bruteforce, uint32_t *bf_test_
         }
     }
 
+    return bitsliced_test_nonces;
 }
 
-uint64_t crack_states_bitsliced_AVX2(uint32_t cuid, uint8_t *best_first_bytes, statelist_t *p, uint32_t *keys_found, uint64_t *num_keys_tested, uint32_t nonces_to_bruteforce, uint8_t *bf_test_nonce_2nd_byte, noncelist_t *nonces) {
+uint64_t crack_states_bitsliced_AVX2(uint32_t cuid, uint8_t *best_first_bytes, statelist_t *p, uint32_t *keys_found, uint64_t *num_keys_tested, uint32_t nonces_to_bruteforce, uint8_t *bf_test_nonce_2nd_byte, noncelist_t *nonces, const void *bitsliced_test_nonces) {
 
     // Unlike aczid's implementation this doesn't roll back at all when performing bitsliced bruteforce.
     // We know that the best first byte is already shifted in. Testing with the remaining three bytes of 
@@ -156,7 +166,11 @@ uint64_t crack_states_bitsliced_AVX2(uint32_t cuid, uint8_t *best_first_bytes, s
     uint32_t bitsliced_blocks = 0;
     uint32_t const *restrict p_even_end = p->states[EVEN_STATE] + p->len[EVEN_STATE];
 
+    const bitslice_t (* restrict bitsliced_encrypted_nonces)[KEYSTREAM_SIZE] = ((const bitsliced_test_nonces_t *) bitsliced_test_nonces)->nonces;
+    const bitslice_t (* restrict bitsliced_encrypted_parity_bits)[4] = ((const bitsliced_test_nonces_t *) bitsliced_test_nonces)->parity_bits;
+
     // constant ones/zeroes
+    bitslice_t bs_ones, bs_zeroes;
     memset(bs_ones.bytes, 0xff, VECTOR_SIZE);
     memset(bs_zeroes.bytes, 0x00, VECTOR_SIZE);
 
@@ -18,6 +18,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include "../crapto1.h"
 #if !defined _MSC_VER && !defined __APPLE__
 #include <malloc.h>
 #endif
@@ -130,3 +131,11 @@ uint32_t count_bitarray_AND4_AVX512(uint32_t* restrict A, uint32_t* restrict B,
     return count;
 }
 
+// filter() of x << 1 and x << 1 | 1 for n lfsr table entries, in bit 0 and bit 1 of flags[]. crapto1 extends its
+// tables with them. Branch free, so that the compiler evaluates the filter for a vector of entries at once.
+void filter_flags_AVX512(const uint32_t* restrict x, uint8_t* restrict flags, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t v = x[i] << 1;
+        flags[i] = filter(v) | filter(v | 1) << 1;
+    }
+}
@@ -18,6 +18,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include "../crapto1.h"
 #if !defined _MSC_VER && !defined __APPLE__
 #include <malloc.h>
 #endif
@@ -127,3 +128,11 @@ uint32_t count_bitarray_AND4_NOSIMD(uint32_t * restrict A, uint32_t * restrict B
     return count;
 }
 
+// filter() of x << 1 and x << 1 | 1 for n lfsr table entries, in bit 0 and bit 1 of flags[]. Without SIMD
+// crapto1 evaluates the filter inside its table extension instead, this is only used to set up a workspace.
+void filter_flags_NOSIMD(const uint32_t* restrict x, uint8_t* restrict flags, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t v = x[i] << 1;
+        flags[i] = filter(v) | filter(v | 1) << 1;
+    }
+}
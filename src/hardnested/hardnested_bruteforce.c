@@ -49,9 +49,11 @@ THE SOFTWARE.
 
 #include "hardnested_bruteforce.h"
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <pthread.h>
 #include "hardnested_cpu_dispatch.h"
+#include "hardnested_threadpool.h"
 #include "../ui.h"
 #include "../util.h"
 #include "../util_posix.h"
@@ -63,16 +65,28 @@ THE SOFTWARE.
 
 #define DEFAULT_BRUTE_FORCE_RATE  (120000000.0)  // if benchmark doesn't succeed
 #define TEST_BENCH_SIZE     (6000)    // number of odd and even states for brute force benchmark
-
-
-static uint32_t nonces_to_bruteforce = 0;
-static uint32_t bf_test_nonce[256];
-static uint8_t bf_test_nonce_2nd_byte[256];
-static uint8_t bf_test_nonce_par[256];
-static uint32_t bucket_count = 0;
-static statelist_t* buckets[128];
-static uint32_t keys_found = 0;
-static uint64_t num_keys_tested;
+#define BF_TASKS_PER_CORE   4         // the buckets of one batch are split into about as many tasks per core
+#define BF_MIN_ODD_STATES   64        // but not into less odd states per task, each task bitslices the even states again
+
+
+// state of one brute force run, shared by its worker threads. Buckets can be added while it runs
+struct bf_run {
+    bool silent;
+    hardnested_ctx_t *attack;           // the attack to report the progress for (NULL: benchmark)
+    uint32_t cuid;
+    uint32_t num_acquired_nonces;
+    noncelist_t *nonces;
+    uint8_t *best_first_bytes;
+    bf_test_nonces_t *test_nonces;
+    void *bitsliced_test_nonces;
+    uint64_t start_time;
+    uint64_t maximum_states;            // of all buckets added so far
+    uint64_t num_slices;                // the same, including the padding of the last bitsliced block
+    uint32_t keys_found;
+    uint64_t found_key;
+    uint64_t num_keys_tested;
+    bool cancelled;                     // by brute_force_bs_cancel(). keys_found is set as well, which stops the cores
+};
 
 uint8_t trailing_zeros(uint8_t byte) {
     static const uint8_t trailing_zeros_LUT[256] = {
@@ -121,6 +135,11 @@ bool verify_key(uint32_t cuid, noncelist_t *nonces, uint8_t *best_first_bytes, u
     return true;
 }
 
+struct crack_states_args {
+    bf_run_t *run;
+    statelist_t *bucket;
+};
+
 static void*
 #ifdef __has_attribute
 #if __has_attribute(force_align_arg_pointer)
@@ -128,56 +147,33 @@ __attribute__((force_align_arg_pointer))
 #endif
 #endif
 crack_states_thread(void* x) {
-
-    struct arg {
-        bool silent;
-        int thread_ID;
-        uint32_t cuid;
-        uint32_t num_acquired_nonces;
-        uint64_t maximum_states;
-        noncelist_t *nonces;
-        uint8_t* best_first_bytes;
-        uint8_t trgBlock;
-        uint8_t trgKey;
-    } *thread_arg;
-
-    thread_arg = (struct arg *) x;
-    const int thread_id = thread_arg->thread_ID;
-    uint32_t current_bucket = thread_id;
-    while (current_bucket < bucket_count) {
-        statelist_t *bucket = buckets[current_bucket];
-        if (bucket) {
-            const uint64_t key = crack_states_bitsliced(thread_arg->cuid, thread_arg->best_first_bytes, bucket, &keys_found, &num_keys_tested, nonces_to_bruteforce, bf_test_nonce_2nd_byte, thread_arg->nonces);
-            if (key != -1) {
-                __sync_fetch_and_add(&keys_found, 1);
-                char progress_text[80];
-                sprintf(progress_text, "Brute force phase completed. Key found: %012" PRIx64, key);
-                if (thread_arg->trgKey == MC_AUTH_A){
-                    t.sectors[block_to_sector(thread_arg->trgBlock)].foundKeyA = true;
-                    num_to_bytes(key, 6, t.sectors[block_to_sector(thread_arg->trgBlock)].KeyA);
-                } else {
-                    t.sectors[block_to_sector(thread_arg->trgBlock)].foundKeyB = true;
-                    num_to_bytes(key, 6, t.sectors[block_to_sector(thread_arg->trgBlock)].KeyB);
-                }
-                hardnested_print_progress(thread_arg->num_acquired_nonces, progress_text, 0.0, 0, thread_arg->trgBlock, thread_arg->trgKey, true);
-                break;
-            } else if (keys_found) {
-                break;
-            } else {
-                if (!thread_arg->silent) {
-                    char progress_text[80];
-                    sprintf(progress_text, "Brute force phase: %6.02f%%", 100.0 * (float) num_keys_tested / (float) (thread_arg->maximum_states));
-                    float remaining_bruteforce = thread_arg->nonces[thread_arg->best_first_bytes[0]].expected_num_brute_force - (float) num_keys_tested / 2;
-                    hardnested_print_progress(thread_arg->num_acquired_nonces, progress_text, remaining_bruteforce, 5000, thread_arg->trgBlock, thread_arg->trgKey, true);
-                }
-            }
+    struct crack_states_args *thread_arg = (struct crack_states_args *) x;
+    bf_run_t *run = thread_arg->run;
+    if (run->keys_found) {
+        return NULL;
+    }
+    const uint64_t key = crack_states_bitsliced(run->cuid, run->best_first_bytes, thread_arg->bucket, &run->keys_found, &run->num_keys_tested, run->test_nonces->nonces_to_bruteforce, run->test_nonces->nonce_2nd_byte, run->nonces, run->bitsliced_test_nonces);
+    if (key != -1) {
+        if (__sync_fetch_and_add(&run->keys_found, 1) == 0) {
+            run->found_key = key;
         }
-        current_bucket += num_CPUs();
+        char progress_text[80];
+        sprintf(progress_text, "Brute force phase completed. Key found: %012" PRIx64, key);
+        hardnested_print_progress(run->attack, run->num_acquired_nonces, progress_text, 0.0, 0, true);
+    } else if (!run->keys_found && !run->silent) {
+        char progress_text[80];
+        sprintf(progress_text, "Brute force phase: %6.02f%%", 100.0 * (float) run->num_keys_tested / (float) (run->maximum_states));
+        float remaining_bruteforce = run->nonces[run->best_first_bytes[0]].expected_num_brute_force - (float) run->num_keys_tested / 2;
+        hardnested_print_progress(run->attack, run->num_acquired_nonces, progress_text, remaining_bruteforce, 5000, true);
     }
     return NULL;
 }
 
-void prepare_bf_test_nonces(noncelist_t *nonces, uint8_t best_first_byte) {
+void prepare_bf_test_nonces(noncelist_t *nonces, uint8_t best_first_byte, bf_test_nonces_t *test_nonces) {
+    uint32_t *bf_test_nonce = test_nonces->nonce;
+    uint8_t *bf_test_nonce_2nd_byte = test_nonces->nonce_2nd_byte;
+    uint8_t *bf_test_nonce_par = test_nonces->nonce_par;
+
     // we do bitsliced brute forcing with best_first_bytes[0] only.
     // Extract the corresponding 2nd bytes
     noncelistentry_t *test_nonce = nonces[best_first_byte].first;
@@ -189,7 +185,8 @@ void prepare_bf_test_nonces(noncelist_t *nonces, uint8_t best_first_byte) {
         test_nonce = test_nonce->next;
         i++;
     }
-    nonces_to_bruteforce = i;
+    test_nonces->nonces_to_bruteforce = i;
+    const uint32_t nonces_to_bruteforce = i;
 
     uint8_t best_4[4] = {0};
     int sum_best = -1;
@@ -236,62 +233,217 @@ void prepare_bf_test_nonces(noncelist_t *nonces, uint8_t best_first_byte) {
     }
 }
 
-bool brute_force_bs(float *bf_rate, statelist_t *candidates, uint32_t cuid, uint32_t num_acquired_nonces, uint64_t maximum_states, noncelist_t *nonces, uint8_t *best_first_bytes, uint8_t trgBlock, uint8_t trgKey) {
-    bool silent = (bf_rate != NULL);
-    keys_found = 0;
-    num_keys_tested = 0;
+bf_run_t *brute_force_bs_start(bool silent, hardnested_ctx_t *attack, uint32_t cuid, uint32_t num_acquired_nonces, noncelist_t *nonces, uint8_t *best_first_bytes, bf_test_nonces_t *test_nonces) {
+    bf_run_t *run = calloc(1, sizeof(bf_run_t));
+    if (run == NULL) {
+        PrintAndLog(true, "Out of memory error in brute_force_bs_start().\n");
+        exit(4);
+    }
+    run->silent = silent;
+    run->attack = attack;
+    run->cuid = cuid;
+    run->num_acquired_nonces = num_acquired_nonces;
+    run->nonces = nonces;
+    run->best_first_bytes = best_first_bytes;
+    run->test_nonces = test_nonces;
+    run->bitsliced_test_nonces = bitslice_test_nonces(test_nonces->nonces_to_bruteforce, test_nonces->nonce, test_nonces->nonce_par);
+    run->start_time = msclock();
+    return run;
+}
 
-    bitslice_test_nonces(nonces_to_bruteforce, bf_test_nonce, bf_test_nonce_par);
 
-    // count number of states to go
-    bucket_count = 0;
-    for (statelist_t *p = candidates; p != NULL; p = p->next) {
-        if (p->states[ODD_STATE] != NULL && p->states[EVEN_STATE] != NULL) {
-            buckets[bucket_count] = p;
-            bucket_count++;
+// number of even states in one bitsliced block of the brute force core in use
+static uint32_t max_bitslices(void) {
+#ifdef X86_SIMD
+    switch (GetSIMDInstr()) {
+        case SIMD_AVX512:
+            return 512;
+        case SIMD_AVX2:
+            return 256;
+        default:
+            return 128;
+    }
+#else
+    return 64;
+#endif
+}
+
+
+// merge the buckets sharing their odd_even statelist into one by concatenating their other statelists.
+// The concatenated lists are appended to merged_lists.
+static uint32_t coalesce_buckets(statelist_t *buckets, uint32_t num_buckets, odd_even_t odd_even, uint32_t **merged_lists, uint32_t *num_merged_lists) {
+    odd_even_t other = odd_even == ODD_STATE ? EVEN_STATE : ODD_STATE;
+    uint32_t num_coalesced = 0;
+    for (uint32_t i = 0; i < num_buckets; i++) {
+        if (buckets[i].states[odd_even] == NULL) {
+            continue;   // already merged into a preceding one
+        }
+        uint32_t len = 0;
+        uint32_t group_size = 0;
+        for (uint32_t j = i; j < num_buckets; j++) {
+            if (buckets[j].states[odd_even] == buckets[i].states[odd_even]) {
+                len += buckets[j].len[other];
+                group_size++;
+            }
+        }
+        statelist_t merged = buckets[i];
+        if (group_size > 1) {
+            uint32_t *list = malloc((len + 1) * sizeof(uint32_t));
+            if (list == NULL) {
+                PrintAndLog(true, "Out of memory error in coalesce_buckets().\n");
+                exit(4);
+            }
+            uint32_t *p = list;
+            for (uint32_t j = i + 1; j < num_buckets; j++) {
+                if (buckets[j].states[odd_even] == merged.states[odd_even]) {
+                    memcpy(p, buckets[j].states[other], buckets[j].len[other] * sizeof(uint32_t));
+                    p += buckets[j].len[other];
+                    buckets[j].states[odd_even] = NULL;
+                }
+            }
+            memcpy(p, merged.states[other], merged.len[other] * sizeof(uint32_t));
+            list[len] = 0xffffffff;
+            merged.states[other] = list;
+            merged.len[other] = len;
+            merged_lists[(*num_merged_lists)++] = list;
         }
+        buckets[num_coalesced++] = merged;
     }
+    return num_coalesced;
+}
 
-    uint8_t num_core = num_CPUs();
-    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * num_core);
-    uint64_t start_time = msclock();
-
-    struct args {
-        bool silent;
-        int thread_ID;
-        uint32_t cuid;
-        uint32_t num_acquired_nonces;
-        uint64_t maximum_states;
-        noncelist_t *nonces;
-        uint8_t *best_first_bytes;
-        uint8_t trgBlock;
-        uint8_t trgKey;
-    } *thread_args = malloc(num_core * sizeof(*thread_args));
 
-    for (uint8_t i = 0; i < num_core; i++) {
-        thread_args[i].thread_ID = i;
-        thread_args[i].silent = silent;
-        thread_args[i].cuid = cuid;
-        thread_args[i].num_acquired_nonces = num_acquired_nonces;
-        thread_args[i].maximum_states = maximum_states;
-        thread_args[i].nonces = nonces;
-        thread_args[i].best_first_bytes = best_first_bytes;
-        thread_args[i].trgBlock = trgBlock;
-        thread_args[i].trgKey = trgKey;
-        pthread_create(&threads[i], NULL, crack_states_thread, (void*) &thread_args[i]);
+static uint32_t bucket_parts(statelist_t *bucket, uint64_t task_states) {
+    uint64_t num_parts = (uint64_t) bucket->len[ODD_STATE] * bucket->len[EVEN_STATE] / task_states + 1;
+    return MIN(num_parts, (bucket->len[ODD_STATE] + BF_MIN_ODD_STATES - 1) / BF_MIN_ODD_STATES);
+}
+
+
+// Buckets sharing their odd statelist are brute forced as one, with their even statelists concatenated. This leaves
+// only one partially used block of bitsliced even states instead of one per bucket. The remaining buckets which share
+// their even statelist get their odd statelists concatenated, which saves bitslicing the even states again. The merged
+// buckets are finally split into ranges of odd states, to keep all cores busy.
+bool brute_force_bs_buckets(bf_run_t *run, statelist_t **buckets, uint32_t num_buckets) {
+    statelist_t *jobs = malloc(num_buckets * sizeof(statelist_t));
+    uint32_t **merged_lists = malloc(2 * num_buckets * sizeof(uint32_t *));
+    if (jobs == NULL || merged_lists == NULL) {
+        PrintAndLog(true, "Out of memory error in brute_force_bs_buckets().\n");
+        exit(4);
     }
-    for (uint8_t i = 0; i < num_core; i++) {
-        pthread_join(threads[i], 0);
+    uint32_t num_jobs = 0;
+    uint64_t batch_states = 0;
+    for (uint32_t i = 0; i < num_buckets; i++) {
+        statelist_t *p = buckets[i];
+        if (p->states[ODD_STATE] != NULL && p->states[EVEN_STATE] != NULL) {
+            batch_states += (uint64_t) p->len[ODD_STATE] * p->len[EVEN_STATE];
+            jobs[num_jobs++] = *p;
+        }
     }
+    uint32_t num_merged_lists = 0;
+    num_jobs = coalesce_buckets(jobs, num_jobs, ODD_STATE, merged_lists, &num_merged_lists);
+    num_jobs = coalesce_buckets(jobs, num_jobs, EVEN_STATE, merged_lists, &num_merged_lists);
+    __sync_fetch_and_add(&run->maximum_states, batch_states);
+
+    const uint32_t slices = max_bitslices();
+    const uint64_t task_states = batch_states / (BF_TASKS_PER_CORE * num_CPUs()) + 1;
+    uint32_t num_tasks = 0;
+    for (uint32_t i = 0; i < num_jobs; i++) {
+        num_tasks += bucket_parts(&jobs[i], task_states);
+    }
+    struct crack_states_args *thread_args = malloc(num_tasks * sizeof(*thread_args));
+    statelist_t *tasks = malloc(num_tasks * sizeof(statelist_t));
+    if (thread_args == NULL || tasks == NULL) {
+        PrintAndLog(true, "Out of memory error in brute_force_bs_buckets().\n");
+        exit(4);
+    }
+    num_tasks = 0;
+    for (uint32_t i = 0; i < num_jobs; i++) {
+        uint32_t len_odd = jobs[i].len[ODD_STATE];
+        uint32_t num_parts = bucket_parts(&jobs[i], task_states);
+        uint32_t num_blocks = (jobs[i].len[EVEN_STATE] + slices - 1) / slices;
+        __sync_fetch_and_add(&run->num_slices, (uint64_t) len_odd * num_blocks * slices);
+        for (uint32_t part = 0; part < num_parts; part++) {
+            uint32_t first = (uint64_t) len_odd * part / num_parts;
+            uint32_t last = (uint64_t) len_odd * (part + 1) / num_parts;
+            tasks[num_tasks] = jobs[i];
+            tasks[num_tasks].states[ODD_STATE] += first;
+            tasks[num_tasks].len[ODD_STATE] = last - first;
+            tasks[num_tasks].next = NULL;
+            thread_args[num_tasks].run = run;
+            thread_args[num_tasks].bucket = &tasks[num_tasks];
+            num_tasks++;
+        }
+    }
+    if (!run->keys_found) {
+        hardnested_pool_run(crack_states_thread, thread_args, sizeof(*thread_args), num_tasks);
+    }
+    for (uint32_t i = 0; i < num_merged_lists; i++) {
+        free(merged_lists[i]);
+    }
+    free(merged_lists);
+    free(tasks);
     free(thread_args);
-    free(threads);
-    uint64_t elapsed_time = msclock() - start_time;
+    free(jobs);
+    return (run->keys_found != 0);
+}
+
+
+// the number of even states tested as one bitsliced block. Shorter even statelists are padded to it
+uint32_t brute_force_bs_block_states(void) {
+    return max_bitslices();
+}
+
+
+// the share of the tested bitslices which hold a real state, i.e. which aren't padding
+float brute_force_bs_utilization(bf_run_t *run) {
+    return run->num_slices == 0 ? 1.0 : (float) run->maximum_states / (float) run->num_slices;
+}
+
+
+bool brute_force_bs_key_found(bf_run_t *run) {
+    return (run->keys_found != 0);
+}
 
+
+// stop the run as if a key had been found: the cores abort their buckets and further buckets are skipped. The run
+// still has to be finished, it reports no key
+void brute_force_bs_cancel(bf_run_t *run) {
+    __atomic_store_n(&run->cancelled, true, __ATOMIC_RELEASE);
+    __sync_fetch_and_add(&run->keys_found, 1);
+}
+
+
+bool brute_force_bs_finish(bf_run_t *run, float *bf_rate, uint64_t *key) {
+    bool found = (run->keys_found != 0 && !run->cancelled);
+    uint64_t elapsed_time = msclock() - run->start_time;
     if (bf_rate != NULL) {
-        *bf_rate = (float) num_keys_tested / ((float) elapsed_time / 1000.0);
+        *bf_rate = (float) run->num_keys_tested / ((float) elapsed_time / 1000.0);
+    }
+    if (found && key != NULL) {
+        *key = run->found_key;
+    }
+    free_bitarray(run->bitsliced_test_nonces);
+    free(run);
+    return found;
+}
+
+
+bool brute_force_bs(float *bf_rate, statelist_t *candidates, hardnested_ctx_t *attack, uint32_t cuid, uint32_t num_acquired_nonces, noncelist_t *nonces, uint8_t *best_first_bytes, bf_test_nonces_t *test_nonces, uint64_t *key) {
+    bf_run_t *run = brute_force_bs_start(bf_rate != NULL, attack, cuid, num_acquired_nonces, nonces, best_first_bytes, test_nonces);
+
+    uint32_t num_buckets = 0;
+    for (statelist_t *p = candidates; p != NULL; p = p->next) {
+        num_buckets++;
+    }
+    statelist_t **buckets = malloc(num_buckets * sizeof(*buckets));
+    num_buckets = 0;
+    for (statelist_t *p = candidates; p != NULL; p = p->next) {
+        buckets[num_buckets++] = p;
     }
+    brute_force_bs_buckets(run, buckets, num_buckets);
+    free(buckets);
 
-    return (keys_found != 0);
+    return brute_force_bs_finish(run, bf_rate, key);
 }
 
 static void _read(void *buf, size_t size, size_t count, uint8_t *stream, size_t *pos) {
@@ -300,7 +452,7 @@ static void _read(void *buf, size_t size, size_t count, uint8_t *stream, size_t
     *pos += len;
 }
 
-static bool read_bench_data(statelist_t *test_candidates) {
+static bool read_bench_data(statelist_t *test_candidates, bf_test_nonces_t *test_nonces) {
     uint8_t *bench_data = bf_bench_data_bin;
     size_t pos = 0;
 
@@ -308,11 +460,11 @@ static bool read_bench_data(statelist_t *test_candidates) {
     uint32_t num_states = 0;
     uint32_t states_read = 0;
 
-    _read(&nonces_to_bruteforce, 1, sizeof (nonces_to_bruteforce), bench_data, &pos);
-    for (uint16_t i = 0; i < nonces_to_bruteforce && i < 256; i++) {
-        _read(&bf_test_nonce[i], 1, sizeof (uint32_t), bench_data, &pos);
-        bf_test_nonce_2nd_byte[i] = (bf_test_nonce[i] >> 16) & 0xff;
-        _read(&bf_test_nonce_par[i], 1, sizeof (uint8_t), bench_data, &pos);
+    _read(&test_nonces->nonces_to_bruteforce, 1, sizeof (test_nonces->nonces_to_bruteforce), bench_data, &pos);
+    for (uint16_t i = 0; i < test_nonces->nonces_to_bruteforce && i < 256; i++) {
+        _read(&test_nonces->nonce[i], 1, sizeof (uint32_t), bench_data, &pos);
+        test_nonces->nonce_2nd_byte[i] = (test_nonces->nonce[i] >> 16) & 0xff;
+        _read(&test_nonces->nonce_par[i], 1, sizeof (uint8_t), bench_data, &pos);
     }
     _read(&num_states, 1, sizeof (uint32_t), bench_data, &pos);
     for (states_read = 0; states_read < MIN(num_states, TEST_BENCH_SIZE); states_read++) {
@@ -347,7 +499,8 @@ float brute_force_benchmark() {
     }
     test_candidates[num_core - 1].next = NULL;
 
-    if (!read_bench_data(test_candidates)) {
+    bf_test_nonces_t test_nonces;
+    if (!read_bench_data(test_candidates, &test_nonces)) {
         PrintAndLog(true, "Couldn't read benchmark data. Assuming brute force rate of %1.0f states per second", DEFAULT_BRUTE_FORCE_RATE);
         return DEFAULT_BRUTE_FORCE_RATE;
     }
@@ -359,10 +512,16 @@ float brute_force_benchmark() {
         test_candidates[i].states[EVEN_STATE][TEST_BENCH_SIZE] = -1;
     }
 
-    uint64_t maximum_states = TEST_BENCH_SIZE * TEST_BENCH_SIZE * (uint64_t) num_core;
-
+    statelist_t *buckets[num_core];
+    for (uint8_t i = 0; i < num_core; i++) {
+        buckets[i] = &test_candidates[i];
+    }
     float bf_rate;
-    brute_force_bs(&bf_rate, test_candidates, 0, 0, maximum_states, NULL, 0, 0, 0);
+    bf_run_t *run = brute_force_bs_start(true, NULL, 0, 0, NULL, 0, &test_nonces);
+    brute_force_bs_buckets(run, buckets, num_core);
+    float utilization = brute_force_bs_utilization(run);
+    brute_force_bs_finish(run, &bf_rate, NULL);
+    PrintAndLog(true, "Brute force benchmark: %1.0f states/s, %1.1f%% of the bitslices used", bf_rate, 100.0 * utilization);
 
     free(test_candidates[0].states[ODD_STATE]);
     free(test_candidates[0].states[EVEN_STATE]);
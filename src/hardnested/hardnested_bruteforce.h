@@ -28,8 +28,28 @@ typedef struct {
     void* next;
 } statelist_t;
 
-extern void prepare_bf_test_nonces(noncelist_t *nonces, uint8_t best_first_byte);
-extern bool brute_force_bs(float *bf_rate, statelist_t *candidates, uint32_t cuid, uint32_t num_acquired_nonces, uint64_t maximum_states, noncelist_t *nonces, uint8_t *best_first_bytes, uint8_t trgBlock, uint8_t trgKey);
+// the nonces with the best first byte, which are tested in the bitsliced brute force
+typedef struct {
+    uint32_t nonces_to_bruteforce;
+    uint32_t nonce[256];
+    uint8_t nonce_2nd_byte[256];
+    uint8_t nonce_par[256];
+} bf_test_nonces_t;
+
+extern void prepare_bf_test_nonces(noncelist_t *nonces, uint8_t best_first_byte, bf_test_nonces_t *test_nonces);
+extern bool brute_force_bs(float *bf_rate, statelist_t *candidates, hardnested_ctx_t *attack, uint32_t cuid, uint32_t num_acquired_nonces, noncelist_t *nonces, uint8_t *best_first_bytes, bf_test_nonces_t *test_nonces, uint64_t *key);
+
+// A brute force run which is fed with buckets while the candidates are still being generated. brute_force_bs_buckets()
+// returns when the given buckets are done, it may be called from several threads at once. After a key has been found
+// further buckets are skipped, just as after brute_force_bs_cancel().
+typedef struct bf_run bf_run_t;
+extern bf_run_t *brute_force_bs_start(bool silent, hardnested_ctx_t *attack, uint32_t cuid, uint32_t num_acquired_nonces, noncelist_t *nonces, uint8_t *best_first_bytes, bf_test_nonces_t *test_nonces);
+extern bool brute_force_bs_buckets(bf_run_t *run, statelist_t **buckets, uint32_t num_buckets);
+extern bool brute_force_bs_key_found(bf_run_t *run);
+extern void brute_force_bs_cancel(bf_run_t *run);
+extern float brute_force_bs_utilization(bf_run_t *run);
+extern uint32_t brute_force_bs_block_states(void);
+extern bool brute_force_bs_finish(bf_run_t *run, float *bf_rate, uint64_t *key);
 extern float brute_force_benchmark();
 extern uint8_t trailing_zeros(uint8_t byte);
 extern bool verify_key(uint32_t cuid, noncelist_t *nonces, uint8_t *best_first_bytes, uint32_t odd, uint32_t even);
@@ -39,6 +39,7 @@ count_bitarray_AND4_t* count_bitarray_AND4_function_p = &count_bitarray_AND4_dis
 
 crack_states_bitsliced_t* crack_states_bitsliced_function_p = &crack_states_bitsliced_dispatch;
 bitslice_test_nonces_t* bitslice_test_nonces_function_p = &bitslice_test_nonces_dispatch;
+filter_flags_t* filter_flags_function_p = &filter_flags_dispatch;
 
 SIMDExecInstr GetSIMDInstr() {
     SIMDExecInstr instr = SIMD_NONE;
@@ -285,7 +286,7 @@ uint32_t count_bitarray_AND4_dispatch(uint32_t* A, uint32_t* B, uint32_t* C, uin
     return (*count_bitarray_AND4_function_p)(A, B, C, D);
 }
 
-uint64_t crack_states_bitsliced_dispatch(uint32_t cuid, uint8_t* best_first_bytes, statelist_t* p, uint32_t* keys_found, uint64_t* num_keys_tested, uint32_t nonces_to_bruteforce, uint8_t* bf_test_nonce_2nd_byte, noncelist_t* nonces) {
+uint64_t crack_states_bitsliced_dispatch(uint32_t cuid, uint8_t* best_first_bytes, statelist_t* p, uint32_t* keys_found, uint64_t* num_keys_tested, uint32_t nonces_to_bruteforce, uint8_t* bf_test_nonce_2nd_byte, noncelist_t* nonces, const void* bitsliced_test_nonces) {
     switch (GetSIMDInstr()) {
     case SIMD_AVX512:
         crack_states_bitsliced_function_p = &crack_states_bitsliced_AVX512;
@@ -304,10 +305,10 @@ uint64_t crack_states_bitsliced_dispatch(uint32_t cuid, uint8_t* best_first_byte
     }
 
     // call the most optimized function for this CPU
-    return (*crack_states_bitsliced_function_p)(cuid, best_first_bytes, p, keys_found, num_keys_tested, nonces_to_bruteforce, bf_test_nonce_2nd_byte, nonces);
+    return (*crack_states_bitsliced_function_p)(cuid, best_first_bytes, p, keys_found, num_keys_tested, nonces_to_bruteforce, bf_test_nonce_2nd_byte, nonces, bitsliced_test_nonces);
 }
 
-void bitslice_test_nonces_dispatch(uint32_t nonces_to_bruteforce, uint32_t* bf_test_nonce, uint8_t* bf_test_nonce_par) {
+void* bitslice_test_nonces_dispatch(uint32_t nonces_to_bruteforce, uint32_t* bf_test_nonce, uint8_t* bf_test_nonce_par) {
     switch (GetSIMDInstr()) {
     case SIMD_AVX512:
         bitslice_test_nonces_function_p = &bitslice_test_nonces_AVX512;
@@ -326,7 +327,29 @@ void bitslice_test_nonces_dispatch(uint32_t nonces_to_bruteforce, uint32_t* bf_t
     }
 
     // call the most optimized function for this CPU
-    (*bitslice_test_nonces_function_p)(nonces_to_bruteforce, bf_test_nonce, bf_test_nonce_par);
+    return (*bitslice_test_nonces_function_p)(nonces_to_bruteforce, bf_test_nonce, bf_test_nonce_par);
+}
+
+void filter_flags_dispatch(const uint32_t* x, uint8_t* flags, uint32_t n) {
+    switch (GetSIMDInstr()) {
+    case SIMD_AVX512:
+        filter_flags_function_p = &filter_flags_AVX512;
+        break;
+    case SIMD_AVX2:
+        filter_flags_function_p = &filter_flags_AVX2;
+        break;
+    case SIMD_AVX:
+        filter_flags_function_p = &filter_flags_AVX;
+        break;
+    case SIMD_SSE2:
+        filter_flags_function_p = &filter_flags_SSE2;
+        break;
+    default:
+        NoCpu();
+    }
+
+    // call the most optimized function for this CPU
+    (*filter_flags_function_p)(x, flags, n);
 }
 #else
 
@@ -343,6 +366,7 @@ count_bitarray_AND4_t* count_bitarray_AND4_function_p = &count_bitarray_AND4_NOS
 
 crack_states_bitsliced_t* crack_states_bitsliced_function_p = &crack_states_bitsliced_NOSIMD;
 bitslice_test_nonces_t* bitslice_test_nonces_function_p = &bitslice_test_nonces_NOSIMD;
+filter_flags_t* filter_flags_function_p = &filter_flags_NOSIMD;
 #endif
 /////////////////////////////////////////////////
 // Entries to dispatched function calls
@@ -387,10 +411,14 @@ inline uint32_t count_bitarray_AND4(uint32_t* A, uint32_t* B, uint32_t* C, uint3
     return (*count_bitarray_AND4_function_p)(A, B, C, D);
 }
 
-uint64_t crack_states_bitsliced(uint32_t cuid, uint8_t* best_first_bytes, statelist_t* p, uint32_t* keys_found, uint64_t* num_keys_tested, uint32_t nonces_to_bruteforce, uint8_t* bf_test_nonce_2nd_byte, noncelist_t* nonces) {
-    return (*crack_states_bitsliced_function_p)(cuid, best_first_bytes, p, keys_found, num_keys_tested, nonces_to_bruteforce, bf_test_nonce_2nd_byte, nonces);
+uint64_t crack_states_bitsliced(uint32_t cuid, uint8_t* best_first_bytes, statelist_t* p, uint32_t* keys_found, uint64_t* num_keys_tested, uint32_t nonces_to_bruteforce, uint8_t* bf_test_nonce_2nd_byte, noncelist_t* nonces, const void* bitsliced_test_nonces) {
+    return (*crack_states_bitsliced_function_p)(cuid, best_first_bytes, p, keys_found, num_keys_tested, nonces_to_bruteforce, bf_test_nonce_2nd_byte, nonces, bitsliced_test_nonces);
+}
+
+void* bitslice_test_nonces(uint32_t nonces_to_bruteforce, uint32_t* bf_test_nonce, uint8_t* bf_test_nonce_par) {
+    return (*bitslice_test_nonces_function_p)(nonces_to_bruteforce, bf_test_nonce, bf_test_nonce_par);
 }
 
-void bitslice_test_nonces(uint32_t nonces_to_bruteforce, uint32_t* bf_test_nonce, uint8_t* bf_test_nonce_par) {
-    (*bitslice_test_nonces_function_p)(nonces_to_bruteforce, bf_test_nonce, bf_test_nonce_par);
+void filter_flags(const uint32_t* x, uint8_t* flags, uint32_t n) {
+    (*filter_flags_function_p)(x, flags, n);
 }
@@ -121,20 +121,27 @@ count_bitarray_AND4_t count_bitarray_AND4_AVX2;
 count_bitarray_AND4_t count_bitarray_AND4_AVX;
 count_bitarray_AND4_t count_bitarray_AND4_SSE2;
 
-typedef uint64_t crack_states_bitsliced_t(uint32_t, uint8_t*, statelist_t*, uint32_t*, uint64_t*, uint32_t, uint8_t*, noncelist_t*);
+typedef uint64_t crack_states_bitsliced_t(uint32_t, uint8_t*, statelist_t*, uint32_t*, uint64_t*, uint32_t, uint8_t*, noncelist_t*, const void*);
 crack_states_bitsliced_t crack_states_bitsliced_dispatch;
 crack_states_bitsliced_t crack_states_bitsliced_AVX512;
 crack_states_bitsliced_t crack_states_bitsliced_AVX2;
 crack_states_bitsliced_t crack_states_bitsliced_AVX;
 crack_states_bitsliced_t crack_states_bitsliced_SSE2;
 
-typedef void bitslice_test_nonces_t(uint32_t, uint32_t*, uint8_t*);
+typedef void* bitslice_test_nonces_t(uint32_t, uint32_t*, uint8_t*);
 bitslice_test_nonces_t bitslice_test_nonces_dispatch;
 bitslice_test_nonces_t bitslice_test_nonces_AVX512;
 bitslice_test_nonces_t bitslice_test_nonces_AVX2;
 bitslice_test_nonces_t bitslice_test_nonces_AVX;
 bitslice_test_nonces_t bitslice_test_nonces_SSE2;
 
+typedef void filter_flags_t(const uint32_t*, uint8_t*, uint32_t);
+filter_flags_t filter_flags_dispatch;
+filter_flags_t filter_flags_AVX512;
+filter_flags_t filter_flags_AVX2;
+filter_flags_t filter_flags_AVX;
+filter_flags_t filter_flags_SSE2;
+
 typedef enum instr {
     SIMD_NONE,
     SIMD_AVX512,
@@ -176,11 +183,14 @@ count_bitarray_AND3_t count_bitarray_AND3_NOSIMD;
 typedef uint32_t count_bitarray_AND4_t(uint32_t*, uint32_t*, uint32_t*, uint32_t*);
 count_bitarray_AND4_t count_bitarray_AND4_NOSIMD;
 
-typedef uint64_t crack_states_bitsliced_t(uint32_t, uint8_t*, statelist_t*, uint32_t*, uint64_t*, uint32_t, uint8_t*, noncelist_t*);
+typedef uint64_t crack_states_bitsliced_t(uint32_t, uint8_t*, statelist_t*, uint32_t*, uint64_t*, uint32_t, uint8_t*, noncelist_t*, const void*);
 crack_states_bitsliced_t crack_states_bitsliced_NOSIMD;
 
-typedef void bitslice_test_nonces_t(uint32_t, uint32_t*, uint8_t*);
+typedef void* bitslice_test_nonces_t(uint32_t, uint32_t*, uint8_t*);
 bitslice_test_nonces_t bitslice_test_nonces_NOSIMD;
+
+typedef void filter_flags_t(const uint32_t*, uint8_t*, uint32_t);
+filter_flags_t filter_flags_NOSIMD;
 #endif
 
 extern uint32_t *malloc_bitarray(uint32_t x);
@@ -193,5 +203,6 @@ extern void bitarray_OR(uint32_t *A, uint32_t *B);
 extern uint32_t count_bitarray_AND2(uint32_t *A, uint32_t *B);
 extern uint32_t count_bitarray_AND3(uint32_t *A, uint32_t *B, uint32_t *C);
 extern uint32_t count_bitarray_AND4(uint32_t *A, uint32_t *B, uint32_t *C, uint32_t *D);
-extern uint64_t crack_states_bitsliced(uint32_t cuid, uint8_t* best_first_bytes, statelist_t* p, uint32_t* keys_found, uint64_t* num_keys_tested, uint32_t nonces_to_bruteforce, uint8_t* bf_test_nonces_2nd_byte, noncelist_t* nonces);
-extern void bitslice_test_nonces(uint32_t nonces_to_bruteforce, uint32_t* bf_test_nonces, uint8_t* bf_test_nonce_par);
+extern uint64_t crack_states_bitsliced(uint32_t cuid, uint8_t* best_first_bytes, statelist_t* p, uint32_t* keys_found, uint64_t* num_keys_tested, uint32_t nonces_to_bruteforce, uint8_t* bf_test_nonces_2nd_byte, noncelist_t* nonces, const void* bitsliced_test_nonces);
+extern void* bitslice_test_nonces(uint32_t nonces_to_bruteforce, uint32_t* bf_test_nonces, uint8_t* bf_test_nonce_par);
+extern void filter_flags(const uint32_t* x, uint8_t* flags, uint32_t n);
@@ -0,0 +1,131 @@
+//-----------------------------------------------------------------------------
+// Copyright (C) 2016, 2017 by piwi
+//
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// A process wide pool of worker threads shared by all hardnested attacks
+//-----------------------------------------------------------------------------
+
+#include "hardnested_threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "../util.h"
+
+typedef struct batch {
+    hardnested_task_t *task;
+    char *args;
+    size_t arg_size;
+    uint32_t num_tasks;
+    uint32_t next_task;         // next task to hand out
+    uint32_t unfinished;        // tasks handed out or queued, but not yet completed
+    pthread_cond_t done;
+    struct batch *next;
+} batch_t;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static batch_t *pool_queue = NULL;
+
+
+// take the next task of the batch and unlink the batch when it is completely handed out. Call with pool_mutex held.
+static uint32_t take_task(batch_t *batch) {
+    uint32_t task_idx = batch->next_task++;
+    if (batch->next_task == batch->num_tasks) {
+        batch_t **p = &pool_queue;
+        while (*p != batch) {
+            p = &(*p)->next;
+        }
+        *p = batch->next;
+    }
+    return task_idx;
+}
+
+
+static void run_task(batch_t *batch, uint32_t task_idx) {
+    batch->task(batch->args + task_idx * batch->arg_size);
+    pthread_mutex_lock(&pool_mutex);
+    if (--batch->unfinished == 0) {
+        pthread_cond_signal(&batch->done);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+
+static void*
+#ifdef __has_attribute
+#if __has_attribute(force_align_arg_pointer)
+__attribute__((force_align_arg_pointer))
+#endif
+#endif
+pool_worker_thread(void *arg) {
+    (void) arg;
+    while (true) {
+        pthread_mutex_lock(&pool_mutex);
+        while (pool_queue == NULL) {
+            pthread_cond_wait(&pool_work, &pool_mutex);
+        }
+        batch_t *batch = pool_queue;
+        uint32_t task_idx = take_task(batch);
+        pthread_mutex_unlock(&pool_mutex);
+        run_task(batch, task_idx);
+    }
+    return NULL;
+}
+
+
+static void start_pool(void) {
+    for (int i = 0; i < num_CPUs(); i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker_thread, NULL)) {
+            printf("Couldn't start worker threads. Aborting...\n");
+            exit(4);
+        }
+        pthread_detach(thread);
+    }
+}
+
+
+void hardnested_pool_run(hardnested_task_t *task, void *args, size_t arg_size, uint32_t num_tasks) {
+    if (num_tasks == 0) {
+        return;
+    }
+    pthread_once(&pool_once, start_pool);
+
+    batch_t batch = {
+        .task = task,
+        .args = args,
+        .arg_size = arg_size,
+        .num_tasks = num_tasks,
+        .next_task = 0,
+        .unfinished = num_tasks,
+        .next = NULL
+    };
+    pthread_cond_init(&batch.done, NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    batch_t **p = &pool_queue;
+    while (*p != NULL) {
+        p = &(*p)->next;
+    }
+    *p = &batch;
+    pthread_cond_broadcast(&pool_work);
+
+    // help with our own batch instead of just waiting for it
+    while (batch.next_task < batch.num_tasks) {
+        uint32_t task_idx = take_task(&batch);
+        pthread_mutex_unlock(&pool_mutex);
+        run_task(&batch, task_idx);
+        pthread_mutex_lock(&pool_mutex);
+    }
+    while (batch.unfinished != 0) {
+        pthread_cond_wait(&batch.done, &pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_cond_destroy(&batch.done);
+}
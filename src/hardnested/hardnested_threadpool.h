@@ -0,0 +1,26 @@
+//-----------------------------------------------------------------------------
+// Copyright (C) 2016, 2017 by piwi
+//
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// A process wide pool of worker threads. All hardnested attacks running in
+// one process share it, i.e. concurrent solves compete for the same num_CPUs()
+// workers instead of each one starting its own set of threads.
+//-----------------------------------------------------------------------------
+
+#ifndef HARDNESTED_THREADPOOL_H__
+#define HARDNESTED_THREADPOOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef void *hardnested_task_t(void *);
+
+// Run num_tasks instances of task on the shared pool. Task i is called with
+// (char *)args + i * arg_size. Returns when all of them have finished. The
+// calling thread works on its own batch while waiting.
+extern void hardnested_pool_run(hardnested_task_t *task, void *args, size_t arg_size, uint32_t num_tasks);
+
+#endif
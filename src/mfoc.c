@@ -38,6 +38,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
 #ifdef _MSC_VER
 #include "unistd_w.h"
 #include "getopt.h"
@@ -57,16 +58,21 @@
 #include "mifare.h"
 #include "nfc-utils.h"
 #include "mfoc.h"
+#include "util_posix.h"
 
 //SLRE 
 #include "slre.h"
 #include "slre.c"
 #include "cmdhfmfhard.h"
+#include "hardnested/hardnested_threadpool.h"
 
 #define MAX_FRAME_LEN 264
+// Fleet mode
+#define MAX_READERS 16
+#define FLEET_POLL_INTERVAL 250 // ms between looking for a new card or for the removal of the last one
 
-mftag        t;
-mfreader    r;
+THREAD_LOCAL mftag        t;
+THREAD_LOCAL mfreader    r;
 
 static const nfc_modulation nm = {
 .nmt = NMT_ISO14443A,
@@ -75,12 +81,37 @@ static const nfc_modulation nm = {
 
 nfc_context *context;
 
-uint64_t knownKey = 0;
-char knownKeyLetter = 'A';
-uint32_t knownSector = 0;
-uint32_t unknownSector = 0;
-char unknownKeyLetter = 'A';
-uint32_t unexpected_random = 0;
+THREAD_LOCAL uint64_t knownKey = 0;
+THREAD_LOCAL char knownKeyLetter = 'A';
+THREAD_LOCAL uint32_t knownSector = 0;
+THREAD_LOCAL uint32_t unknownSector = 0;
+THREAD_LOCAL char unknownKeyLetter = 'A';
+THREAD_LOCAL uint32_t unexpected_random = 0;
+
+// Command line options. Set by main() and only read afterwards, also by the readers in fleet mode.
+static int probes = DEFAULT_PROBES_NR;
+static int sets = DEFAULT_SETS_NR;
+static uint32_t tolerance = DEFAULT_TOLERANCE;
+static bool opt_use_default_key = true;
+static bool force_hardnested = false;
+// Next default key specified as option (-k)
+static uint8_t *opt_defKeys = NULL;
+static size_t opt_defKeys_len = 0;
+// Hardnested low memory
+static bool hard_low_memory = false;
+// Solve hardnested targets in the background while acquiring the nonces for the next one
+static bool hardnested_background = false;
+// Start brute forcing hardnested targets speculatively while still acquiring their nonces
+static bool hard_speculative = false;
+// Maximum probability that the Sum(a8) guesses of secondary first bytes exclude the hardnested key (0: don't use them)
+static float hard_sum_a8_risk = 0.0;
+// Fleet mode: number of readers to use (0: single card on the first reader)
+static int num_readers = 0;
+static char *dump_file = NULL;
+
+// Hardnested tables, shared by all hardnested attacks (on all readers)
+static hardnested_tables_t *hardnested_tables = NULL;
+static pthread_mutex_t hardnested_tables_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 // Sectors 0 to 31 have 4 blocks per sector.
@@ -96,25 +127,36 @@ uint8_t sector_to_block(uint8_t sector)
   return 128+(sector<<4);
 }
 
-int main(int argc, char *const argv[])
+// The hardnested tables are created on first use and then shared by all readers
+static hardnested_tables_t *get_hardnested_tables(void)
+{
+  pthread_mutex_lock(&hardnested_tables_mutex);
+  if (hardnested_tables == NULL) {
+    hardnested_tables = hardnested_tables_create(hard_low_memory, hard_speculative, hard_sum_a8_risk);
+  }
+  pthread_mutex_unlock(&hardnested_tables_mutex);
+  return hardnested_tables;
+}
+
+// Recover the keys of the tag in front of r.pdi and dump it to pfDump (if not NULL). pfDump is closed on return.
+// Unless EXIT_SUCCESS is returned, nothing complete has been written to it.
+static int recover_card(FILE *pfDump)
 {
-  int ch, i, k, n, j, m;
+  int i, n, j, m;
   int key, block;
-  int succeed = 1;
 
   // Exploit sector
   int e_sector;
-  int probes = DEFAULT_PROBES_NR;
-  int sets = DEFAULT_SETS_NR;
 
   // By default, dump 'A' keys
   int dumpKeysA = true;
   bool failure = false;
   bool skip = false;
-  bool force_hardnested = false;
-  // Next default key specified as option (-k)
-  uint8_t *defKeys = NULL, *p;
-  size_t defKeys_len = 0;
+  int nested_res;
+  // The keys to try. Replaced by the keys found so far when checking for key reuse
+  uint8_t *defKeys = opt_defKeys;
+  size_t defKeys_len = opt_defKeys_len;
+  bool use_default_key = opt_use_default_key;
 
   // Array with default Mifare Classic keys
   uint8_t defaultKeys[][6] = {
@@ -134,133 +176,32 @@ int main(int argc, char *const argv[])
 
   };
 
-  denonce        d = {NULL, 0, DEFAULT_DIST_NR, DEFAULT_TOLERANCE, {0x00, 0x00, 0x00}};
+  denonce        d = {NULL, 0, DEFAULT_DIST_NR, tolerance, {0x00, 0x00, 0x00}, 0, 0};
 
   // Pointers to possible keys
-  pKeys        *pk;
-  countKeys    *ck;
+  pKeys        *pk = NULL;
+  // Sectors attacked with the nested attack whose keys are still being recovered
+  nested_target_t *nested_targets = NULL;
 
   // Pointer to already broken keys, except defaults
-  bKeys        *bk;
+  bKeys        *bk = NULL;
 
-  static mifare_param mp, mtmp;
-  static mifare_classic_tag mtDump;
+  mifare_param mp, mtmp;
+  mifare_classic_tag mtDump;
 
   mifare_cmd mc;
-  FILE *pfDump = NULL;
-  
-  // Hardnested low memory
-  bool hard_low_memory = false;
-  
-  //File pointers for the keyfile 
-  FILE * fp;
-  char line[20];
+  hardnested_result_t hardnested_res;
 
-  bool use_default_key=true;
-  //Regexp declarations
-  static const char *regex = "([0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f])";
-  struct slre_cap caps[2];  
+  memset(&mp, 0, sizeof(mp));
+  memset(&mtmp, 0, sizeof(mtmp));
+  memset(&mtDump, 0, sizeof(mtDump));
+  t.sectors = NULL;
 
-  // Parse command line arguments
-  while ((ch = getopt(argc, argv, "hCZFP:T:O:k:f:")) != -1) {
-    switch (ch) {
-      case 'C':
-        use_default_key=false;
-        break;
-      case 'P':
-        // Number of probes
-        if (!(probes = atoi(optarg)) || probes < 1) {
-          ERR("The number of probes must be a positive number");
-          exit(EXIT_FAILURE);
-        }
-        fprintf(stdout, "Number of probes: %d\n", probes);
-        break;
-      case 'T': {
-        int res;
-        // Nonce tolerance range
-        if (((res = atoi(optarg)) < 0)) {
-          ERR("The nonce distances range must be a zero or a positive number");
-          exit(EXIT_FAILURE);
-        }
-        d.tolerance = (uint32_t)res;
-        fprintf(stdout, "Tolerance number: %d\n", probes);
-      }
-      break;
-    case 'f':
-    if (!(fp = fopen(optarg, "r"))) {
-                fprintf(stderr, "Cannot open keyfile: %s, exiting\n", optarg);
-                exit(EXIT_FAILURE);
-    }
-        while ((fgets(line, sizeof(line), fp)) != NULL) {
-            int i, j = 0, str_len = strlen(line);
-            while (j < str_len &&
-                   (i = slre_match(regex, line + j, str_len - j, caps, 500, 1)) > 0) {
-                //We've found a key, let's add it to the structure.
-                p = realloc(defKeys, defKeys_len + 6);
-                if (!p) {
-                  ERR("Cannot allocate memory for defKeys");
-                  exit(EXIT_FAILURE);
-                }                
-                defKeys = p;
-                memset(defKeys + defKeys_len, 0, 6);
-                num_to_bytes(strtoll(caps[0].ptr, NULL, 16), 6, defKeys + defKeys_len);
-                fprintf(stdout, "The custom key 0x%.*s has been added to the default keys\n", caps[0].len, caps[0].ptr);
-                defKeys_len = defKeys_len + 6;
-                
-              j += i;
-            }
-        }
-      break;
-      case 'k':
-        // Add this key to the default keys
-        p = realloc(defKeys, defKeys_len + 6);
-        if (!p) {
-          ERR("Cannot allocate memory for defKeys");
-          exit(EXIT_FAILURE);
-        }
-        defKeys = p;
-        memset(defKeys + defKeys_len, 0, 6);
-        num_to_bytes(strtoll(optarg, NULL, 16), 6, defKeys + defKeys_len);
-        fprintf(stdout, "The custom key 0x%012llx has been added to the default keys\n", bytes_to_num(defKeys + defKeys_len, 6));
-        defKeys_len = defKeys_len + 6;
-
-        break;
-      case 'F':
-        //force hardnested
-        force_hardnested = true;
-        break;
-      case 'Z':
-        //Reduce memory usage
-        hard_low_memory = true;
-        break;
-      case 'O':
-        // File output
-        if (!(pfDump = fopen(optarg, "wb"))) {
-          fprintf(stderr, "Cannot open: %s, exiting\n", optarg);
-          exit(EXIT_FAILURE);
-        }
-        // fprintf(stdout, "Output file: %s\n", optarg);
-        break;
-      case 'h':
-        usage(stdout, 0);
-        break;
-      default:
-        usage(stderr, 1);
-        break;
-    }
+  if (!mf_configure(r.pdi)) {
+    goto error;
   }
 
-  // if (!pfDump) {
-  //   ERR("parameter -O is mandatory");
-  //   exit(EXIT_FAILURE);
-  // }
-
-  // Initialize reader/tag structures
-  mf_init(&r);
-
-  mf_configure(r.pdi);
-
-  int tag_count;
+  int tag_count, is_2k;
   if ((tag_count = nfc_initiator_select_passive_target(r.pdi, nm, NULL, 0, &t.nt)) < 0) {
     nfc_perror(r.pdi, "nfc_initiator_select_passive_target");
     goto error;
@@ -285,7 +226,10 @@ int main(int argc, char *const argv[])
     case 0x08:
     case 0x88:
     case 0x28:
-      if (get_rats_is_2k(t, r)) {
+      if ((is_2k = get_rats_is_2k(t, r)) < 0) {
+        goto error;
+      }
+      if (is_2k) {
           printf("Found Mifare Plus 2k tag\n");
           t.num_sectors = NR_TRAILERS_2k;
           t.num_blocks = NR_BLOCKS_2k;
@@ -412,7 +356,9 @@ int main(int argc, char *const argv[])
               nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
               goto error;
             }
-            mf_anticollision(t, r);
+            if (!mf_anticollision(t, r)) {
+              goto error;
+            }
           } else {
             // Save all information about successfull keyA authentization
             memcpy(t.sectors[i].KeyA, mp.mpa.abtKey, sizeof(mp.mpa.abtKey));
@@ -429,8 +375,9 @@ int main(int argc, char *const argv[])
                 memcpy(mtmp.mpa.abtAuthUid, t.nt.nti.nai.abtUid + t.nt.nti.nai.szUidLen - 4, sizeof(mtmp.mpa.abtAuthUid));
                 if ((nfc_initiator_mifare_cmd(r.pdi, MC_AUTH_B, block, &mtmp)) < 0) {
                   //fprintf(stdout, "Failed!\n");
-                  mf_configure(r.pdi);
-                  mf_anticollision(t, r);
+                  if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+                    goto error;
+                  }
                 } else {
                   //fprintf(stdout, "OK\n");
                   memcpy(t.sectors[i].KeyB, mtmp.mpd.abtData + 10, sizeof(t.sectors[i].KeyB));
@@ -444,7 +391,9 @@ int main(int argc, char *const argv[])
                     nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
                     goto error;
                   }
-                mf_anticollision(t, r);
+                if (!mf_anticollision(t, r)) {
+                  goto error;
+                }
               }
             }
           }
@@ -458,7 +407,9 @@ int main(int argc, char *const argv[])
               nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
               goto error;
             }
-            mf_anticollision(t, r);
+            if (!mf_anticollision(t, r)) {
+              goto error;
+            }
             // No success, try next block
             t.sectors[i].trailer = block;
           } else {
@@ -510,15 +461,30 @@ int main(int argc, char *const argv[])
   }
   fflush(stdout);
 
-  // Return the first (exploit) sector encrypted with the default key or -1 (we have all keys)
+  // Return the first (exploit) sector encrypted with the default key, -1 (we have all keys) or -2 (no key at all)
   e_sector = find_exploit_sector(t);
+  if (e_sector == -2) {
+    goto error;
+  }
   //mf_enhanced_auth(e_sector, 0, t, r, &d, pk, 'd'); // AUTH + Get Distances mode
 
   // Recover key from encrypted sectors, j is a sector counter
   for (m = 0; m < 2; ++m) {
     if (e_sector == -1) break; // All keys are default, I am skipping recovery mode
     for (j = 0; j < (t.num_sectors); ++j) {
+      // Apply the keys of hardnested targets solved in the background so far
+      if (hardnested_background_result(&hardnested_res, false)) {
+        goto check_keys;
+      }
+      // Same for the nested targets. Those which came out without key get another probe.
+      while ((nested_res = nested_process(&nested_targets, false, e_sector, &d, pk, bk)) > 0);
+      if (nested_res < 0) {
+        goto error;
+      }
       memcpy(mp.mpa.abtAuthUid, t.nt.nti.nai.abtUid + t.nt.nti.nai.szUidLen - 4, sizeof(mp.mpa.abtAuthUid));
+      if (hardnested_background_pending(sector_to_block(j), dumpKeysA ? MC_AUTH_A : MC_AUTH_B) || nested_pending(nested_targets, j, dumpKeysA)) {
+        continue; // still being solved
+      }
       if ((dumpKeysA && !t.sectors[j].foundKeyA) || (!dumpKeysA && !t.sectors[j].foundKeyB)) {
 
         // First, try already broken keys
@@ -532,7 +498,9 @@ int main(int argc, char *const argv[])
               nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
               goto error;
             }
-            mf_anticollision(t, r);
+            if (!mf_anticollision(t, r)) {
+              goto error;
+            }
           } else {
             // Save all information about successfull authentization
             printf("Sector: %d, type %c\n", j, (dumpKeysA ? 'A' : 'B'));
@@ -547,8 +515,9 @@ int main(int argc, char *const argv[])
                   memcpy(mtmp.mpa.abtAuthUid, t.nt.nti.nai.abtUid + t.nt.nti.nai.szUidLen - 4, sizeof(mtmp.mpa.abtAuthUid));
                   if ((nfc_initiator_mifare_cmd(r.pdi, MC_AUTH_B, t.sectors[j].trailer, &mtmp)) < 0) {
                     fprintf(stdout, "Failed!\n");
-                    mf_configure(r.pdi);
-                    mf_anticollision(t, r);
+                    if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+                      goto error;
+                    }
                   } else {
                     fprintf(stdout, "OK\n");
                     memcpy(t.sectors[j].KeyB, mtmp.mpd.abtData + 10, sizeof(t.sectors[j].KeyB));
@@ -562,7 +531,9 @@ int main(int argc, char *const argv[])
                       nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
                       goto error;
                     }
-                  mf_anticollision(t, r);
+                  if (!mf_anticollision(t, r)) {
+                    goto error;
+                  }
                 }
               }
             } else {
@@ -571,260 +542,497 @@ int main(int argc, char *const argv[])
             }
             fprintf(stdout, "  Found Key: %c [%012llx]\n", (dumpKeysA ? 'A' : 'B'),
                     bytes_to_num(mp.mpa.abtKey, 6));
-            mf_configure(r.pdi);
-            mf_anticollision(t, r);
+            if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+              goto error;
+            }
             skip = true;
             break;
           }
         }
         if (skip) continue; // We have already revealed key, go to the next iteration
         
-        if ((mf_enhanced_auth(e_sector, 0, t, r, &d, pk, 'd', dumpKeysA, 0, 0) == -99999) || force_hardnested == true) {
+        int auth_res = mf_enhanced_auth(e_sector, 0, t, r, &d, pk, 'd', dumpKeysA, 0, 0); // AUTH + Get Distances mode
+        if (auth_res == AUTH_TAG_LOST) {
+          goto error;
+        }
+        if (auth_res == AUTH_NOT_VULNERABLE || force_hardnested == true) {
         //Hardnested attack
             
-            mf_configure(r.pdi);
-            mf_anticollision(t, r);
+            if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+              goto error;
+            }
             
             uint8_t blockNo = sector_to_block(e_sector); //Block
             uint8_t keyType = (t.sectors[e_sector].foundKeyA ? MC_AUTH_A : MC_AUTH_B);
             uint8_t *key = (t.sectors[e_sector].foundKeyA ? t.sectors[e_sector].KeyA : t.sectors[e_sector].KeyB);;
             uint8_t trgBlockNo = sector_to_block(j); //block
             uint8_t trgKeyType = (dumpKeysA ? MC_AUTH_A : MC_AUTH_B);
-            mfnestedhard(blockNo, keyType, key, trgBlockNo, trgKeyType, hard_low_memory);
+            hardnested_tables_t *hardnested_tables = get_hardnested_tables();
+            int hardnested_status;
+            if (hardnested_background) {
+              // continue with the next sector while this one is brute forced
+              hardnested_status = mfnestedhard_background(hardnested_tables, blockNo, keyType, key, trgBlockNo, trgKeyType);
+            } else {
+              hardnested_status = mfnestedhard(hardnested_tables, blockNo, keyType, key, trgBlockNo, trgKeyType);
+            }
+            if (hardnested_status != HARDNESTED_OK) {
+              // the tag is gone, or its nonces (or the reader's) can't be used. Trying again would just loop
+              ERR("%s, the hardnested attack is not possible", hardnested_status == HARDNESTED_STATIC_NONCE ? "Static encrypted nonce" :
+                  hardnested_status == HARDNESTED_BIASED_NONCE ? "Biased encrypted nonce" :
+                  hardnested_status == HARDNESTED_PARITY_ERRORS ? "Inconsistent nonce parity bits" :
+                  hardnested_status == HARDNESTED_NO_READER ? "Nonce reader thread not started" : "Tag removed");
+              goto error;
+            }
             did_hardnested=true;
+            if (hardnested_background) {
+              continue;
+            }
             goto check_keys;
         } else {
             //Nested attack
             // DSR! - fix https://github.com/vk496/mfoc/issues/4
-            mf_configure(r.pdi);
-            mf_anticollision(t, r);
+            if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+              goto error;
+            }
           
-            // Max probes for auth for each sector
-            for (k = 0; k < probes; ++k) {
-              // Try to authenticate to exploit sector and determine distances (filling denonce.distances)
-              mf_enhanced_auth(e_sector, 0, t, r, &d, pk, 'd', dumpKeysA, 0, 0); // AUTH + Get Distances mode
-              printf("Sector: %d, type %c, probe %d, distance %d ", j, (dumpKeysA ? 'A' : 'B'), k, d.median);
-              // Configure device to the previous state
-              mf_configure(r.pdi);
-              mf_anticollision(t, r);
-
-              pk->possibleKeys = NULL;
-              pk->size = 0;
-              // We have 'sets' * 32b keystream of potential keys
-              for (n = 0; n < sets; n++) {
-                // AUTH + Recovery key mode (for a_sector), repeat 5 times
-                mf_enhanced_auth(e_sector, t.sectors[j].trailer, t, r, &d, pk, 'r', dumpKeysA, 0, 0);
-                mf_configure(r.pdi);
-                mf_anticollision(t, r);
-                fprintf(stdout, ".");
-                fflush(stdout);
-              }
-              fprintf(stdout, "\n");
-              // Get first 15 grouped keys
-              ck = uniqsort(pk->possibleKeys, pk->size);
-              for (i = 0; i < TRY_KEYS ; i++) {
-                // We don't known this key, try to break it
-                // This key can be found here two or more times
-                if (ck[i].count > 0) {
-                  // fprintf(stdout,"%d %llx\n",ck[i].count, ck[i].key);
-                  // Set required authetication method
-                  num_to_bytes(ck[i].key, 6, mp.mpa.abtKey);
-                  mc = dumpKeysA ? MC_AUTH_A : MC_AUTH_B;
-                  int res;
-                  if ((res = nfc_initiator_mifare_cmd(r.pdi, mc, t.sectors[j].trailer, &mp)) < 0) {
-                    if (res != NFC_EMFCAUTHFAIL) {
-                      nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
-                      goto error;
-                    }
-                    mf_anticollision(t, r);
-                  } else {
-                    // Save all information about successfull authentization
-                    bk->size++;
-                    bk->brokenKeys = (uint64_t *) realloc((void *)bk->brokenKeys, bk->size * sizeof(uint64_t));
-                    bk->brokenKeys[bk->size - 1] = bytes_to_num(mp.mpa.abtKey, sizeof(mp.mpa.abtKey));
-                    if (dumpKeysA) {
-                      memcpy(t.sectors[j].KeyA, mp.mpa.abtKey, sizeof(mp.mpa.abtKey));
-                      t.sectors[j].foundKeyA = true;
-
-                    } else {
-                      memcpy(t.sectors[j].KeyB, mp.mpa.abtKey, sizeof(mp.mpa.abtKey));
-                      t.sectors[j].foundKeyB = true;
-                    }
-                    fprintf(stdout, "  Found Key: %c [%012llx]\n", (dumpKeysA ? 'A' : 'B'),
-                            bytes_to_num(mp.mpa.abtKey, 6));
-                    // if we need KeyB for this sector, it should be revealed by a data read with KeyA
-                    if (!t.sectors[j].foundKeyB) {
-                      if ((res = nfc_initiator_mifare_cmd(r.pdi, MC_READ, t.sectors[j].trailer, &mtmp)) >= 0) {
-                        fprintf(stdout, "  Data read with Key A revealed Key B: [%012llx] - checking Auth: ", bytes_to_num(mtmp.mpd.abtData + 10, sizeof(mtmp.mpa.abtKey)));
-                        memcpy(mtmp.mpa.abtKey, mtmp.mpd.abtData + 10, sizeof(mtmp.mpa.abtKey));
-                        memcpy(mtmp.mpa.abtAuthUid, t.nt.nti.nai.abtUid + t.nt.nti.nai.szUidLen - 4, sizeof(mtmp.mpa.abtAuthUid));
-                        if ((nfc_initiator_mifare_cmd(r.pdi, MC_AUTH_B, t.sectors[j].trailer, &mtmp)) < 0) {
-                          fprintf(stdout, "Failed!\n");
-                          mf_configure(r.pdi);
-                          mf_anticollision(t, r);
-                        } else {
-                          fprintf(stdout, "OK\n");
-                          memcpy(t.sectors[j].KeyB, mtmp.mpd.abtData + 10, sizeof(t.sectors[j].KeyB));
-                          t.sectors[j].foundKeyB = true;
-                          bk->size++;
-                          bk->brokenKeys = (uint64_t *) realloc((void *)bk->brokenKeys, bk->size * sizeof(uint64_t));
-                          bk->brokenKeys[bk->size - 1] = bytes_to_num(mtmp.mpa.abtKey, sizeof(mtmp.mpa.abtKey));
-                        }
-                      } else {
-                          if (res != NFC_ERFTRANS) {
-                            nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
-                            goto error;
-                          }
-                        mf_anticollision(t, r);
-                      }
-                    }
-                    mf_configure(r.pdi);
-                    mf_anticollision(t, r);
-                    break;
-                  }
-                }
-              }
-              free(pk->possibleKeys);
-              free(ck);
-              // Success, try the next sector
-              if ((dumpKeysA && t.sectors[j].foundKeyA) || (!dumpKeysA && t.sectors[j].foundKeyB)) break;
+            // Only capture the nonces here. The keys are recovered in the background while we go on with the next sectors.
+            nested_target_t *target = nested_target_add(&nested_targets, j, dumpKeysA);
+            if (!nested_capture(target, e_sector, &d, pk)) {
+              goto error;
             }
-        }
-        // We haven't found any key, exiting
-        if ((dumpKeysA && !t.sectors[j].foundKeyA) || (!dumpKeysA && !t.sectors[j].foundKeyB)) {
-          ERR("No success, maybe you should increase the probes");
-          goto error;
+            continue;
         }
       }
     }
+    // Wait for the nested targets of this key type
+    while ((nested_res = nested_process(&nested_targets, true, e_sector, &d, pk, bk)) > 0);
+    if (nested_res < 0) {
+      goto error;
+    }
     dumpKeysA = false;
   }
 
+  // Wait for the hardnested targets still being solved in the background
+  if (hardnested_background_result(&hardnested_res, true)) {
+    dumpKeysA = true;
+    goto check_keys;
+  }
+
 
   for (i = 0; i < (t.num_sectors); ++i) {
     if ((dumpKeysA && !t.sectors[i].foundKeyA) || (!dumpKeysA && !t.sectors[i].foundKeyB)) {
       fprintf(stdout, "\nTry again, there are still some encrypted blocks\n");
-      succeed = 0;
-      break;
+      // Don't leave an incomplete dump behind, the caller removes the empty file
+      goto error;
     }
   }
 
-  if (succeed) {
-    i = t.num_sectors; // Sector counter
-    fprintf(stdout, "Auth with all sectors succeeded, dumping keys to a file!\n");
-    // Read all blocks
-    for (block = t.num_blocks; block >= 0; block--) {
-      trailer_block(block) ? i-- : i;
-      failure = true;
-
-      // Try A key, auth() + read()
-      memcpy(mp.mpa.abtKey, t.sectors[i].KeyA, sizeof(t.sectors[i].KeyA));
-      int res;
-      if ((res = nfc_initiator_mifare_cmd(r.pdi, MC_AUTH_A, block, &mp)) < 0) {
-        if (res != NFC_EMFCAUTHFAIL) {
+  i = t.num_sectors; // Sector counter
+  fprintf(stdout, "Auth with all sectors succeeded, dumping keys to a file!\n");
+  // Read all blocks
+  for (block = t.num_blocks; block >= 0; block--) {
+    trailer_block(block) ? i-- : i;
+    failure = true;
+
+    // Try A key, auth() + read()
+    memcpy(mp.mpa.abtKey, t.sectors[i].KeyA, sizeof(t.sectors[i].KeyA));
+    int res;
+    if ((res = nfc_initiator_mifare_cmd(r.pdi, MC_AUTH_A, block, &mp)) < 0) {
+      if (res != NFC_EMFCAUTHFAIL) {
+        nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
+        goto error;
+      }
+      if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+        goto error;
+      }
+    } else { // and Read
+      if ((res = nfc_initiator_mifare_cmd(r.pdi, MC_READ, block, &mp)) >= 0) {
+        fprintf(stdout, "Block %02d, type %c, key %012llx :", block, 'A', bytes_to_num(t.sectors[i].KeyA, 6));
+        print_hex(mp.mpd.abtData, 16);
+        if (!mf_configure(r.pdi) || !mf_select_tag(r.pdi, &(t.nt))) {
+          goto error;
+        }
+        failure = false;
+      } else {
+        // Error, now try read() with B key
+        if (res != NFC_ERFTRANS) {
           nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
           goto error;
         }
-        mf_configure(r.pdi);
-        mf_anticollision(t, r);
-      } else { // and Read
-        if ((res = nfc_initiator_mifare_cmd(r.pdi, MC_READ, block, &mp)) >= 0) {
-          fprintf(stdout, "Block %02d, type %c, key %012llx :", block, 'A', bytes_to_num(t.sectors[i].KeyA, 6));
-          print_hex(mp.mpd.abtData, 16);
-          mf_configure(r.pdi);
-          mf_select_tag(r.pdi, &(t.nt));
-          failure = false;
-        } else {
-          // Error, now try read() with B key
-          if (res != NFC_ERFTRANS) {
+        if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+          goto error;
+        }
+        memcpy(mp.mpa.abtKey, t.sectors[i].KeyB, sizeof(t.sectors[i].KeyB));
+        if ((res = nfc_initiator_mifare_cmd(r.pdi, MC_AUTH_B, block, &mp)) < 0) {
+          if (res != NFC_EMFCAUTHFAIL) {
             nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
             goto error;
           }
-          mf_configure(r.pdi);
-          mf_anticollision(t, r);
-          memcpy(mp.mpa.abtKey, t.sectors[i].KeyB, sizeof(t.sectors[i].KeyB));
-          if ((res = nfc_initiator_mifare_cmd(r.pdi, MC_AUTH_B, block, &mp)) < 0) {
-            if (res != NFC_EMFCAUTHFAIL) {
+          if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+            goto error;
+          }
+        } else { // and Read
+          if ((res = nfc_initiator_mifare_cmd(r.pdi, MC_READ, block, &mp)) >= 0) {
+            fprintf(stdout, "Block %02d, type %c, key %012llx :", block, 'B', bytes_to_num(t.sectors[i].KeyB, 6));
+            print_hex(mp.mpd.abtData, 16);
+            if (!mf_configure(r.pdi) || !mf_select_tag(r.pdi, &(t.nt))) {
+              goto error;
+            }
+            failure = false;
+          } else {
+            if (res != NFC_ERFTRANS) {
               nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
               goto error;
             }
-            mf_configure(r.pdi);
-            mf_anticollision(t, r);
-          } else { // and Read
-            if ((res = nfc_initiator_mifare_cmd(r.pdi, MC_READ, block, &mp)) >= 0) {
-              fprintf(stdout, "Block %02d, type %c, key %012llx :", block, 'B', bytes_to_num(t.sectors[i].KeyB, 6));
-              print_hex(mp.mpd.abtData, 16);
-              mf_configure(r.pdi);
-              mf_select_tag(r.pdi, &(t.nt));
-              failure = false;
-            } else {
-              if (res != NFC_ERFTRANS) {
-                nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
-                goto error;
-              }
-              mf_configure(r.pdi);
-              mf_anticollision(t, r);
-              // ERR ("Error: Read B");
+            if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+              goto error;
             }
+            // ERR ("Error: Read B");
           }
         }
       }
-      if (trailer_block(block)) {
-        // Copy the keys over from our key dump and store the retrieved access bits
-        memcpy(mtDump.amb[block].mbt.abtKeyA, t.sectors[i].KeyA, 6);
-        memcpy(mtDump.amb[block].mbt.abtKeyB, t.sectors[i].KeyB, 6);
-        if (!failure) memcpy(mtDump.amb[block].mbt.abtAccessBits, mp.mpd.abtData + 6, 4);
-      } else if (!failure) memcpy(mtDump.amb[block].mbd.abtData, mp.mpd.abtData, 16);
-      memcpy(mp.mpa.abtAuthUid, t.nt.nti.nai.abtUid + t.nt.nti.nai.szUidLen - 4, sizeof(mp.mpa.abtAuthUid));
     }
+    if (trailer_block(block)) {
+      // Copy the keys over from our key dump and store the retrieved access bits
+      memcpy(mtDump.amb[block].mbt.abtKeyA, t.sectors[i].KeyA, 6);
+      memcpy(mtDump.amb[block].mbt.abtKeyB, t.sectors[i].KeyB, 6);
+      if (!failure) memcpy(mtDump.amb[block].mbt.abtAccessBits, mp.mpd.abtData + 6, 4);
+    } else if (!failure) memcpy(mtDump.amb[block].mbd.abtData, mp.mpd.abtData, 16);
+    memcpy(mp.mpa.abtAuthUid, t.nt.nti.nai.abtUid + t.nt.nti.nai.szUidLen - 4, sizeof(mp.mpa.abtAuthUid));
+  }
 
-    // Finally save all keys + data to file
-    if (pfDump) {
-      uint16_t dump_size = (t.num_blocks + 1) * 16;
-      if (fwrite(&mtDump, 1, dump_size, pfDump) != dump_size) {
-        fprintf(stdout, "Error, cannot write dump\n");
-        fclose(pfDump);
-        goto error;
-      }
+  // Finally save all keys + data to file
+  if (pfDump) {
+    uint16_t dump_size = (t.num_blocks + 1) * 16;
+    if (fwrite(&mtDump, 1, dump_size, pfDump) != dump_size) {
+      fprintf(stdout, "Error, cannot write dump\n");
       fclose(pfDump);
+      pfDump = NULL;
+      goto error;
+    }
+    fclose(pfDump);
+  }
+
+  free(t.sectors);
+  t.sectors = NULL;
+  free(d.distances);
+  free(pk);
+  free(bk->brokenKeys);
+  free(bk);
+
+  // Reset the "advanced" configuration to normal
+  nfc_device_set_property_bool(r.pdi, NP_HANDLE_CRC, true);
+  nfc_device_set_property_bool(r.pdi, NP_HANDLE_PARITY, true);
+
+  return EXIT_SUCCESS;
+error:
+  // Stop the hardnested targets of this card still being solved in the background, and collect them
+  hardnested_background_cancel();
+  while (hardnested_background_result(&hardnested_res, true));
+  nested_targets_free(&nested_targets);
+  if (pfDump) {
+    fclose(pfDump);
+  }
+  free(t.sectors);
+  t.sectors = NULL;
+  free(d.distances);
+  free(pk);
+  if (bk != NULL) {
+    free(bk->brokenKeys);
+  }
+  free(bk);
+
+  // Reset the "advanced" configuration to normal
+  nfc_device_set_property_bool(r.pdi, NP_HANDLE_CRC, true);
+  nfc_device_set_property_bool(r.pdi, NP_HANDLE_PARITY, true);
+
+  return EXIT_FAILURE;
+}
+
+// Fleet mode: one thread per reader, each of them recovering the cards presented to its reader one after the
+// other. Reader I/O (dictionary checks, nonce acquisition) runs on the reader threads, hardnested candidate
+// generation and brute force of all readers share one worker pool and one set of tables.
+
+typedef struct {
+  int reader_no;
+  nfc_connstring connstring;
+  pthread_t thread;
+} fleet_reader;
+
+
+static void *
+#ifdef __has_attribute
+#if __has_attribute(force_align_arg_pointer)
+__attribute__((force_align_arg_pointer))
+#endif
+#endif
+fleet_reader_thread(void *arg)
+{
+  fleet_reader *reader = (fleet_reader *) arg;
+  uint32_t cards = 0;
+
+  r.pdi = nfc_open(context, reader->connstring);
+  if (!r.pdi) {
+    printf("Reader %d: cannot open %s\n", reader->reader_no, reader->connstring);
+    return NULL;
+  }
+  printf("Reader %d: %s\n", reader->reader_no, nfc_device_get_name(r.pdi));
+
+  while (true) {
+    // Wait for the next card
+    nfc_target nt;
+    if (!mf_configure(r.pdi)) {
+      printf("Reader %d: failed, no more cards on this reader\n", reader->reader_no);
+      break;
+    }
+    while (nfc_initiator_select_passive_target(r.pdi, nm, NULL, 0, &nt) <= 0) {
+      msleep(FLEET_POLL_INTERVAL);
+    }
+
+    char uid[2 * 10 + 1] = "";
+    for (size_t k = 0; k < nt.nti.nai.szUidLen && k < 10; k++) {
+      sprintf(uid + 2 * k, "%02x", nt.nti.nai.abtUid[k]);
+    }
+    printf("Reader %d: card %s\n", reader->reader_no, uid);
+
+    FILE *pfDump = NULL;
+    char dump_name[FILENAME_MAX];
+    if (dump_file) {
+      snprintf(dump_name, sizeof(dump_name), "%s-%s.mfd", dump_file, uid);
+      if (!(pfDump = fopen(dump_name, "wb"))) {
+        fprintf(stderr, "Reader %d: cannot open %s\n", reader->reader_no, dump_name);
+      }
+    }
+
+    uint64_t card_start = msclock();
+    int res = recover_card(pfDump);
+    if (res != EXIT_SUCCESS && pfDump) {
+      remove(dump_name);
+    }
+    cards++;
+    printf("Reader %d: card %s %s after %" PRIu64 "s (%" PRIu32 " cards so far)\n", reader->reader_no, uid,
+           res == EXIT_SUCCESS ? "done" : "failed", (msclock() - card_start) / 1000, cards);
+
+    // Wait until the card has been taken away
+    while (nfc_initiator_target_is_present(r.pdi, NULL) == NFC_SUCCESS) {
+      msleep(FLEET_POLL_INTERVAL);
+    }
+  }
+
+  nfc_close(r.pdi);
+  return NULL;
+}
+
+
+static int mfoc_fleet(void)
+{
+  nfc_connstring connstrings[MAX_READERS];
+  fleet_reader readers[MAX_READERS];
+
+  size_t num_devices = nfc_list_devices(context, connstrings, num_readers < MAX_READERS ? num_readers : MAX_READERS);
+  if (num_devices == 0) {
+    printf("No NFC device found.\n");
+    return EXIT_FAILURE;
+  }
+  printf("Fleet mode with %d reader(s). Present the cards one after the other to any of them.\n", (int) num_devices);
+
+  for (size_t i = 0; i < num_devices; i++) {
+    readers[i].reader_no = i;
+    memcpy(readers[i].connstring, connstrings[i], sizeof(nfc_connstring));
+    if (pthread_create(&readers[i].thread, NULL, fleet_reader_thread, &readers[i])) {
+      ERR("Cannot start reader thread");
+      return EXIT_FAILURE;
+    }
+  }
+  for (size_t i = 0; i < num_devices; i++) {
+    pthread_join(readers[i].thread, NULL);
+  }
+
+  hardnested_tables_free(hardnested_tables);
+  return EXIT_SUCCESS;
+}
+int main(int argc, char *const argv[])
+{
+  int ch;
+  uint8_t *p;
+  FILE *pfDump = NULL;
+
+  //File pointers for the keyfile 
+  FILE * fp;
+  char line[20];
+
+  //Regexp declarations
+  static const char *regex = "([0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f])";
+  struct slre_cap caps[2];  
+
+  // Parse command line arguments
+  while ((ch = getopt(argc, argv, "hCZBSFN:P:T:R:O:k:f:")) != -1) {
+    switch (ch) {
+      case 'C':
+        opt_use_default_key=false;
+        break;
+      case 'P':
+        // Number of probes
+        if (!(probes = atoi(optarg)) || probes < 1) {
+          ERR("The number of probes must be a positive number");
+          exit(EXIT_FAILURE);
+        }
+        fprintf(stdout, "Number of probes: %d\n", probes);
+        break;
+      case 'T': {
+        int res;
+        // Nonce tolerance range
+        if (((res = atoi(optarg)) < 0)) {
+          ERR("The nonce distances range must be a zero or a positive number");
+          exit(EXIT_FAILURE);
+        }
+        tolerance = (uint32_t)res;
+        fprintf(stdout, "Tolerance number: %d\n", probes);
+      }
+      break;
+    case 'f':
+    if (!(fp = fopen(optarg, "r"))) {
+                fprintf(stderr, "Cannot open keyfile: %s, exiting\n", optarg);
+                exit(EXIT_FAILURE);
     }
+        while ((fgets(line, sizeof(line), fp)) != NULL) {
+            int i, j = 0, str_len = strlen(line);
+            while (j < str_len &&
+                   (i = slre_match(regex, line + j, str_len - j, caps, 500, 1)) > 0) {
+                //We've found a key, let's add it to the structure.
+                p = realloc(opt_defKeys, opt_defKeys_len + 6);
+                if (!p) {
+                  ERR("Cannot allocate memory for defKeys");
+                  exit(EXIT_FAILURE);
+                }                
+                opt_defKeys = p;
+                memset(opt_defKeys + opt_defKeys_len, 0, 6);
+                num_to_bytes(strtoll(caps[0].ptr, NULL, 16), 6, opt_defKeys + opt_defKeys_len);
+                fprintf(stdout, "The custom key 0x%.*s has been added to the default keys\n", caps[0].len, caps[0].ptr);
+                opt_defKeys_len = opt_defKeys_len + 6;
+                
+              j += i;
+            }
+        }
+      break;
+      case 'k':
+        // Add this key to the default keys
+        p = realloc(opt_defKeys, opt_defKeys_len + 6);
+        if (!p) {
+          ERR("Cannot allocate memory for defKeys");
+          exit(EXIT_FAILURE);
+        }
+        opt_defKeys = p;
+        memset(opt_defKeys + opt_defKeys_len, 0, 6);
+        num_to_bytes(strtoll(optarg, NULL, 16), 6, opt_defKeys + opt_defKeys_len);
+        fprintf(stdout, "The custom key 0x%012llx has been added to the default keys\n", bytes_to_num(opt_defKeys + opt_defKeys_len, 6));
+        opt_defKeys_len = opt_defKeys_len + 6;
+
+        break;
+      case 'F':
+        //force hardnested
+        force_hardnested = true;
+        break;
+      case 'Z':
+        //Reduce memory usage
+        hard_low_memory = true;
+        break;
+      case 'B':
+        //Brute force hardnested targets in the background
+        hardnested_background = true;
+        break;
+      case 'S':
+        //Speculative hardnested brute force during the nonce acquisition
+        hard_speculative = true;
+        break;
+      case 'R':
+        // Secondary Sum(a8) filters
+        if ((hard_sum_a8_risk = atof(optarg)) <= 0.0 || hard_sum_a8_risk >= 1.0) {
+          ERR("The Sum(a8) risk must be a probability between 0 and 1");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'N':
+        // Fleet mode
+        if ((num_readers = atoi(optarg)) < 1) {
+          ERR("The number of readers must be a positive number");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'O':
+        // File output. Opened once all options are known, in fleet mode one file per card
+        dump_file = optarg;
+        // fprintf(stdout, "Output file: %s\n", optarg);
+        break;
+      case 'h':
+        usage(stdout, 0);
+        break;
+      default:
+        usage(stderr, 1);
+        break;
+    }
+  }
+
+  // if (!pfDump) {
+  //   ERR("parameter -O is mandatory");
+  //   exit(EXIT_FAILURE);
+  // }
+
+  if (num_readers > 0) {
+    nfc_init(&context);
+    if (context == NULL) {
+      ERR("Unable to init libnfc (malloc)");
+      exit(EXIT_FAILURE);
+    }
+    int res = mfoc_fleet();
+    nfc_exit(context);
+    exit(res);
+  }
+
+  if (dump_file && !(pfDump = fopen(dump_file, "wb"))) {
+    fprintf(stderr, "Cannot open: %s, exiting\n", dump_file);
+    exit(EXIT_FAILURE);
   }
 
-  free(t.sectors);
-  free(d.distances);
+  // Initialize reader/tag structures
+  mf_init(&r);
 
-  // Reset the "advanced" configuration to normal
-  nfc_device_set_property_bool(r.pdi, NP_HANDLE_CRC, true);
-  nfc_device_set_property_bool(r.pdi, NP_HANDLE_PARITY, true);
+  int res = recover_card(pfDump);
+  if (res != EXIT_SUCCESS && pfDump) {
+    remove(dump_file);
+  }
+
+  hardnested_tables_free(hardnested_tables);
 
   // Disconnect device and exit
   nfc_close(r.pdi);
   nfc_exit(context);
-  exit(EXIT_SUCCESS);
-error:
-  nfc_close(r.pdi);
-  nfc_exit(context);
-  exit(EXIT_FAILURE);
+  exit(res);
 }
 
 void usage(FILE *stream, uint8_t errnr)
 {
-  fprintf(stream, "Usage: mfoc-hardnested [-h] [-C] [-F] [-k key] [-f file] ... [-P probnum] [-T tolerance] [-O output]\n");
+  fprintf(stream, "Usage: mfoc-hardnested [-h] [-C] [-F] [-Z] [-B] [-S] [-N readers] [-k key] [-f file] ... [-P probnum] [-T tolerance] [-R risk] [-O output]\n");
   fprintf(stream, "\n");
   fprintf(stream, "  h     print this help and exit\n");
   fprintf(stream, "  C     skip testing default keys\n");
   fprintf(stream, "  F     force the hardnested keys extraction\n");
   fprintf(stream, "  Z     reduce memory usage\n");
+  fprintf(stream, "  B     brute force hardnested keys in the background while acquiring nonces for the next sector\n");
+  fprintf(stream, "  S     start brute forcing hardnested keys speculatively while still acquiring their nonces\n");
+  fprintf(stream, "  N     fleet mode: recover the cards presented to up to this number of readers, concurrently\n");
   fprintf(stream, "  k     try the specified key in addition to the default keys\n");
   fprintf(stream, "  f     parses a file of keys to add in addition to the default keys \n");    
   fprintf(stream, "  P     number of probes per sector, instead of default of 20\n");
   fprintf(stream, "  T     nonce tolerance half-range, instead of default of 20\n        (i.e., 40 for the total range, in both directions)\n");
-  fprintf(stream, "  O     file in which the card contents will be written\n");
+  fprintf(stream, "  R     also check the Sum(a8) of secondary first bytes against the hardnested candidates, excluding\n        the key with at most this probability (e.g. 0.01)\n");
+  fprintf(stream, "  O     file in which the card contents will be written\n        (fleet mode: one file per card, named <output>-<UID>.mfd)\n");
   fprintf(stream, "\n");
   fprintf(stream, "Example: mfoc-hardnested -O mycard.mfd\n");
   fprintf(stream, "Example: mfoc-hardnested -k ffffeeeedddd -O mycard.mfd\n");
   fprintf(stream, "Example: mfoc-hardnested -f keys.txt -O mycard.mfd\n");
   fprintf(stream, "Example: mfoc-hardnested -P 50 -T 30 -O mycard.mfd\n");
+  fprintf(stream, "Example: mfoc-hardnested -N 4 -B -O cards\n");
   fprintf(stream, "\n");
   fprintf(stream, "This is mfoc-hardnested version %s.\n", PACKAGE_VERSION);
   exit(errnr);
@@ -845,51 +1053,52 @@ void mf_init(mfreader *r)
   }
 }
 
-void mf_configure(nfc_device *pdi)
+// Returns false if the reader can't be configured, e.g. because it has been unplugged
+bool mf_configure(nfc_device *pdi)
 {
   if (nfc_initiator_init(pdi) < 0) {
     nfc_perror(pdi, "nfc_initiator_init");
-    exit(EXIT_FAILURE);
+    return false;
   }
   // Drop the field for a while, so can be reset
   if (nfc_device_set_property_bool(pdi, NP_ACTIVATE_FIELD, false) < 0) {
     nfc_perror(pdi, "nfc_device_set_property_bool activate field");
-    exit(EXIT_FAILURE);
+    return false;
   }
   // Let the reader only try once to find a tag
   if (nfc_device_set_property_bool(pdi, NP_INFINITE_SELECT, false) < 0) {
     nfc_perror(pdi, "nfc_device_set_property_bool infinite select");
-    exit(EXIT_FAILURE);
+    return false;
   }
   // Configure the CRC and Parity settings
   if (nfc_device_set_property_bool(pdi, NP_HANDLE_CRC, true) < 0) {
     nfc_perror(pdi, "nfc_device_set_property_bool crc");
-    exit(EXIT_FAILURE);
+    return false;
   }
   if (nfc_device_set_property_bool(pdi, NP_HANDLE_PARITY, true) < 0) {
     nfc_perror(pdi, "nfc_device_set_property_bool parity");
-    exit(EXIT_FAILURE);
+    return false;
   }
   // Disable ISO14443-4 switching in order to read devices that emulate Mifare Classic with ISO14443-4 compliance.
   if (nfc_device_set_property_bool(pdi, NP_AUTO_ISO14443_4, false) < 0) {
     nfc_perror(pdi, "nfc_device_set_property_bool");
-    exit(EXIT_FAILURE);
+    return false;
   }
   // Enable the field so more power consuming cards can power themselves up
   if (nfc_device_set_property_bool(pdi, NP_ACTIVATE_FIELD, true) < 0) {
     nfc_perror(pdi, "nfc_device_set_property_bool activate field");
-    exit(EXIT_FAILURE);
+    return false;
   }
+  return true;
 }
 
-void mf_select_tag(nfc_device *pdi, nfc_target *pnt)
+bool mf_select_tag(nfc_device *pdi, nfc_target *pnt)
 {
   if (nfc_initiator_select_passive_target(pdi, nm, NULL, 0, pnt) < 0) {
     ERR("Unable to connect to the MIFARE Classic tag");
-    nfc_close(pdi);
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
+    return false;
   }
+  return true;
 }
 
 int trailer_block(uint32_t block)
@@ -926,21 +1135,24 @@ int find_exploit_sector(mftag t)
       return i;
     }
   }
-  ERR("\n\nNo sector encrypted with the default key has been found, exiting..");
-  exit(EXIT_FAILURE);
+  ERR("\n\nNo sector encrypted with the default key has been found");
+  return -2;
 }
 
-void mf_anticollision(mftag t, mfreader r)
+// Returns false if the tag has been removed. Only the card is given up then, the other readers go on.
+bool mf_anticollision(mftag t, mfreader r)
 {
   if (nfc_initiator_select_passive_target(r.pdi, nm, NULL, 0, &t.nt) < 0) {
     nfc_perror(r.pdi, "nfc_initiator_select_passive_target");
     ERR("Tag has been removed");
-    exit(EXIT_FAILURE);
+    return false;
   }
+  return true;
 }
 
 
-bool
+// Returns 1 for a Mifare Plus 2k, 0 for other tags and -1 if the tag has disappeared
+int
 get_rats_is_2k(mftag t, mfreader r)
 {
   int res;
@@ -949,26 +1161,24 @@ get_rats_is_2k(mftag t, mfreader r)
   // Use raw send/receive methods
   if (nfc_device_set_property_bool(r.pdi, NP_EASY_FRAMING, false) < 0) {
     nfc_perror(r.pdi, "nfc_configure");
-    return false;
+    return 0;
   }
   res = nfc_initiator_transceive_bytes(r.pdi, abtRats, sizeof(abtRats), abtRx, sizeof(abtRx), 0);
   if (res > 0) {
     // ISO14443-4 card, turn RF field off/on to access ISO14443-3 again
     if (nfc_device_set_property_bool(r.pdi, NP_ACTIVATE_FIELD, false) < 0) {
       nfc_perror(r.pdi, "nfc_configure");
-      return false;
+      return 0;
     }
     if (nfc_device_set_property_bool(r.pdi, NP_ACTIVATE_FIELD, true) < 0) {
       nfc_perror(r.pdi, "nfc_configure");
-      return false;
+      return 0;
     }
   }
   // Reselect tag
   if (nfc_initiator_select_passive_target(r.pdi, nm, NULL, 0, &t.nt) <= 0) {
     printf("Error: tag disappeared\n");
-    nfc_close(r.pdi);
-    nfc_exit(context);
-    exit(EXIT_FAILURE);
+    return -1;
   }
   if (res >= 10) {
     printf("ATS %02X%02X%02X%02X%02X|%02X%02X%02X%02X%02X\n", res, abtRx[0], abtRx[1], abtRx[2], abtRx[3], abtRx[4], abtRx[5], abtRx[6], abtRx[7], abtRx[8]);
@@ -977,20 +1187,166 @@ get_rats_is_2k(mftag t, mfreader r)
             && ((t.nt.nti.nai.abtAtqa[1] & 0x02) == 0x00));
   } else {
     printf("ATS len = %d\n", res);
-    return false;
+    return 0;
   }
 }
 
-int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d, pKeys *pk, char mode, bool dumpKeysA, uint32_t *NtEncBytes, uint8_t* parBits)
+// One candidate tag nonce of a nested authentication and the keys recovered from it
+typedef struct {
+  uint32_t ks1;
+  uint32_t in;
+  uint64_t *keys;
+  uint32_t num_keys;
+} nt_probe_task;
+
+// lfsr_recovery32 tables, about 60 MB each. A recovery takes one from the free list and puts it back when done, so
+// there are only as many as recoveries have run at once, only one with -Z. The nested runner releases them, and the
+// scratch of the parallel recoveries, when its queue has drained
+typedef struct recovery_workspace {
+  struct lfsr_recovery32_workspace *ws;
+  struct recovery_workspace *next;
+} recovery_workspace_t;
+
+static pthread_mutex_t workspace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workspace_returned = PTHREAD_COND_INITIALIZER;
+static recovery_workspace_t *free_workspaces = NULL;
+static uint32_t num_workspaces = 0; // including the ones in use
+
+static void recovery_workspaces_free(void)
 {
-  struct Crypto1State *pcs;
-  struct Crypto1State *revstate;
-  struct Crypto1State *revstate_start;
+  pthread_mutex_lock(&workspace_mutex);
+  while (free_workspaces != NULL) {
+    recovery_workspace_t *workspace = free_workspaces;
+    free_workspaces = workspace->next;
+    lfsr_recovery32_workspace_destroy(workspace->ws);
+    free(workspace);
+    num_workspaces--;
+  }
+  pthread_mutex_unlock(&workspace_mutex);
+  lfsr_recovery32_release();
+}
 
-  uint64_t lfsr;
+static void *
+#ifdef __has_attribute
+#if __has_attribute(force_align_arg_pointer)
+__attribute__((force_align_arg_pointer))
+#endif
+#endif
+nt_probe_recover(void *arg)
+{
+  nt_probe_task *probe = (nt_probe_task *) arg;
+  pthread_mutex_lock(&workspace_mutex);
+  while (free_workspaces == NULL && hard_low_memory && num_workspaces != 0) {
+    pthread_cond_wait(&workspace_returned, &workspace_mutex);
+  }
+  recovery_workspace_t *workspace = free_workspaces;
+  if (workspace != NULL) {
+    free_workspaces = workspace->next;
+  } else {
+    num_workspaces++;
+  }
+  pthread_mutex_unlock(&workspace_mutex);
+  if (workspace == NULL) {
+    if ((workspace = malloc(sizeof(recovery_workspace_t))) == NULL || (workspace->ws = lfsr_recovery32_workspace_create()) == NULL) {
+      ERR("Cannot allocate memory for lfsr_recovery32");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  struct Crypto1State *revstate = lfsr_recovery32_ws(probe->ks1, probe->in, workspace->ws);
+  if (revstate == NULL) {
+    ERR("Cannot allocate memory for lfsr_recovery32");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t num_keys = 0;
+  while ((revstate[num_keys].odd != 0x0) || (revstate[num_keys].even != 0x0)) {
+    num_keys++;
+  }
+  probe->keys = (uint64_t *) malloc((num_keys + 1) * sizeof(uint64_t));
+  if (probe->keys == NULL) {
+    ERR("Memory allocation error for the recovered keys");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < num_keys; i++) {
+    lfsr_rollback_word(&revstate[i], probe->in, 0);
+    crypto1_get_lfsr(&revstate[i], &probe->keys[i]);
+  }
+  probe->num_keys = num_keys;
+
+  pthread_mutex_lock(&workspace_mutex);
+  workspace->next = free_workspaces;
+  free_workspaces = workspace;
+  pthread_cond_signal(&workspace_returned);
+  pthread_mutex_unlock(&workspace_mutex);
+  return NULL;
+}
 
+// Recover the candidate keys for a captured nested nonce and append them to pk
+void nested_recover(const nestedNonce *nonce, uint32_t tolerance, uint32_t authuid, pKeys *pk)
+{
   // Possible key counter, just continue with a previous "session"
   uint32_t kcount = pk->size;
+  uint32_t NtProbe, Ks1, m;
+  uint64_t lfsr;
+
+  // Iterate over Nt-x, Nt+x
+  // fprintf(stdout, "Iterate from %d to %d\n", nonce->median-tolerance, nonce->median+tolerance);
+  nt_probe_task *probes = (nt_probe_task *) malloc((tolerance + 1) * sizeof(nt_probe_task));
+  if (probes == NULL) {
+    ERR("Memory allocation error for the nonce probes");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t num_probes = 0;
+  NtProbe = prng_successor(nonce->nt, nonce->median - tolerance);
+  for (m = nonce->median - tolerance; m <= nonce->median + tolerance; m += 2) {
+
+    // Try to recover the keystream1
+    Ks1 = nonce->nt_enc ^ NtProbe;
+
+    // Skip this nonce after invalid 3b parity check
+    if (valid_nonce(NtProbe, nonce->nt_enc, Ks1, (uint8_t *) nonce->parity)) {
+      probes[num_probes].ks1 = Ks1;
+      probes[num_probes].in = NtProbe ^ authuid;
+      num_probes++;
+    }
+    NtProbe = prng_successor(NtProbe, 2);
+  }
+
+  // And finally recover the first 32 bits of the key. The probes are independent, recover them in parallel
+  hardnested_pool_run(nt_probe_recover, probes, sizeof(nt_probe_task), num_probes);
+
+  for (uint32_t probe = 0; probe < num_probes; probe++) {
+    for (uint32_t key = 0; key < probes[probe].num_keys; key++) {
+      lfsr = probes[probe].keys[key];
+      // Allocate a new space for keys
+      if (((kcount % MEM_CHUNK) == 0) || (kcount >= pk->size)) {
+        pk->size += MEM_CHUNK;
+        // fprintf(stdout, "New chunk by %d, sizeof %lu\n", kcount, pk->size * sizeof(uint64_t));
+        pk->possibleKeys = (uint64_t *) realloc((void *)pk->possibleKeys, pk->size * sizeof(uint64_t));
+        if (pk->possibleKeys == NULL) {
+          ERR("Memory allocation error for pk->possibleKeys");
+          exit(EXIT_FAILURE);
+        }
+      }
+      pk->possibleKeys[kcount] = lfsr;
+      kcount++;
+    }
+    free(probes[probe].keys);
+  }
+  free(probes);
+  // Truncate
+  if (kcount != 0) {
+    pk->size = kcount;
+    if ((pk->possibleKeys = (uint64_t *) realloc((void *)pk->possibleKeys, pk->size * sizeof(uint64_t))) == NULL) {
+      ERR("Memory allocation error for pk->possibleKeys");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d, pKeys *pk, char mode, bool dumpKeysA, uint32_t *NtEncBytes, uint8_t* parBits)
+{
+  struct Crypto1State cs, *pcs = &cs;
 
   uint8_t Nr[4] = { 0x00, 0x00, 0x00, 0x00 }; // Reader nonce
   uint8_t Auth[4] = { 0x00, t.sectors[e_sector].trailer, 0x00, 0x00 };
@@ -1009,7 +1365,7 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
   uint8_t Rx[MAX_FRAME_LEN]; // Tag response
   uint8_t RxPar[MAX_FRAME_LEN]; // Tag response
 
-  uint32_t Nt, NtLast, NtProbe, NtEnc, Ks1;
+  uint32_t Nt, NtLast, NtEnc;
 
   int res;
   uint32_t m, i;
@@ -1027,24 +1383,24 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
   // We need full control over the CRC
   if (nfc_device_set_property_bool(r.pdi, NP_HANDLE_CRC, false) < 0)  {
     nfc_perror(r.pdi, "nfc_device_set_property_bool crc");
-    exit(EXIT_FAILURE);
+    return AUTH_TAG_LOST;
   }
 
   // Request plain tag-nonce
   // TODO: Set NP_EASY_FRAMING option only once if possible
   if (nfc_device_set_property_bool(r.pdi, NP_EASY_FRAMING, false) < 0) {
     nfc_perror(r.pdi, "nfc_device_set_property_bool framing");
-    exit(EXIT_FAILURE);
+    return AUTH_TAG_LOST;
   }
 
   if ((res = nfc_initiator_transceive_bytes(r.pdi, Auth, 4, Rx, sizeof(Rx), 0)) < 0) {
     fprintf(stdout, "Error while requesting plain tag-nonce, %d\n", res);
-    exit(EXIT_FAILURE);
+    return AUTH_TAG_LOST;
   }
 
   if (nfc_device_set_property_bool(r.pdi, NP_EASY_FRAMING, true) < 0) {
     nfc_perror(r.pdi, "nfc_device_set_property_bool");
-    exit(EXIT_FAILURE);
+    return AUTH_TAG_LOST;
   }
   // print_hex(Rx, res);
 
@@ -1053,9 +1409,9 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
 
   // Init the cipher with key {0..47} bits
   if (t.sectors[e_sector].foundKeyA) {
-    pcs = crypto1_create(bytes_to_num(t.sectors[e_sector].KeyA, 6));
+    crypto1_init(pcs, bytes_to_num(t.sectors[e_sector].KeyA, 6));
   } else {
-    pcs = crypto1_create(bytes_to_num(t.sectors[e_sector].KeyB, 6));
+    crypto1_init(pcs, bytes_to_num(t.sectors[e_sector].KeyB, 6));
   }
 
   // Load (plain) uid^nt into the cipher {48..79} bits
@@ -1081,15 +1437,15 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
   // Finally we want to send arbitrary parity bits
   if (nfc_device_set_property_bool(r.pdi, NP_HANDLE_PARITY, false) < 0) {
     nfc_perror(r.pdi, "nfc_device_set_property_bool parity");
-    exit(EXIT_FAILURE);
+    return AUTH_TAG_LOST;
   }
 
   // Transmit reader-answer
   // fprintf(stdout, "\t{Ar}:\t");
   // print_hex_par(ArEnc, 64, ArEncPar);
   if (((res = nfc_initiator_transceive_bits(r.pdi, ArEnc, 64, ArEncPar, Rx, sizeof(Rx), RxPar)) < 0) || (res != 32)) {
-    ERR("Reader-answer transfer error, exiting..");
-    exit(EXIT_FAILURE);
+    ERR("Reader-answer transfer error");
+    return AUTH_TAG_LOST;
   }
 
   // Now print the answer from the tag
@@ -1099,8 +1455,8 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
   // Decrypt the tag answer and verify that suc3(Nt) is At
   Nt = prng_successor(Nt, 32);
   if (!((crypto1_word(pcs, 0x00, 0) ^ bytes_to_num(Rx, 4)) == (Nt & 0xFFFFFFFF))) {
-    ERR("[At] is not Suc3(Nt), something is wrong, exiting..");
-    exit(EXIT_FAILURE);
+    ERR("[At] is not Suc3(Nt), something is wrong");
+    return AUTH_TAG_LOST;
   }
   // fprintf(stdout, "Authentication completed.\n\n");
 
@@ -1121,7 +1477,7 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
       // Sending the encrypted Auth command
       if ((res = nfc_initiator_transceive_bits(r.pdi, AuthEnc, 32, AuthEncPar, Rx, sizeof(Rx), RxPar)) < 0) {
         fprintf(stdout, "Error requesting encrypted tag-nonce\n");
-        exit(EXIT_FAILURE);
+        return AUTH_TAG_LOST;
       }
 
       // fprintf(stdout, "\t{AuthEnResp}:\t");
@@ -1129,16 +1485,16 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
 
       // Decrypt the encrypted auth
       if (t.sectors[e_sector].foundKeyA) {
-        pcs = crypto1_create(bytes_to_num(t.sectors[e_sector].KeyA, 6));
+        crypto1_init(pcs, bytes_to_num(t.sectors[e_sector].KeyA, 6));
       } else {
-        pcs = crypto1_create(bytes_to_num(t.sectors[e_sector].KeyB, 6));
+        crypto1_init(pcs, bytes_to_num(t.sectors[e_sector].KeyB, 6));
       }
       NtLast = bytes_to_num(Rx, 4) ^ crypto1_word(pcs, bytes_to_num(Rx, 4) ^ t.authuid, 1);
 
       // Make sure the card is using the known PRNG
       if (! validate_prng_nonce(NtLast)) {
            printf("Card is not vulnerable to nested attack\n");
-           return -99999;
+           return AUTH_NOT_VULNERABLE;
       }
       // Save the determined nonces distance
       d->distances[m] = nonce_distance(Nt, NtLast);
@@ -1161,13 +1517,13 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
       // print_hex_par(ArEnc, 64, ArEncPar);
 
       if (((res = nfc_initiator_transceive_bits(r.pdi, ArEnc, 64, ArEncPar, Rx, sizeof(Rx), RxPar)) < 0) || (res != 32)) {
-        ERR("Reader-answer transfer error, exiting..");
-        exit(EXIT_FAILURE);
+        ERR("Reader-answer transfer error");
+        return AUTH_TAG_LOST;
       }
       Nt = prng_successor(Nt, 32);
       if (!((crypto1_word(pcs, 0x00, 0) ^ bytes_to_num(Rx, 4)) == (Nt & 0xFFFFFFFF))) {
-        ERR("[At] is not Suc3(Nt), something is wrong, exiting..");
-        exit(EXIT_FAILURE);
+        ERR("[At] is not Suc3(Nt), something is wrong");
+        return AUTH_TAG_LOST;
       }
 
       // Now print the answer from the tag
@@ -1180,8 +1536,8 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
     // fprintf(stdout, "Median: %05d\n", d->median);
   } // The end of Get Distances mode
 
-  // If we are in "Get Recovery" mode
-  if (mode == 'r') {
+  // If we are in "Get Recovery" or "Capture" mode
+  if (mode == 'r' || mode == 'c') {
     // Again, prepare the Auth command with MC_AUTH_A, recover the block and CRC
     Auth[0] = dumpKeysA ? MC_AUTH_A : MC_AUTH_B;
     Auth[1] = a_sector;
@@ -1195,18 +1551,18 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
     }
     if (nfc_initiator_transceive_bits(r.pdi, AuthEnc, 32, AuthEncPar, Rx, sizeof(Rx), RxPar) < 0) {
       ERR("while requesting encrypted tag-nonce");
-      exit(EXIT_FAILURE);
+      return AUTH_TAG_LOST;
     }
 
     // Finally we want to send arbitrary parity bits
     if (nfc_device_set_property_bool(r.pdi, NP_HANDLE_PARITY, true) < 0)  {
       nfc_perror(r.pdi, "nfc_device_set_property_bool parity restore M");
-      exit(EXIT_FAILURE);
+      return AUTH_TAG_LOST;
     }
 
     if (nfc_device_set_property_bool(r.pdi, NP_HANDLE_CRC, true) < 0)  {
       nfc_perror(r.pdi, "nfc_device_set_property_bool crc restore M");
-      exit(EXIT_FAILURE);
+      return AUTH_TAG_LOST;
     }
 
     // Save the encrypted nonce
@@ -1217,51 +1573,15 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
       d->parity[i] = (oddparity(Rx[i]) != RxPar[i]);
     }
 
-    // Iterate over Nt-x, Nt+x
-    // fprintf(stdout, "Iterate from %d to %d\n", d->median-d->tolerance, d->median+d->tolerance);
-    NtProbe = prng_successor(Nt, d->median - d->tolerance);
-    for (m = d->median - d->tolerance; m <= d->median + d->tolerance; m += 2) {
-
-      // Try to recover the keystream1
-      Ks1 = NtEnc ^ NtProbe;
-
-      // Skip this nonce after invalid 3b parity check
-      revstate_start = NULL;
-      if (valid_nonce(NtProbe, NtEnc, Ks1, d->parity)) {
-        // And finally recover the first 32 bits of the key
-        revstate = lfsr_recovery32(Ks1, NtProbe ^ t.authuid);
-        if (revstate_start == NULL) {
-          revstate_start = revstate;
-        }
-        while ((revstate->odd != 0x0) || (revstate->even != 0x0)) {
-          lfsr_rollback_word(revstate, NtProbe ^ t.authuid, 0);
-          crypto1_get_lfsr(revstate, &lfsr);
-          // Allocate a new space for keys
-          if (((kcount % MEM_CHUNK) == 0) || (kcount >= pk->size)) {
-            pk->size += MEM_CHUNK;
-            // fprintf(stdout, "New chunk by %d, sizeof %lu\n", kcount, pk->size * sizeof(uint64_t));
-            pk->possibleKeys = (uint64_t *) realloc((void *)pk->possibleKeys, pk->size * sizeof(uint64_t));
-            if (pk->possibleKeys == NULL) {
-              ERR("Memory allocation error for pk->possibleKeys");
-              exit(EXIT_FAILURE);
-            }
-          }
-          pk->possibleKeys[kcount] = lfsr;
-          kcount++;
-          revstate++;
-        }
-        free(revstate_start);
-      }
-      NtProbe = prng_successor(NtProbe, 2);
-    }
-    // Truncate
-    if (kcount != 0) {
-      pk->size = --kcount;
-      if ((pk->possibleKeys = (uint64_t *) realloc((void *)pk->possibleKeys, pk->size * sizeof(uint64_t))) == NULL) {
-        ERR("Memory allocation error for pk->possibleKeys");
-        exit(EXIT_FAILURE);
-      }
+    // Capture mode, keep the nonce to verify candidate keys offline
+    if (mode == 'c') {
+      d->nt = Nt;
+      d->nt_enc = NtEnc;
+      return 0;
     }
+
+    nestedNonce nonce = {Nt, NtEnc, d->median, {d->parity[0], d->parity[1], d->parity[2]}};
+    nested_recover(&nonce, d->tolerance, t.authuid, pk);
   }
 
   if (mode == 'h') {
@@ -1278,7 +1598,7 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
     }
     if ((( res = nfc_initiator_transceive_bits(r.pdi, AuthEnc, 32, AuthEncPar, Rx, sizeof (Rx), RxPar)) < 0) || (res != 32)){
         ERR("while requesting encrypted tag-nonce");
-        exit(EXIT_FAILURE);
+        return AUTH_TAG_LOST;
     }
     
     // Save the encrypted nonce
@@ -1297,15 +1617,20 @@ int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d
       
   }
   
-  crypto1_destroy(pcs);
   return 0;
 }
 
+static int compar_distance(const void *a, const void *b)
+{
+  uint32_t da = *(const uint32_t *)a, db = *(const uint32_t *)b;
+  return (da > db) - (da < db);
+}
+
 // Return the median value from the nonce distances array
 uint32_t median(denonce d)
 {
   int middle = (int) d.num_distances / 2;
-  qsort(d.distances, d.num_distances, sizeof(uint32_t), compar_int);
+  qsort(d.distances, d.num_distances, sizeof(uint32_t), compar_distance);
 
   if (d.num_distances % 2 == 1) {
     // Odd number of elements
@@ -1318,7 +1643,8 @@ uint32_t median(denonce d)
 
 int compar_int(const void *a, const void *b)
 {
-  return (*(uint64_t *)b - * (uint64_t *)a);
+  uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+  return (kb > ka) - (kb < ka);
 }
 
 // Compare countKeys structure
@@ -1327,32 +1653,526 @@ int compar_special_int(const void *a, const void *b)
   return (((countKeys *)b)->count - ((countKeys *)a)->count);
 }
 
-countKeys *uniqsort(uint64_t *possibleKeys, uint32_t size)
+#define AGG_KEYS_INITIAL_SIZE   (1 << 16)
+
+void agg_keys_init(aggKeys *ak)
+{
+  ak->slots = NULL;
+  ak->capacity = 0;
+  ak->size = 0;
+  ak->num_top = 0;
+}
+
+void agg_keys_free(aggKeys *ak)
+{
+  free(ak->slots);
+  agg_keys_init(ak);
+}
+
+// Open addressing with linear probing. Returns the slot of key, or the free slot where it belongs
+static uint32_t agg_keys_slot(const countKeys *slots, uint32_t capacity, uint64_t key)
+{
+  uint32_t mask = capacity - 1;
+  uint32_t i = (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+  while (slots[i].count != 0 && slots[i].key != key) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static void agg_keys_grow(aggKeys *ak)
+{
+  uint32_t capacity = ak->capacity ? ak->capacity * 2 : AGG_KEYS_INITIAL_SIZE;
+  countKeys *slots = calloc(capacity, sizeof(countKeys));
+  if (slots == NULL) {
+    ERR("Memory allocation error for the key candidates");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < ak->capacity; i++) {
+    if (ak->slots[i].count != 0) {
+      slots[agg_keys_slot(slots, capacity, ak->slots[i].key)] = ak->slots[i];
+    }
+  }
+  free(ak->slots);
+  ak->slots = slots;
+  ak->capacity = capacity;
+}
+
+// Keep ak->top sorted by count. Only keys whose count went up need to be offered.
+static void agg_keys_update_top(aggKeys *ak, uint64_t key, int count)
+{
+  if (ak->num_top == TRY_KEYS && count <= ak->top[TRY_KEYS - 1].count) {
+    return;
+  }
+  uint32_t i = 0;
+  while (i < ak->num_top && ak->top[i].key != key) {
+    i++;
+  }
+  if (i == ak->num_top) {
+    if (ak->num_top < TRY_KEYS) {
+      ak->num_top++;
+    } else {
+      i = TRY_KEYS - 1;
+    }
+  }
+  while (i > 0 && ak->top[i - 1].count < count) {
+    ak->top[i] = ak->top[i - 1];
+    i--;
+  }
+  ak->top[i].key = key;
+  ak->top[i].count = count;
+}
+
+// Count one vote for each of the keys. Rejected keys keep a negative count and never get back into the top list.
+void agg_keys_add(aggKeys *ak, const uint64_t *keys, uint32_t num_keys)
+{
+  for (uint32_t k = 0; k < num_keys; k++) {
+    if ((ak->size + 1) * 4 > ak->capacity * 3) {
+      agg_keys_grow(ak);
+    }
+    countKeys *slot = &ak->slots[agg_keys_slot(ak->slots, ak->capacity, keys[k])];
+    if (slot->count == 0) {
+      slot->key = keys[k];
+      ak->size++;
+    }
+    if (slot->count < 0) {
+      slot->count--;
+    } else {
+      slot->count++;
+      agg_keys_update_top(ak, slot->key, slot->count);
+    }
+  }
+}
+
+// The key failed to authenticate. Drop it from the top list, agg_keys_rank() fills the list up again.
+void agg_keys_reject(aggKeys *ak, uint64_t key)
+{
+  if (ak->capacity == 0) {
+    return;
+  }
+  countKeys *slot = &ak->slots[agg_keys_slot(ak->slots, ak->capacity, key)];
+  if (slot->count <= 0) {
+    return;
+  }
+  slot->count = -slot->count;
+  for (uint32_t i = 0; i < ak->num_top; i++) {
+    if (ak->top[i].key == key) {
+      memmove(&ak->top[i], &ak->top[i + 1], (ak->num_top - i - 1) * sizeof(countKeys));
+      ak->num_top--;
+      break;
+    }
+  }
+}
+
+// Rebuild the top list from all untried candidates
+void agg_keys_rank(aggKeys *ak)
+{
+  ak->num_top = 0;
+  for (uint32_t i = 0; i < ak->capacity; i++) {
+    if (ak->slots[i].count > 0) {
+      agg_keys_update_top(ak, ak->slots[i].key, ak->slots[i].count);
+    }
+  }
+}
+
+// Check which keys could have produced the captured nested nonce: the tag nonce is one of the candidates around the
+// median distance, and it must encrypt to the captured nonce with the key. The keys are run through the cipher in
+// bitsliced batches of CRYPTO1_BATCH_SIZE. Matching keys are moved to the front of keys, returns their number
+uint32_t verify_nested_keys(uint64_t *keys, uint32_t num_keys, const nestedNonce *nonce, uint32_t tolerance, uint32_t authuid)
+{
+  struct Crypto1Batch key_states, s;
+  uint64_t in[32], ks[32];
+  uint32_t num_verified = 0;
+
+  for (uint32_t first = 0; first < num_keys; first += CRYPTO1_BATCH_SIZE) {
+    uint32_t n = MIN(num_keys - first, CRYPTO1_BATCH_SIZE);
+    crypto1_init_batch(&key_states, keys + first, n);
+    uint64_t matched = 0; // one bit per key
+
+    uint32_t NtProbe = prng_successor(nonce->nt, nonce->median - tolerance);
+    for (uint32_t m = nonce->median - tolerance; m <= nonce->median + tolerance; m += 2) {
+      uint32_t Ks1 = nonce->nt_enc ^ NtProbe;
+      if (valid_nonce(NtProbe, nonce->nt_enc, Ks1, (uint8_t *) nonce->parity)) {
+        // all keys get the same input, and their keystream is compared with the same Ks1
+        s = key_states;
+        for (uint32_t k = 0; k < 32; k++) {
+          in[k] = -(uint64_t) BIT(NtProbe ^ authuid, k);
+        }
+        crypto1_word_batch(&s, in, ks, 0);
+        uint64_t mismatch = 0;
+        for (uint32_t k = 0; k < 32; k++) {
+          mismatch |= ks[k] ^ -(uint64_t) BIT(Ks1, k);
+        }
+        matched |= ~mismatch;
+      }
+      NtProbe = prng_successor(NtProbe, 2);
+    }
+
+    for (uint32_t j = 0; j < n; j++) {
+      if (matched >> j & 1) {
+        uint64_t key = keys[first + j];
+        keys[first + j] = keys[num_verified];
+        keys[num_verified++] = key;
+      }
+    }
+  }
+  return num_verified;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// pipelined nested attack
+// The reader only measures distances and captures encrypted nonces. Recovering the candidate keys from a nonce is a
+// job on a background runner, so that the reader can go on with the next sectors meanwhile. A job keeps the candidates
+// which also match a verification nonce of its sector. Once all jobs of a sector are done, these are tried online.
+
+typedef struct nested_job {
+  nested_target_t *target;
+  nestedNonce nonce;
+  uint32_t authuid;
+  struct nested_job *next;
+} nested_job_t;
+
+static pthread_once_t nested_runner_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t nested_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nested_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t nested_done = PTHREAD_COND_INITIALIZER;
+static nested_job_t *nested_queue = NULL;
+
+static void nested_job_run(nested_job_t *job)
+{
+  nested_target_t *target = job->target;
+  pKeys pk = {NULL, 0};
+  uint32_t num_verified = 0;
+
+  nested_recover(&job->nonce, target->tolerance, job->authuid, &pk);
+  // a key only has to match one of the verification nonces
+  for (uint32_t v = 0; v < target->num_verify_nonces; v++) {
+    num_verified += verify_nested_keys(pk.possibleKeys + num_verified, pk.size - num_verified, &target->verify_nonces[v],
+                                       target->tolerance, job->authuid);
+  }
+  pthread_mutex_lock(&nested_mutex);
+  agg_keys_add(&target->ak, pk.possibleKeys, num_verified);
+  target->pending--;
+  pthread_cond_broadcast(&nested_done);
+  pthread_mutex_unlock(&nested_mutex);
+  free(pk.possibleKeys);
+}
+
+static void *
+#ifdef __has_attribute
+#if __has_attribute(force_align_arg_pointer)
+__attribute__((force_align_arg_pointer))
+#endif
+#endif
+nested_runner_thread(void *arg)
 {
-  unsigned int i, j = 0;
-  int count = 0;
-  countKeys *our_counts;
+  (void) arg;
+  while (true) {
+    pthread_mutex_lock(&nested_mutex);
+    if (nested_queue == NULL) {
+      // nothing left to recover for now, give the memory of the recoveries back
+      pthread_mutex_unlock(&nested_mutex);
+      recovery_workspaces_free();
+      pthread_mutex_lock(&nested_mutex);
+    }
+    while (nested_queue == NULL) {
+      pthread_cond_wait(&nested_work, &nested_mutex);
+    }
+    nested_job_t *job = nested_queue;
+    nested_queue = job->next;
+    pthread_mutex_unlock(&nested_mutex);
+    nested_job_run(job);
+    free(job);
+  }
+  return NULL;
+}
 
-  qsort(possibleKeys, size, sizeof(uint64_t), compar_int);
+static void nested_start_runner(void)
+{
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, nested_runner_thread, NULL)) {
+    ERR("Cannot start the nested recovery thread");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(thread);
+}
 
-  our_counts = calloc(size, sizeof(countKeys));
-  if (our_counts == NULL) {
-    ERR("Memory allocation error for our_counts");
+nested_target_t *nested_target_add(nested_target_t **targets, int sector, bool dumpKeysA)
+{
+  nested_target_t *target = calloc(1, sizeof(nested_target_t));
+  if (target == NULL) {
+    ERR("Cannot allocate memory for nested target");
     exit(EXIT_FAILURE);
   }
+  target->sector = sector;
+  target->dumpKeysA = dumpKeysA;
+  agg_keys_init(&target->ak);
+  pthread_mutex_lock(&nested_mutex);
+  target->next = *targets;
+  *targets = target;
+  pthread_mutex_unlock(&nested_mutex);
+  return target;
+}
+
+static bool nested_capture_nonce(int e_sector, nested_target_t *target, denonce *d, pKeys *pk, nestedNonce *nonce)
+{
+  if (mf_enhanced_auth(e_sector, t.sectors[target->sector].trailer, t, r, d, pk, 'c', target->dumpKeysA, 0, 0) == AUTH_TAG_LOST) { // AUTH + Capture mode
+    return false;
+  }
+  nonce->nt = d->nt;
+  nonce->nt_enc = d->nt_enc;
+  nonce->median = d->median;
+  memcpy(nonce->parity, d->parity, sizeof(d->parity));
+  return mf_configure(r.pdi) && mf_anticollision(t, r);
+}
+
+// Capture one probe of the target, the distances in d must be fresh. The nonces are queued for recovery.
+// Returns false if the tag has been removed, the jobs queued so far stay with the target.
+bool nested_capture(nested_target_t *target, int e_sector, denonce *d, pKeys *pk)
+{
+  pthread_once(&nested_runner_once, nested_start_runner);
+  printf("Sector: %d, type %c, probe %d, distance %d ", target->sector, (target->dumpKeysA ? 'A' : 'B'), target->rounds, d->median);
+  target->tolerance = d->tolerance;
+
+  // Each probe gets its own verification nonces: if the distance of one of them is off, only this probe's candidates
+  // are lost. The jobs of the previous probe are all done (or cancelled) by now.
+  target->num_verify_nonces = 0;
+  while (target->num_verify_nonces < VERIFY_NONCES_NR) {
+    if (!nested_capture_nonce(e_sector, target, d, pk, &target->verify_nonces[target->num_verify_nonces])) {
+      return false;
+    }
+    target->num_verify_nonces++;
+  }
+
+  // We have 'sets' * 32b keystream of potential keys
+  for (int n = 0; n < sets; n++) {
+    nested_job_t *job = calloc(1, sizeof(nested_job_t));
+    if (job == NULL) {
+      ERR("Cannot allocate memory for nested job");
+      exit(EXIT_FAILURE);
+    }
+    if (!nested_capture_nonce(e_sector, target, d, pk, &job->nonce)) {
+      free(job);
+      return false;
+    }
+    job->target = target;
+    job->authuid = t.authuid;
+
+    pthread_mutex_lock(&nested_mutex);
+    nested_job_t **p = &nested_queue;
+    while (*p != NULL) {
+      p = &(*p)->next;
+    }
+    *p = job;
+    target->pending++;
+    pthread_cond_signal(&nested_work);
+    pthread_mutex_unlock(&nested_mutex);
+    fprintf(stdout, ".");
+    fflush(stdout);
+  }
+  fprintf(stdout, "\n");
+  target->rounds++;
+  return true;
+}
+
+bool nested_pending(nested_target_t *targets, int sector, bool dumpKeysA)
+{
+  for (nested_target_t *target = targets; target != NULL; target = target->next) {
+    if (target->sector == sector && target->dumpKeysA == dumpKeysA) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Try the verified candidates of a target on the card. Returns 1 when the key was found, 0 if not and -1 on reader errors.
+static int nested_apply(nested_target_t *target, const countKeys *ck, uint32_t num_ck, bKeys *bk)
+{
+  int j = target->sector;
+  bool dumpKeysA = target->dumpKeysA;
+  mifare_param mp, mtmp;
+  int res;
+
+  // Found in the meantime, e.g. by key reuse
+  if ((dumpKeysA && t.sectors[j].foundKeyA) || (!dumpKeysA && t.sectors[j].foundKeyB)) {
+    return 1;
+  }
+
+  memset(&mtmp, 0, sizeof(mtmp));
+  memcpy(mp.mpa.abtAuthUid, t.nt.nti.nai.abtUid + t.nt.nti.nai.szUidLen - 4, sizeof(mp.mpa.abtAuthUid));
+  for (uint32_t i = 0; i < num_ck; i++) {
+    // fprintf(stdout,"%d %llx\n",ck[i].count, ck[i].key);
+    // Set required authetication method
+    num_to_bytes(ck[i].key, 6, mp.mpa.abtKey);
+    if ((res = nfc_initiator_mifare_cmd(r.pdi, dumpKeysA ? MC_AUTH_A : MC_AUTH_B, t.sectors[j].trailer, &mp)) < 0) {
+      if (res != NFC_EMFCAUTHFAIL) {
+        nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
+        return -1;
+      }
+      if (!mf_anticollision(t, r)) {
+        return -1;
+      }
+    } else {
+      // Save all information about successfull authentization
+      bk->size++;
+      bk->brokenKeys = (uint64_t *) realloc((void *)bk->brokenKeys, bk->size * sizeof(uint64_t));
+      bk->brokenKeys[bk->size - 1] = bytes_to_num(mp.mpa.abtKey, sizeof(mp.mpa.abtKey));
+      if (dumpKeysA) {
+        memcpy(t.sectors[j].KeyA, mp.mpa.abtKey, sizeof(mp.mpa.abtKey));
+        t.sectors[j].foundKeyA = true;
+
+      } else {
+        memcpy(t.sectors[j].KeyB, mp.mpa.abtKey, sizeof(mp.mpa.abtKey));
+        t.sectors[j].foundKeyB = true;
+      }
+      fprintf(stdout, "Sector: %d, type %c\n", j, (dumpKeysA ? 'A' : 'B'));
+      fprintf(stdout, "  Found Key: %c [%012llx]\n", (dumpKeysA ? 'A' : 'B'),
+              bytes_to_num(mp.mpa.abtKey, 6));
+      // if we need KeyB for this sector, it should be revealed by a data read with KeyA
+      if (!t.sectors[j].foundKeyB) {
+        if ((res = nfc_initiator_mifare_cmd(r.pdi, MC_READ, t.sectors[j].trailer, &mtmp)) >= 0) {
+          fprintf(stdout, "  Data read with Key A revealed Key B: [%012llx] - checking Auth: ", bytes_to_num(mtmp.mpd.abtData + 10, sizeof(mtmp.mpa.abtKey)));
+          memcpy(mtmp.mpa.abtKey, mtmp.mpd.abtData + 10, sizeof(mtmp.mpa.abtKey));
+          memcpy(mtmp.mpa.abtAuthUid, t.nt.nti.nai.abtUid + t.nt.nti.nai.szUidLen - 4, sizeof(mtmp.mpa.abtAuthUid));
+          if ((nfc_initiator_mifare_cmd(r.pdi, MC_AUTH_B, t.sectors[j].trailer, &mtmp)) < 0) {
+            fprintf(stdout, "Failed!\n");
+            if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+              return -1;
+            }
+          } else {
+            fprintf(stdout, "OK\n");
+            memcpy(t.sectors[j].KeyB, mtmp.mpd.abtData + 10, sizeof(t.sectors[j].KeyB));
+            t.sectors[j].foundKeyB = true;
+            bk->size++;
+            bk->brokenKeys = (uint64_t *) realloc((void *)bk->brokenKeys, bk->size * sizeof(uint64_t));
+            bk->brokenKeys[bk->size - 1] = bytes_to_num(mtmp.mpa.abtKey, sizeof(mtmp.mpa.abtKey));
+          }
+        } else {
+          if (res != NFC_ERFTRANS) {
+            nfc_perror(r.pdi, "nfc_initiator_mifare_cmd");
+            return -1;
+          }
+          if (!mf_anticollision(t, r)) {
+            return -1;
+          }
+        }
+      }
+      if (!mf_configure(r.pdi) || !mf_anticollision(t, r)) {
+        return -1;
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void nested_target_free(nested_target_t *target)
+{
+  agg_keys_free(&target->ak);
+  free(target);
+}
 
-  for (i = 0; i < size; i++) {
-    if (possibleKeys[i + 1] == possibleKeys[i]) {
-      count++;
+// Drop the queued jobs of the target and wait for its running one. Call with nested_mutex held.
+static void nested_target_cancel(nested_target_t *target)
+{
+  for (nested_job_t **p = &nested_queue; *p != NULL;) {
+    nested_job_t *job = *p;
+    if (job->target == target) {
+      target->pending--;
+      *p = job->next;
+      free(job);
     } else {
-      our_counts[j].key = possibleKeys[i];
-      our_counts[j].count = count;
-      j++;
-      count = 0;
+      p = &job->next;
+    }
+  }
+  while (target->pending != 0) {
+    pthread_cond_wait(&nested_done, &nested_mutex);
+  }
+}
+
+// Handle one target which has verified candidates or whose jobs are all done: apply its key, or capture another probe.
+// Returns 1 if a target was handled, 0 if none is ready (or none is left when waiting) and -1 on errors.
+int nested_process(nested_target_t **targets, bool wait, int e_sector, denonce *d, pKeys *pk, bKeys *bk)
+{
+  nested_target_t *target = NULL;
+
+  pthread_mutex_lock(&nested_mutex);
+  while (true) {
+    nested_target_t **p;
+    for (p = targets; *p != NULL && (*p)->pending != 0 && (*p)->ak.num_top == 0; p = &(*p)->next);
+    if (*p != NULL) {
+      target = *p;
+      *p = target->next;
+      break;
+    }
+    if (*targets == NULL || !wait) {
+      break;
+    }
+    pthread_cond_wait(&nested_done, &nested_mutex);
+  }
+  pthread_mutex_unlock(&nested_mutex);
+
+  if (target == NULL) {
+    return 0;
+  }
+  // The candidates don't change while they are tried, only the list of a target with pending jobs grows
+  pthread_mutex_lock(&nested_mutex);
+  countKeys top[TRY_KEYS];
+  uint32_t num_top = target->ak.num_top;
+  memcpy(top, target->ak.top, sizeof(top));
+  pthread_mutex_unlock(&nested_mutex);
+  int res = nested_apply(target, top, num_top, bk);
+  pthread_mutex_lock(&nested_mutex);
+  for (uint32_t i = 0; res == 0 && i < num_top; i++) {
+    // Wrong key, don't try it again
+    agg_keys_reject(&target->ak, top[i].key);
+  }
+  if (res == 0 && target->pending != 0) {
+    // Wait for the remaining jobs
+    target->next = *targets;
+    *targets = target;
+    pthread_mutex_unlock(&nested_mutex);
+    return 1;
+  }
+  // Key found (or error), the remaining nonces of this target are not needed any more
+  nested_target_cancel(target);
+  agg_keys_rank(&target->ak);
+  pthread_mutex_unlock(&nested_mutex);
+
+  if (res == 0 && target->rounds < (uint32_t) probes) {
+    // Try to authenticate to exploit sector and determine distances (filling denonce.distances)
+    pthread_mutex_lock(&nested_mutex);
+    target->next = *targets;
+    *targets = target;
+    pthread_mutex_unlock(&nested_mutex);
+    if (mf_enhanced_auth(e_sector, 0, t, r, d, pk, 'd', target->dumpKeysA, 0, 0) == AUTH_TAG_LOST) { // AUTH + Get Distances mode
+      return -1;
     }
+    if (!mf_configure(r.pdi) || !mf_anticollision(t, r) || !nested_capture(target, e_sector, d, pk)) {
+      return -1;
+    }
+    return 1;
+  }
+  if (res == 0) {
+    // We haven't found any key, exiting
+    ERR("No success, maybe you should increase the probes");
+    res = -1;
+  }
+  nested_target_free(target);
+  return res;
+}
+
+// Drop the queued jobs of the targets, wait for the running ones and free the targets
+void nested_targets_free(nested_target_t **targets)
+{
+  pthread_mutex_lock(&nested_mutex);
+  while (*targets != NULL) {
+    nested_target_t *target = *targets;
+    nested_target_cancel(target);
+    *targets = target->next;
+    nested_target_free(target);
   }
-  qsort(our_counts, j, sizeof(countKeys), compar_special_int);
-  return (our_counts);
+  pthread_mutex_unlock(&nested_mutex);
 }
 
 
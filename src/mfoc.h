@@ -40,6 +40,13 @@
 // Number of sets with 32b keys
 #define DEFAULT_SETS_NR         5
 
+// Number of extra nested nonces captured per sector to verify candidate keys offline
+#define VERIFY_NONCES_NR        2
+
+// mf_enhanced_auth() results other than 0
+#define AUTH_NOT_VULNERABLE     -99999  // the card doesn't use the known PRNG
+#define AUTH_TAG_LOST           -1      // the exchange failed, e.g. the tag has been removed
+
 #define odd_parity(i) (( (i) ^ (i)>>1 ^ (i)>>2 ^ (i)>>3 ^ (i)>>4 ^ (i)>>5 ^ (i)>>6 ^ (i)>>7 ^ 1) & 0x01)
 
 typedef struct {
@@ -56,8 +63,17 @@ typedef struct {
   uint32_t       num_distances;
   uint32_t       tolerance;
   uint8_t        parity[3];              // used for 3 bits of parity information
+  uint32_t       nt;                     // plain tag nonce the last nested one follows
+  uint32_t       nt_enc;                 // last encrypted nested tag nonce
 } denonce;                                      // Revealed information about nonce
 
+typedef struct {
+  uint32_t       nt;
+  uint32_t       nt_enc;
+  uint32_t       median;
+  uint8_t        parity[3];
+} nestedNonce;                                  // Captured nested nonce, to verify candidate keys offline
+
 typedef struct {
   nfc_target	 nt;
   sector         *sectors;                // Allocate later, we do not know the number of sectors yet
@@ -86,25 +102,66 @@ typedef struct {
   int            count;
 } countKeys;
 
+// Vote count of candidate keys, an open addressing hash table. A free slot has count 0,
+// a rejected key a negative count. top holds the best untried candidates, highest count first.
+typedef struct {
+  countKeys      *slots;
+  uint32_t       capacity;
+  uint32_t       size;
+  countKeys      top[TRY_KEYS];
+  uint32_t       num_top;
+} aggKeys;
+
+
+// A sector attacked with the nested attack. Its captured nonces are recovered by background jobs.
+typedef struct nested_target {
+  int            sector;
+  bool           dumpKeysA;
+  uint32_t       tolerance;
+  uint32_t       rounds;                 // probes captured so far
+  uint32_t       pending;                // jobs not finished yet
+  nestedNonce    verify_nonces[VERIFY_NONCES_NR];
+  uint32_t       num_verify_nonces;
+  aggKeys        ak;                     // verified candidate keys
+  struct nested_target *next;
+} nested_target_t;
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
 
-extern mftag        t;
-extern mfreader    r;
+// The tag and reader of the calling thread. Each reader has its own in fleet mode.
+extern THREAD_LOCAL mftag        t;
+extern THREAD_LOCAL mfreader    r;
 
 
 void usage(FILE *stream, uint8_t errnr);
 void mf_init(mfreader *r);
-void mf_configure(nfc_device *pdi);
-void mf_select_tag(nfc_device *pdi, nfc_target *pnt);
+bool mf_configure(nfc_device *pdi);
+bool mf_select_tag(nfc_device *pdi, nfc_target *pnt);
 int trailer_block(uint32_t block);
 int find_exploit_sector(mftag t);
-void mf_anticollision(mftag t, mfreader r);
-bool get_rats_is_2k(mftag t, mfreader r);
+bool mf_anticollision(mftag t, mfreader r);
+int get_rats_is_2k(mftag t, mfreader r);
 int mf_enhanced_auth(int e_sector, int a_sector, mftag t, mfreader r, denonce *d, pKeys *pk, char mode, bool dumpKeysA, uint32_t *NtEncBytes, uint8_t* parBits);
 uint32_t median(denonce d);
 int compar_int(const void *a, const void *b);
 int valid_nonce(uint32_t Nt, uint32_t NtEnc, uint32_t Ks1, uint8_t *parity);
+uint32_t verify_nested_keys(uint64_t *keys, uint32_t num_keys, const nestedNonce *nonce, uint32_t tolerance, uint32_t authuid);
+void nested_recover(const nestedNonce *nonce, uint32_t tolerance, uint32_t authuid, pKeys *pk);
+nested_target_t *nested_target_add(nested_target_t **targets, int sector, bool dumpKeysA);
+bool nested_capture(nested_target_t *target, int e_sector, denonce *d, pKeys *pk);
+bool nested_pending(nested_target_t *targets, int sector, bool dumpKeysA);
+int nested_process(nested_target_t **targets, bool wait, int e_sector, denonce *d, pKeys *pk, bKeys *bk);
+void nested_targets_free(nested_target_t **targets);
 int compar_special_int(const void *a, const void *b);
-countKeys *uniqsort(uint64_t *possibleKeys, uint32_t size);
+void agg_keys_init(aggKeys *ak);
+void agg_keys_free(aggKeys *ak);
+void agg_keys_add(aggKeys *ak, const uint64_t *keys, uint32_t num_keys);
+void agg_keys_reject(aggKeys *ak, uint64_t key);
+void agg_keys_rank(aggKeys *ak);
 void num_to_bytes(uint64_t n, uint32_t len, uint8_t *dest);
 long long unsigned int bytes_to_num(uint8_t *src, uint32_t len);
 
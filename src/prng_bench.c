@@ -0,0 +1,74 @@
+/*  prng_bench.c
+
+        This program is free software; you can redistribute it and/or
+        modify it under the terms of the GNU General Public License
+        as published by the Free Software Foundation; either version 2
+        of the License, or (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+        MA  02110-1301, US
+ */
+/* Microbenchmark for prng_successor(). Compares the table lookup against the
+ * plain bit by bit stepping for the distances mfoc uses. Build with
+ * `make prng-bench`, it is not installed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "crapto1.h"
+#include "util_posix.h"
+
+#define CALLS   (1 << 20)
+
+static uint32_t prng_successor_stepped(uint32_t x, uint32_t n) {
+    x = (x >> 8 & 0xff00ff) | (x & 0xff00ff) << 8, x = x >> 16 | x << 16;
+    while (n--)
+        x = x >> 1 | (x >> 16 ^ x >> 18 ^ x >> 19 ^ x >> 21) << 31;
+    x = (x >> 8 & 0xff00ff) | (x & 0xff00ff) << 8, x = x >> 16 | x << 16;
+    return x;
+}
+
+int main(void) {
+    static const uint32_t distances[] = {2, 32, 160, 1024, 20000, 60000};
+    uint32_t nt = 0x01200145, x, y, calls;
+    uint64_t start, stepped_ms, table_ms;
+
+    // first call builds the tables, keep it out of the timing
+    if (prng_successor(nt, 16) != prng_successor_stepped(nt, 16)) {
+        printf("prng_successor() is broken\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("distance   stepped (ns/call)   table (ns/call)\n");
+    for (size_t i = 0; i < sizeof (distances) / sizeof (distances[0]); i++) {
+        // the stepped version gets fewer calls for long distances, it would take minutes otherwise
+        calls = CALLS / (distances[i] / 64 + 1);
+        x = nt;
+        start = msclock();
+        for (uint32_t j = 0; j < calls; j++) {
+            x = prng_successor_stepped(x, distances[i]);
+        }
+        stepped_ms = msclock() - start;
+        y = nt;
+        for (uint32_t j = 0; j < calls; j++) {
+            y = prng_successor(y, distances[i]);
+        }
+        if (x != y) {
+            printf("prng_successor() is broken for distance %u\n", distances[i]);
+            return EXIT_FAILURE;
+        }
+        start = msclock();
+        for (uint32_t j = 0; j < CALLS; j++) {
+            y = prng_successor(y, distances[i]);
+        }
+        table_ms = msclock() - start;
+        printf("%8u   %17.1f   %15.1f\n", distances[i], stepped_ms * 1e6 / calls, table_ms * 1e6 / CALLS);
+    }
+    return EXIT_SUCCESS;
+}